@@ -0,0 +1,153 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "server.hpp"
+#include "tcp.hpp"
+#include "util.hpp"
+
+// Runs a server and a client that does a single request per connection ("Connection: close")
+// and counts the heap allocations of the server thread per connection, i.e. what accepting,
+// serving and closing a connection costs. It also prints the slowest connections, because
+// allocations (and the page faults of fresh memory) show up in the tail latency.
+
+using namespace std::literals;
+
+static std::atomic<size_t> allocations { 0 };
+static thread_local bool countAllocations = false;
+
+void* operator new(size_t size)
+{
+    if (countAllocations) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (auto ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+static constexpr uint16_t port = 6972;
+static constexpr size_t warmupConnections = 100;
+static constexpr size_t numConnections = 20'000;
+
+static bool connection()
+{
+    const auto sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    ::sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+    if (::connect(sock, reinterpret_cast<::sockaddr*>(&addr), sizeof(addr)) != 0) {
+        ::close(sock);
+        return false;
+    }
+
+    static const auto req = "GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"s;
+    if (::send(sock, req.data(), req.size(), 0) != static_cast<ssize_t>(req.size())) {
+        ::close(sock);
+        return false;
+    }
+    // Read until the server closes the connection
+    char buf[1024];
+    size_t received = 0;
+    while (true) {
+        const auto n = ::recv(sock, buf, sizeof(buf), 0);
+        if (n < 0) {
+            ::close(sock);
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        received += n;
+    }
+    ::close(sock);
+    return received > 0;
+}
+
+static void client()
+{
+    // The first connections grow the session pool, buffers, etc.
+    for (size_t i = 0; i < warmupConnections; ++i) {
+        if (!connection()) {
+            slog::fatal("Error in warmup connection");
+            std::quick_exit(1);
+        }
+    }
+    // Give the server time to close the last connection
+    std::this_thread::sleep_for(100ms);
+
+    std::vector<double> durations;
+    durations.reserve(numConnections);
+    const auto allocsBefore = allocations.load();
+    for (size_t i = 0; i < numConnections; ++i) {
+        const auto start = std::chrono::steady_clock::now();
+        if (!connection()) {
+            slog::fatal("Error in connection");
+            std::quick_exit(1);
+        }
+        const auto end = std::chrono::steady_clock::now();
+        durations.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    }
+    std::this_thread::sleep_for(100ms);
+    const auto allocs = allocations.load() - allocsBefore;
+
+    std::sort(durations.begin(), durations.end());
+    slog::info("Connections: ", numConnections);
+    slog::info("Allocations per connection: ", static_cast<double>(allocs) / numConnections);
+    slog::info("Latency p50: ", durations[durations.size() / 2], "us, p99: ",
+        durations[durations.size() * 99 / 100], "us, max: ", durations.back(), "us");
+    // The server loop never terminates, so just leave without running any destructors
+    std::quick_exit(0);
+}
+
+int main()
+{
+    slog::init(slog::Severity::Info);
+
+    IoQueue io;
+    // Use the same features as htcpp would (see htcpp.cpp)
+    io.registerProvidedBuffers(4096, 1024);
+    io.registerFixedFiles(1024);
+
+    Config::Server config;
+    config.listenAddress = ::inet_addr("127.0.0.1");
+    config.listenPort = port;
+    config.accesLog = false;
+
+    Server<TcpConnectionFactory> server(
+        io, TcpConnectionFactory {}, [](const Request&, std::shared_ptr<Responder> responder) {
+            responder->respond(Response("OK"s));
+        },
+        config);
+    server.start();
+
+    std::thread t(client);
+    t.detach();
+
+    countAllocations = true;
+    io.run();
+    return 0;
+}
@@ -0,0 +1,151 @@
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "filecache.hpp"
+#include "hosthandler.hpp"
+#include "server.hpp"
+#include "tcp.hpp"
+#include "util.hpp"
+
+// Runs a server with a HostHandler that serves a single file and a client that does keep-alive GET
+// requests for it. It counts the heap allocations of the server thread per request, i.e. what
+// parsing, routing, the file cache lookup, building the response and the metrics cost.
+// Once the file is in the cache, this should be zero.
+
+using namespace std::literals;
+
+static std::atomic<size_t> allocations { 0 };
+static thread_local bool countAllocations = false;
+
+void* operator new(size_t size)
+{
+    if (countAllocations) {
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (auto ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+static constexpr uint16_t port = 6973;
+static constexpr size_t warmupRequests = 100;
+static constexpr size_t numRequests = 100'000;
+static constexpr auto fileContents = "OK"sv;
+
+static bool request(int sock)
+{
+    static const auto req = "GET /index.html HTTP/1.1\r\nHost: localhost\r\n"
+                            "User-Agent: getallocs\r\nAccept: */*\r\n\r\n"s;
+    if (::send(sock, req.data(), req.size(), 0) != static_cast<ssize_t>(req.size())) {
+        return false;
+    }
+    std::string resp;
+    char buf[1024];
+    while (true) {
+        const auto headerEnd = resp.find("\r\n\r\n");
+        if (headerEnd != std::string::npos
+            && resp.size() >= headerEnd + 4 + fileContents.size()) {
+            return resp.compare(0, 12, "HTTP/1.1 200") == 0;
+        }
+        const auto n = ::recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return false;
+        }
+        resp.append(buf, n);
+    }
+}
+
+static void client()
+{
+    const auto sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    ::sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+    if (::connect(sock, reinterpret_cast<::sockaddr*>(&addr), sizeof(addr)) != 0) {
+        slog::fatal("Could not connect: ", errnoToString(errno));
+        std::quick_exit(1);
+    }
+
+    // The first requests load the file, grow the arena, create the metrics, etc.
+    for (size_t i = 0; i < warmupRequests; ++i) {
+        if (!request(sock)) {
+            slog::fatal("Error in warmup request");
+            std::quick_exit(1);
+        }
+    }
+
+    const auto allocsBefore = allocations.load();
+    for (size_t i = 0; i < numRequests; ++i) {
+        if (!request(sock)) {
+            slog::fatal("Error in request");
+            std::quick_exit(1);
+        }
+    }
+    const auto allocs = allocations.load() - allocsBefore;
+
+    slog::info("Requests: ", numRequests);
+    slog::info("Allocations: ", allocs);
+    slog::info("Allocations per request: ", static_cast<double>(allocs) / numRequests);
+    // The server loop never terminates, so just leave without running any destructors
+    std::quick_exit(allocs == 0 ? 0 : 1);
+}
+
+int main()
+{
+    slog::init(slog::Severity::Info);
+
+    char dir[] = "/tmp/htcpp-getallocs-XXXXXX";
+    if (!::mkdtemp(dir)) {
+        slog::fatal("Could not create temporary directory: ", errnoToString(errno));
+        return 1;
+    }
+    const auto path = std::string(dir) + "/index.html";
+    std::ofstream(path) << fileContents;
+
+    IoQueue io;
+    // Use the same features as htcpp would (see htcpp.cpp)
+    io.registerProvidedBuffers(4096, 1024);
+    io.registerFixedFiles(1024);
+
+    FileCache fileCache(io);
+    Config::Service::Host host;
+    host.files.push_back({ *Pattern::create("/index.html"), path });
+    HostHandler handler(io, fileCache, { { "*", host } });
+
+    Config::Server config;
+    config.listenAddress = ::inet_addr("127.0.0.1");
+    config.listenPort = port;
+    config.accesLog = false;
+
+    Server<TcpConnectionFactory> server(io, TcpConnectionFactory {}, handler, config);
+    server.start();
+
+    std::thread t(client);
+    t.detach();
+
+    countAllocations = true;
+    io.run();
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "function.hpp"
+#include "server.hpp"
+#include "tcp.hpp"
+#include "util.hpp"
+
+// Runs a server and a client that does keep-alive requests against it and counts how often IO
+// handlers (Function) had to be allocated on the heap per request/response cycle.
+// This should be zero.
+
+using namespace std::literals;
+
+static constexpr uint16_t port = 6971;
+static constexpr size_t warmupRequests = 100;
+static constexpr size_t numRequests = 100'000;
+
+static bool request(int sock)
+{
+    static const auto req = "GET / HTTP/1.1\r\nHost: localhost\r\n\r\n"s;
+    if (::send(sock, req.data(), req.size(), 0) != static_cast<ssize_t>(req.size())) {
+        return false;
+    }
+    // The response body is always "OK"
+    std::string resp;
+    char buf[1024];
+    while (true) {
+        const auto headerEnd = resp.find("\r\n\r\n");
+        if (headerEnd != std::string::npos && resp.size() >= headerEnd + 4 + 2) {
+            return true;
+        }
+        const auto n = ::recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return false;
+        }
+        resp.append(buf, n);
+    }
+}
+
+static void client()
+{
+    const auto sock = ::socket(AF_INET, SOCK_STREAM, 0);
+    ::sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = ::inet_addr("127.0.0.1");
+    addr.sin_port = htons(port);
+    if (::connect(sock, reinterpret_cast<::sockaddr*>(&addr), sizeof(addr)) != 0) {
+        slog::fatal("Could not connect: ", errnoToString(errno));
+        std::quick_exit(1);
+    }
+
+    // The first requests set up the connection, grow buffers, etc.
+    for (size_t i = 0; i < warmupRequests; ++i) {
+        if (!request(sock)) {
+            slog::fatal("Error in warmup request");
+            std::quick_exit(1);
+        }
+    }
+
+    const auto allocsBefore = getFunctionHeapAllocations();
+    for (size_t i = 0; i < numRequests; ++i) {
+        if (!request(sock)) {
+            slog::fatal("Error in request");
+            std::quick_exit(1);
+        }
+    }
+    const auto allocs = getFunctionHeapAllocations() - allocsBefore;
+
+    slog::info("Requests: ", numRequests);
+    slog::info("Handler allocations: ", allocs);
+    slog::info("Handler allocations per request: ", static_cast<double>(allocs) / numRequests);
+    // The server loop never terminates, so just leave without running any destructors
+    std::quick_exit(allocs == 0 ? 0 : 1);
+}
+
+int main()
+{
+    slog::init(slog::Severity::Info);
+
+    IoQueue io;
+    // Use the same features as htcpp would (see htcpp.cpp)
+    io.registerProvidedBuffers(4096, 1024);
+    io.registerFixedFiles(1024);
+
+    Config::Server config;
+    config.listenAddress = ::inet_addr("127.0.0.1");
+    config.listenPort = port;
+    config.accesLog = false;
+    config.headerReadTimeoutMs = 10 * 1000;
+    config.keepAliveIdleTimeoutMs = 10 * 1000;
+
+    Server<TcpConnectionFactory> server(
+        io, TcpConnectionFactory {}, [](const Request&, std::shared_ptr<Responder> responder) {
+            responder->respond(Response("OK"s));
+        },
+        config);
+    server.start();
+
+    std::thread t(client);
+    t.detach();
+
+    io.run();
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <string_view>
+
+#include "http.hpp"
+#include "httptokenizer.hpp"
+#include "log.hpp"
+
+// Compares Request::parse (which needs the complete request header) with RequestParser.
+// If the header arrives in pieces, Request::parse has to be run again on everything received so
+// far, every time something new arrives, while RequestParser only looks at the new bytes.
+// RequestParser is run with every tokenizer implementation the CPU supports (see
+// httptokenizer.hpp) on header sets of different browsers.
+// At the end it compares looking up the headers the server needs per request with
+// HeaderMap::get and Request::getHeader.
+
+using namespace std::literals;
+
+// What Chrome sends for a subresource (~700 bytes)
+static const auto chromeRequest
+    = "GET /static/css/main.css?v=1c2f6e9 HTTP/1.1\r\n"
+      "Host: www.example.org\r\n"
+      "Connection: keep-alive\r\n"
+      "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+      "sec-ch-ua-mobile: ?0\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+      "Chrome/124.0.0.0 Safari/537.36\r\n"
+      "sec-ch-ua-platform: \"Linux\"\r\n"
+      "Accept: text/css,*/*;q=0.1\r\n"
+      "Sec-Fetch-Site: same-origin\r\n"
+      "Sec-Fetch-Mode: no-cors\r\n"
+      "Sec-Fetch-Dest: style\r\n"
+      "Referer: https://www.example.org/blog/2024/05/some-article.html\r\n"
+      "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+      "Accept-Language: en-US,en;q=0.9,de;q=0.8\r\n"
+      "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark\r\n"
+      "If-None-Match: \"5f3a-18c2e4b1f40\"\r\n"
+      "If-Modified-Since: Tue, 07 May 2024 10:21:33 GMT\r\n"
+      "\r\n"sv;
+
+// Firefox navigating to a page
+static const auto firefoxRequest
+    = "GET /blog/2024/05/some-article.html HTTP/1.1\r\n"
+      "Host: www.example.org\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Ubuntu; Linux x86_64; rv:125.0) Gecko/20100101 "
+      "Firefox/125.0\r\n"
+      "Accept: "
+      "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+      "Accept-Language: en-US,en;q=0.5\r\n"
+      "Accept-Encoding: gzip, deflate, br\r\n"
+      "DNT: 1\r\n"
+      "Connection: keep-alive\r\n"
+      "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; consent=1\r\n"
+      "Upgrade-Insecure-Requests: 1\r\n"
+      "Sec-Fetch-Dest: document\r\n"
+      "Sec-Fetch-Mode: navigate\r\n"
+      "Sec-Fetch-Site: none\r\n"
+      "Sec-Fetch-User: ?1\r\n"
+      "Priority: u=1\r\n"
+      "\r\n"sv;
+
+// curl (a small request)
+static const auto curlRequest = "GET /index.html HTTP/1.1\r\n"
+                                "Host: www.example.org\r\n"
+                                "User-Agent: curl/8.5.0\r\n"
+                                "Accept: */*\r\n"
+                                "\r\n"sv;
+
+static std::string_view browserRequest = chromeRequest;
+
+// The machine this runs on is usually busy with something else as well, so every benchmark runs
+// a number of rounds and the fastest round counts.
+static constexpr size_t rounds = 20;
+static constexpr size_t iterationsPerRound = 10'000;
+// Roughly what arrives per recv on a slow link
+static constexpr size_t segmentSize = 64;
+
+static size_t sink = 0;
+
+template <typename Func>
+static void bench(std::string_view name, Func&& func)
+{
+    Arena arena;
+    // Warmup (arena chunk, caches)
+    for (size_t i = 0; i < iterationsPerRound; ++i) {
+        sink += func(arena);
+        arena.reset();
+    }
+    double minNs = std::numeric_limits<double>::max();
+    for (size_t r = 0; r < rounds; ++r) {
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterationsPerRound; ++i) {
+            sink += func(arena);
+            arena.reset();
+        }
+        const auto dur = std::chrono::steady_clock::now() - start;
+        minNs = std::min(minNs, std::chrono::duration<double, std::nano>(dur).count());
+    }
+    slog::info(name, ": ", minNs / iterationsPerRound, " ns/request");
+}
+
+static size_t parseOnce(Arena& arena)
+{
+    const auto req = Request::parse(browserRequest, &arena);
+    if (!req) {
+        slog::fatal("Request::parse failed");
+        std::exit(1);
+    }
+    return req->headers.getEntries().size();
+}
+
+static size_t parseIncremental(Arena& arena, size_t segment)
+{
+    RequestParser parser;
+    parser.reset(&arena);
+    Request req;
+    for (size_t size = segment;; size += segment) {
+        const auto data = browserRequest.substr(0, size);
+        const auto res = parser.parse(data, req);
+        if (res == RequestParser::Result::Complete) {
+            return req.headers.getEntries().size();
+        } else if (res == RequestParser::Result::Error || data.size() == browserRequest.size()) {
+            slog::fatal("RequestParser failed");
+            std::exit(1);
+        }
+    }
+}
+
+static size_t parseRetry(Arena& arena, size_t segment)
+{
+    // This is what we would have to do with Request::parse if the header arrives in pieces
+    for (size_t size = segment;; size += segment) {
+        const auto data = browserRequest.substr(0, size);
+        if (data.find("\r\n\r\n") != std::string_view::npos) {
+            const auto req = Request::parse(data, &arena);
+            if (req) {
+                return req->headers.getEntries().size();
+            }
+        }
+        if (data.size() == browserRequest.size()) {
+            slog::fatal("Request::parse failed");
+            std::exit(1);
+        }
+    }
+}
+
+static size_t lookupGeneric(const Request& req)
+{
+    size_t n = 0;
+    for (const auto name : { "Host"sv, "Content-Length"sv, "Connection"sv, "If-None-Match"sv,
+             "If-Modified-Since"sv }) {
+        n += req.headers.get(name).value_or(""sv).size();
+    }
+    return n;
+}
+
+static size_t lookupKnown(const Request& req)
+{
+    size_t n = 0;
+    for (const auto header : { KnownHeader::Host, KnownHeader::ContentLength,
+             KnownHeader::Connection, KnownHeader::IfNoneMatch, KnownHeader::IfModifiedSince }) {
+        n += req.getHeader(header).value_or(""sv).size();
+    }
+    return n;
+}
+
+int main()
+{
+    slog::init(slog::Severity::Info);
+    slog::info("Default tokenizer: ", toString(getTokenizerImpl()));
+    const auto defaultImpl = getTokenizerImpl();
+
+    const std::pair<std::string_view, std::string_view> requests[] = {
+        { "chrome", chromeRequest },
+        { "firefox", firefoxRequest },
+        { "curl", curlRequest },
+    };
+    for (const auto& [name, request] : requests) {
+        browserRequest = request;
+        slog::info(name, " (", request.size(), " bytes)");
+        bench("  Request::parse", parseOnce);
+        const auto impls = { TokenizerImpl::Scalar, TokenizerImpl::Ssse3, TokenizerImpl::Avx2 };
+        for (const auto impl : impls) {
+            if (setTokenizerImpl(impl)) {
+                bench("  RequestParser (" + std::string(toString(impl)) + ")",
+                    [](Arena& arena) { return parseIncremental(arena, browserRequest.size()); });
+            }
+        }
+        setTokenizerImpl(defaultImpl);
+    }
+
+    browserRequest = chromeRequest;
+    slog::info("chrome in segments");
+    bench("  Request::parse (" + std::to_string(segmentSize) + " byte segments, retry)",
+        [](Arena& arena) { return parseRetry(arena, segmentSize); });
+    bench("  RequestParser (" + std::to_string(segmentSize) + " byte segments)",
+        [](Arena& arena) { return parseIncremental(arena, segmentSize); });
+    bench("  RequestParser (1 byte segments)",
+        [](Arena& arena) { return parseIncremental(arena, 1); });
+
+    slog::info("chrome header lookups (Host, Content-Length, Connection, If-None-Match, "
+               "If-Modified-Since)");
+    Arena arena;
+    const auto req = Request::parse(chromeRequest, &arena);
+    if (!req || lookupGeneric(*req) != lookupKnown(*req)) {
+        slog::fatal("Lookups differ");
+        return 1;
+    }
+    bench("  HeaderMap::get", [&req](Arena&) { return lookupGeneric(*req); });
+    bench("  Request::getHeader", [&req](Arena&) { return lookupKnown(*req); });
+
+    return sink == 0 ? 1 : 0;
+}
@@ -0,0 +1,59 @@
+#!/bin/bash
+set -eou pipefail # strict mode
+commit_hash="$(git rev-parse HEAD)"
+outdir="benchmarks/$commit_hash"
+mkdir -p "$outdir"
+
+# Every request is a new TLS connection (and handshake), so this shows how expensive connection
+# setup and teardown are. Run it on two commits to compare them.
+# Execute this script from the root of the repository (after scripts/create_cert.sh).
+concurrency="${CONCURRENCY:-64}"
+threads="${THREADS:-1}"
+duration="10s"
+url="README.md"
+
+config="$(mktemp --suffix .joml)"
+trap 'rm -f "$config"' EXIT
+cat > "$config" <<EOF
+threads: $threads
+services: {
+    "127.0.0.1:6970": {
+        access_log: false
+        tls: {
+            chain: "cert.pem"
+            key: "key.pem"
+        }
+        hosts: {
+            "*": {
+                files: "."
+            }
+        }
+    }
+}
+EOF
+
+# Prints user + system CPU time of a process (including all of its threads) in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+build/htcpp "$config" &
+https_pid=$!
+sleep 1
+
+echo "Warmup" # file cache, free lists
+hey -c "$concurrency" -z 3s -disable-keepalive "https://localhost:6970/$url" > /dev/null
+
+echo "https ${concurrency} close"
+outfile="$outdir/handshakes_c${concurrency}_t${threads}_${duration}"
+ticks_before="$(cpu_ticks "$https_pid")"
+hey -c "$concurrency" -z "$duration" -disable-keepalive "https://localhost:6970/$url" > "$outfile"
+ticks_after="$(cpu_ticks "$https_pid")"
+handshakes="$(awk '/Requests\/sec/ { print $2 }' "$outfile")"
+awk -v t0="$ticks_before" -v t1="$ticks_after" -v hz="$(getconf CLK_TCK)" -v h="$handshakes" \
+    -v d="${duration%s}" \
+    'BEGIN { printf "Handshakes/sec: %.0f\nCPU us/handshake: %.1f\n", h, (t1 - t0) / hz * 1e6 / (h * d) }' \
+    | tee -a "$outfile"
+grep -A4 "Latency distribution" "$outfile" | tail -n +2 || true
+
+kill "$https_pid"
@@ -0,0 +1,99 @@
+#!/usr/bin/env python3
+# Measures the memory per idle TLS keep-alive connection: Every connection does a single request
+# and then stays open. The difference in RSS of the htcpp process divided by the number of
+# connections is the cost of an idle connection.
+# Execute this script from the root of the repository (after scripts/create_cert.sh), e.g.:
+# scripts/bench-tls-memory.py 10000
+import resource
+import socket
+import ssl
+import subprocess
+import sys
+import tempfile
+import time
+
+PORT = 6969
+CONFIG = """
+services: {
+    "127.0.0.1:%d": {
+        access_log: false
+        keep_alive_idle_timeout_ms: 600000
+        tls: {
+            chain: "cert.pem"
+            key: "key.pem"
+        }
+        hosts: {
+            "*": {
+                files: "."
+            }
+        }
+    }
+}
+""" % PORT
+
+
+def rss_kib(pid):
+    with open(f"/proc/{pid}/status") as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])
+    raise RuntimeError("No VmRSS")
+
+
+def request(ctx):
+    sock = socket.create_connection(("127.0.0.1", PORT))
+    conn = ctx.wrap_socket(sock, server_hostname="localhost")
+    conn.sendall(b"GET /README.md HTTP/1.1\r\nHost: localhost\r\n\r\n")
+    data = b""
+    while b"\r\n\r\n" not in data:
+        data += conn.recv(16 * 1024)
+    header, body = data.split(b"\r\n\r\n", 1)
+    length = 0
+    for line in header.split(b"\r\n")[1:]:
+        name, value = line.split(b":", 1)
+        if name.strip().lower() == b"content-length":
+            length = int(value)
+    while len(body) < length:
+        body += conn.recv(16 * 1024)
+    return conn
+
+
+def main():
+    num_connections = int(sys.argv[1]) if len(sys.argv) > 1 else 5000
+    # Both this process and htcpp (which inherits it) need an fd per connection
+    _, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    resource.setrlimit(resource.RLIMIT_NOFILE, (hard, hard))
+
+    with tempfile.NamedTemporaryFile("w", suffix=".joml") as config:
+        config.write(CONFIG)
+        config.flush()
+        server = subprocess.Popen(["build/htcpp", config.name])
+        try:
+            time.sleep(1)
+            ctx = ssl.create_default_context()
+            ctx.check_hostname = False
+            ctx.verify_mode = ssl.CERT_NONE
+
+            # Warm up, so allocations that happen once (file cache, SSL_CTX) are not counted
+            warmup = [request(ctx) for _ in range(16)]
+            for conn in warmup:
+                conn.close()
+            time.sleep(0.5)
+
+            rss_before = rss_kib(server.pid)
+            connections = [request(ctx) for _ in range(num_connections)]
+            time.sleep(0.5)
+            rss_after = rss_kib(server.pid)
+
+            print(f"Connections: {len(connections)}")
+            print(f"RSS before: {rss_before} KiB, after: {rss_after} KiB")
+            print(f"KiB/connection: {(rss_after - rss_before) / len(connections):.2f}")
+            for conn in connections:
+                conn.close()
+        finally:
+            server.terminate()
+            server.wait()
+
+
+if __name__ == "__main__":
+    main()
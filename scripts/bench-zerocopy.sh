@@ -0,0 +1,62 @@
+#!/bin/bash
+set -eou pipefail # strict mode
+commit_hash="$(git rev-parse HEAD)"
+outdir="benchmarks/$commit_hash"
+mkdir -p "$outdir"
+
+# Compares CPU time per GB served with and without zero-copy sends.
+# Traffic to a local address never leaves loopback, where the kernel has to copy anyway (see
+# "Copied zero-copy sends"), so this only shows the overhead there. To see the savings, put hey on
+# another machine (e.g. with a wrapper script named hey that runs it over ssh) and set CLIENT_HOST
+# to the address of this machine.
+concurrency="64"
+threads="${THREADS:-1}"
+duration="10s"
+file_size_mb="${FILE_SIZE_MB:-4}"
+host="${CLIENT_HOST:-localhost}"
+
+workdir="$(mktemp -d)"
+trap 'rm -rf "$workdir"' EXIT
+head -c "$((file_size_mb * 1024 * 1024))" /dev/urandom > "$workdir/large.bin"
+
+# Prints user + system CPU time of a process (including all of its threads) in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# Prints the sum of all series that contain the given string
+metric_sum() {
+    curl -s "http://localhost:$1/metrics" | grep -F "$2" | awk '{ s += $2 } END { print s + 0 }'
+}
+
+run() {
+    local name="$1" threshold="$2" port="$3"
+    HTCPP_ACCESS_LOG=0 build/htcpp --threads "$threads" --listen "0.0.0.0:$port" \
+        --metrics /metrics --zero-copy-threshold "$threshold" "$workdir" &
+    local pid=$!
+    sleep 1
+
+    echo "Warmup $name" # file cache
+    hey -c "$concurrency" -z 3s "http://$host:$port/large.bin" > /dev/null
+
+    echo "$name"
+    local outfile="$outdir/zerocopy_${name}_c${concurrency}_t${threads}_${file_size_mb}mb_${duration}"
+    local ticks_before ticks_after copied
+    ticks_before="$(cpu_ticks "$pid")"
+    hey -c "$concurrency" -z "$duration" "http://$host:$port/large.bin" > "$outfile"
+    ticks_after="$(cpu_ticks "$pid")"
+    copied="$(metric_sum "$port" 'htcpp_io_zero_copy_sends_total{copied="true"}')"
+    kill "$pid"
+    wait "$pid" || true
+
+    grep "Requests/sec" "$outfile"
+    local bytes
+    bytes="$(awk '/Total data:/ { print $3 }' "$outfile")"
+    awk -v t0="$ticks_before" -v t1="$ticks_after" -v hz="$(getconf CLK_TCK)" -v b="$bytes" \
+        -v d="${duration%s}" -v c="$copied" \
+        'BEGIN { printf "GB/s: %.2f\nCPU s/GB: %.3f\nCopied zero-copy sends: %d\n", b / d / 1e9, (t1 - t0) / hz / (b / 1e9), c }' \
+        | tee -a "$outfile"
+}
+
+run copy 0 6969
+run zerocopy 1 6969
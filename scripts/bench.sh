@@ -5,38 +5,90 @@ outdir="benchmarks/$commit_hash"
 mkdir -p "$outdir"
 
 concurrency="512"
+# Run e.g. THREADS=4 scripts/bench.sh to see how it scales
+threads="${THREADS:-1}"
+# Compare ring setup profiles with e.g.:
+# for p in plain taskrun sqpoll; do RING_PROFILE=$p scripts/bench.sh; done
+# The SQ polling threads belong to the process, so they show up in the CPU time.
+profile="${RING_PROFILE:-auto}"
 duration="10s"
 url="file/src/config.hpp"
 
-HTCPP_ACCESS_LOG=0 build/htcpp --listen 127.0.0.1:6969 &
+metrics_url="http://localhost:6969/metrics"
+
+# Prints the value of an unlabeled metric
+metric() {
+    curl -s "$metrics_url" | awk -v name="$1" '$1 == name { print $2 }'
+}
+
+# Prints user + system CPU time of a process (including all of its threads) in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# Appends CPU milliseconds per 1000 requests to the output file
+cpu_per_request() {
+    local ticks_before="$1" ticks_after="$2" outfile="$3"
+    local requests
+    requests="$(awk '/Requests\/sec/ { print $2 }' "$outfile")"
+    awk -v t0="$ticks_before" -v t1="$ticks_after" -v hz="$(getconf CLK_TCK)" -v r="$requests" \
+        -v d="${duration%s}" 'BEGIN { printf "CPU ms/1000 requests: %.2f\n", (t1 - t0) / hz * 1000 / (r * d) * 1000 }' \
+        | tee -a "$outfile"
+}
+
+args=(--threads "$threads" --ring-profile "$profile")
+
+HTCPP_ACCESS_LOG=0 build/htcpp "${args[@]}" --listen 127.0.0.1:6969 --metrics /metrics &
 http_pid=$!
 
-HTCPP_ACCESS_LOG=0 build/htcpp --listen 127.0.0.1:6970 --tls cert.pem key.pem &
+HTCPP_ACCESS_LOG=0 build/htcpp "${args[@]}" --listen 127.0.0.1:6970 --tls cert.pem key.pem &
 https_pid=$!
 
 echo "Warmup HTTP" # file cache, grow some buffers, allocate things
 hey -c "$concurrency" -z 3s "http://localhost:6969/$url" > /dev/null
 
 echo "http ${concurrency}"
-outfile="$outdir/http_c${concurrency}_${duration}"
+outfile="$outdir/http_c${concurrency}_t${threads}_${profile}_${duration}"
+ticks_before="$(cpu_ticks "$http_pid")"
+submits_before="$(metric htcpp_io_submits_total)"
+cqes_before="$(metric htcpp_io_cqes_per_iteration_sum)"
+iterations_before="$(metric htcpp_io_cqes_per_iteration_count)"
 hey -c "$concurrency" -z "$duration" "http://localhost:6969/$url" > "$outfile"
+submits_after="$(metric htcpp_io_submits_total)"
+cqes_after="$(metric htcpp_io_cqes_per_iteration_sum)"
+iterations_after="$(metric htcpp_io_cqes_per_iteration_count)"
+ticks_after="$(cpu_ticks "$http_pid")"
 grep "Requests/sec" "$outfile"
+cpu_per_request "$ticks_before" "$ticks_after" "$outfile"
+awk -v s0="$submits_before" -v s1="$submits_after" -v d="${duration%s}" \
+    -v c0="$cqes_before" -v c1="$cqes_after" -v i0="$iterations_before" -v i1="$iterations_after" \
+    'BEGIN { printf "Submits/sec: %.0f\nCQEs/iteration: %.2f\n", (s1 - s0) / d, (c1 - c0) / (i1 - i0) }' \
+    | tee -a "$outfile"
 
 echo "http ${concurrency} close"
-outfile="$outdir/http_c${concurrency}_${duration}_close"
+outfile="$outdir/http_c${concurrency}_t${threads}_${profile}_${duration}_close"
+sqes_before="$(metric htcpp_io_sqes_total)"
+accepted_before="$(metric htcpp_connections_accepted)"
 hey -c "$concurrency" -z "$duration" -disable-keepalive "http://localhost:6969/$url" > "$outfile"
+sqes_after="$(metric htcpp_io_sqes_total)"
+accepted_after="$(metric htcpp_connections_accepted)"
 grep "Requests/sec" "$outfile"
+awk -v s0="$sqes_before" -v s1="$sqes_after" -v a0="$accepted_before" -v a1="$accepted_after" \
+    'BEGIN { printf "SQEs/connection: %.2f\n", (s1 - s0) / (a1 - a0) }' | tee -a "$outfile"
 
 echo "Warmup HTTPS"
 hey -c "$concurrency" -z 3s "https://localhost:6970/$url" > /dev/null
 
 echo "https ${concurrency}"
-outfile="$outdir/https_c${concurrency}_${duration}"
+outfile="$outdir/https_c${concurrency}_t${threads}_${profile}_${duration}"
+ticks_before="$(cpu_ticks "$https_pid")"
 hey -c "$concurrency" -z "$duration" "https://localhost:6970/$url" > "$outfile"
+ticks_after="$(cpu_ticks "$https_pid")"
 grep "Requests/sec" "$outfile"
+cpu_per_request "$ticks_before" "$ticks_after" "$outfile"
 
 echo "https ${concurrency} close"
-outfile="$outdir/https_c${concurrency}_${duration}_close"
+outfile="$outdir/https_c${concurrency}_t${threads}_${profile}_${duration}_close"
 hey -c "$concurrency" -z "$duration" -disable-keepalive "https://localhost:6970/$url" > "$outfile"
 grep "Requests/sec" "$outfile"
 
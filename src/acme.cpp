@@ -661,23 +661,18 @@ AcmeClient::AcmeClient(IoQueue& io, Config::Acme config)
     , config_(config)
     , requester_(io)
     , challenges_(std::make_shared<std::vector<Challenge>>())
-    , challengesListener_(
-          io, [this](decltype(challenges_)&& challenges) { challenges_ = std::move(challenges); })
-    , currentContextListener_(io, [this](decltype(currentContext_)&& currentContext) {
-        currentContext_ = std::move(currentContext);
-    })
 {
     thread_ = std::thread([this]() { threadFunc(); });
 }
 
-std::shared_ptr<SslContext> AcmeClient::getCurrentContext() const
+std::shared_ptr<SslContext> AcmeClient::getCurrentContext(IoQueue& io)
 {
-    return currentContext_;
+    return currentContext_.get(io);
 }
 
-std::shared_ptr<std::vector<AcmeClient::Challenge>> AcmeClient::getChallenges() const
+std::shared_ptr<std::vector<AcmeClient::Challenge>> AcmeClient::getChallenges(IoQueue& io)
 {
-    return challenges_;
+    return challenges_.get(io);
 }
 
 void AcmeClient::threadFunc()
@@ -794,7 +789,7 @@ bool AcmeClient::updateContext()
         return false;
     }
     slog::info("ACME: Updating context");
-    currentContextListener_.emit(std::shared_ptr<SslContext>(std::move(ctx)));
+    currentContext_.set(std::move(ctx));
     return true;
 }
 
@@ -913,11 +908,10 @@ bool AcmeClient::issueCertificate(
             const auto keyAuth = challenge.token + "." + jwkThumbprint;
             auto challenges = std::vector<Challenge> { { path, keyAuth } };
             slog::info("ACME: Received challenge ", path);
-            challengesListener_.emit(
-                std::make_shared<std::vector<Challenge>>(std::move(challenges)));
+            challenges_.set(std::make_shared<std::vector<Challenge>>(std::move(challenges)));
 
-            // We actually have to wait until the main thread has consumed the event until we can
-            // really confirm the challenge has been completed, but considering that the
+            // We actually have to wait until the IoQueue threads have received the update until we
+            // can really confirm the challenge has been completed, but considering that the
             // conformation and the request from the ACME server take some time, it should be fine.
 
             // Confirm the challenge has been completed
@@ -4,7 +4,7 @@
 
 #include "client.hpp"
 #include "config.hpp"
-#include "events.hpp"
+#include "replicated.hpp"
 #include "result.hpp"
 #include "ssl.hpp"
 
@@ -17,8 +17,9 @@ public:
 
     AcmeClient(IoQueue& io, Config::Acme config);
 
-    std::shared_ptr<SslContext> getCurrentContext() const;
-    std::shared_ptr<std::vector<Challenge>> getChallenges() const;
+    // These may be called from any IoQueue thread (with its own IoQueue)
+    std::shared_ptr<SslContext> getCurrentContext(IoQueue& io);
+    std::shared_ptr<std::vector<Challenge>> getChallenges(IoQueue& io);
 
 private:
     void threadFunc();
@@ -30,12 +31,9 @@ private:
     IoQueue& io_;
     Config::Acme config_;
     ThreadRequester requester_;
-    std::shared_ptr<std::vector<Challenge>> challenges_;
-    // These listeners are sent events from the threadFunc and simply set the corresponding member
-    // variables from the main thread
-    EventListener<decltype(challenges_)> challengesListener_;
-    std::shared_ptr<SslContext> currentContext_;
-    EventListener<decltype(currentContext_)> currentContextListener_;
+    // These are set from threadFunc
+    Replicated<std::shared_ptr<std::vector<Challenge>>> challenges_;
+    Replicated<std::shared_ptr<SslContext>> currentContext_;
     std::thread thread_;
 };
 
@@ -50,9 +48,9 @@ struct AcmeSslConnectionFactory {
 
     AcmeClient* acmeClient;
 
-    std::unique_ptr<Connection> create(IoQueue& io, int fd)
+    std::unique_ptr<Connection> create(IoQueue& io, IoQueue::Descriptor fd)
     {
-        auto context = acmeClient->getCurrentContext();
+        auto context = acmeClient->getCurrentContext(io);
         return context ? std::make_unique<Connection>(io, fd, std::move(context)) : nullptr;
     }
 };
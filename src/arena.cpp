@@ -0,0 +1,56 @@
+#include "arena.hpp"
+
+#include <cassert>
+#include <cstdint>
+
+Arena::Arena(size_t initialSize)
+    : initialSize_(initialSize)
+{
+    assert(initialSize_ > 0);
+}
+
+void* Arena::allocate(size_t size, size_t alignment)
+{
+    assert(alignment > 0 && (alignment & (alignment - 1)) == 0);
+    if (!chunks_.empty()) {
+        const auto& chunk = chunks_.back();
+        const auto base = reinterpret_cast<uintptr_t>(chunk.data.get());
+        const auto start = (base + offset_ + alignment - 1) & ~(alignment - 1);
+        if (start + size <= base + chunk.size) {
+            offset_ = start + size - base;
+            return reinterpret_cast<void*>(start);
+        }
+    }
+    // The chunks themselves are aligned for max_align_t, but the alignment might be larger
+    addChunk(size + alignment);
+    return allocate(size, alignment);
+}
+
+void Arena::reset()
+{
+    if (chunks_.size() > 1) {
+        const auto capacity = getCapacity();
+        chunks_.clear();
+        addChunk(capacity);
+    }
+    offset_ = 0;
+}
+
+size_t Arena::getCapacity() const
+{
+    size_t capacity = 0;
+    for (const auto& chunk : chunks_) {
+        capacity += chunk.size;
+    }
+    return capacity;
+}
+
+void Arena::addChunk(size_t minSize)
+{
+    auto size = chunks_.empty() ? initialSize_ : chunks_.back().size * 2;
+    while (size < minSize) {
+        size *= 2;
+    }
+    chunks_.push_back(Chunk { std::unique_ptr<char[]>(new char[size]), size });
+    offset_ = 0;
+}
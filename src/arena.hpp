@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+// A bump allocator: Allocations are just an increment of an offset into a chunk of memory and
+// freeing single allocations does nothing. All of the memory is released at once with reset.
+// It is meant for objects that all have the same lifetime, like everything belonging to a single
+// request.
+// If a chunk is full, a new (larger) one is allocated. reset replaces all chunks with a single
+// one that is large enough for everything that was allocated since the last reset, so after a few
+// requests there is only a single chunk left and neither allocate nor reset touch the heap.
+class Arena {
+public:
+    Arena(size_t initialSize = 4096);
+    ~Arena() = default;
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t));
+
+    // Everything allocated from this arena must have been destroyed already!
+    void reset();
+
+    // Sum of the size of all chunks
+    size_t getCapacity() const;
+
+private:
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+
+    void addChunk(size_t minSize);
+
+    size_t initialSize_;
+    std::vector<Chunk> chunks_;
+    // Offset into chunks_.back()
+    size_t offset_ = 0;
+};
+
+// A std allocator that allocates from an Arena. If it has no arena, it falls back to operator new
+// and delete, so types using it can be used just like before, if there is no arena around.
+// Moving a container moves the allocator with it, but copying it does not (see
+// select_on_container_copy_construction). That way copies of objects allocated from an arena
+// (e.g. a Request a handler wants to keep around) don't break, when the arena is reset.
+template <typename T>
+class ArenaAllocator {
+public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    ArenaAllocator() = default;
+
+    ArenaAllocator(Arena* arena)
+        : arena_(arena)
+    {
+    }
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other)
+        : arena_(other.getArena())
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if (arena_) {
+            return static_cast<T*>(arena_->allocate(n * sizeof(T), alignof(T)));
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t)
+    {
+        if (!arena_) {
+            ::operator delete(ptr);
+        }
+    }
+
+    ArenaAllocator select_on_container_copy_construction() const { return ArenaAllocator(); }
+
+    Arena* getArena() const { return arena_; }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const
+    {
+        return arena_ == other.getArena();
+    }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const
+    {
+        return arena_ != other.getArena();
+    }
+
+private:
+    Arena* arena_ = nullptr;
+};
@@ -26,7 +26,6 @@ void request(IoQueue& io, Method method, const std::string_view urlStr, const He
 
 ThreadRequester::ThreadRequester(IoQueue& io)
     : io_(io)
-    , eventListener_(io, [this](Event&& event) { eventHandler(std::move(event)); })
 {
 }
 
@@ -35,8 +34,9 @@ std::future<ThreadRequester::RequestResult> ThreadRequester::request(
 {
     auto prom = std::make_shared<std::promise<RequestResult>>();
     auto fut = prom->get_future();
-    eventListener_.emit(
-        Event { std::move(prom), method, std::move(url), std::move(headers), std::move(body) });
+    io_.post([this,
+                 event = Event { std::move(prom), method, std::move(url), std::move(headers),
+                     std::move(body) }]() mutable { eventHandler(std::move(event)); });
     return fut;
 }
 
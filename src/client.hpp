@@ -333,5 +333,4 @@ private:
     void eventHandler(Event&& event);
 
     IoQueue& io_;
-    EventListener<Event> eventListener_;
 };
@@ -1,7 +1,6 @@
 #include <cpprom/cpprom.hpp>
 
 #include "client.hpp"
-#include "events.hpp"
 
 #ifdef TLS_SUPPORT_ENABLED
 #include "ssl.hpp"
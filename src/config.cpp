@@ -2,6 +2,7 @@
 
 #include <cassert>
 #include <filesystem>
+#include <limits>
 
 #include <pwd.h>
 #include <unistd.h>
@@ -118,6 +119,21 @@ bool load(const joml::Node& value, std::string_view name, Duration& dest)
     return loadParse(value, name, "duration (XXd, XXh, XXm or XXs)", dest);
 }
 
+bool load(const joml::Node& value, std::string_view name, Config::IoRingProfile& dest)
+{
+    std::string str;
+    if (!load(value, name, str)) {
+        return false;
+    }
+    const auto profile = Config::parseIoRingProfile(str);
+    if (!profile) {
+        slog::error("'", name, "' must be one of 'auto', 'plain', 'taskrun' or 'sqpoll'");
+        return false;
+    }
+    dest = *profile;
+    return true;
+}
+
 template <typename T>
 bool load(const joml::Node& value, std::string_view name, std::optional<T>& dest)
 {
@@ -147,6 +163,21 @@ bool load(const joml::Node& value, std::string_view name, std::vector<T>& dest)
     return true;
 }
 
+// Timeouts are given in milliseconds
+bool loadTimeout(const joml::Node& value, std::string_view name, uint32_t& dest)
+{
+    int64_t ms = 0;
+    if (!load(value, name, ms)) {
+        return false;
+    }
+    if (ms <= 0 || ms > std::numeric_limits<uint32_t>::max()) {
+        slog::error("'", name, "' must be a positive number of milliseconds");
+        return false;
+    }
+    dest = static_cast<uint32_t>(ms);
+    return true;
+}
+
 #define CHECK_OR_NULLOPT(cond)                                                                     \
     if (!(cond)) {                                                                                 \
         return std::nullopt;                                                                       \
@@ -418,6 +449,41 @@ std::optional<std::vector<Config::Service>> loadServices(const joml::Node& node)
                     return std::nullopt;
                 }
                 service.accesLog = svalue.asBool();
+            } else if (skey == "idle_connection_watermark") {
+                int64_t watermark = 0;
+                CHECK_OR_NULLOPT(load(svalue, "idle_connection_watermark", watermark));
+                if (watermark < 0) {
+                    slog::error("'idle_connection_watermark' must not be negative");
+                    return std::nullopt;
+                }
+                service.idleConnectionWatermark = static_cast<size_t>(watermark);
+            } else if (skey == "zero_copy_send_threshold") {
+                int64_t threshold = 0;
+                CHECK_OR_NULLOPT(load(svalue, "zero_copy_send_threshold", threshold));
+                if (threshold < 0) {
+                    slog::error("'zero_copy_send_threshold' must not be negative");
+                    return std::nullopt;
+                }
+                service.zeroCopySendThreshold = static_cast<size_t>(threshold);
+            } else if (skey == "max_free_sessions") {
+                int64_t maxFree = 0;
+                CHECK_OR_NULLOPT(load(svalue, "max_free_sessions", maxFree));
+                if (maxFree < 0) {
+                    slog::error("'max_free_sessions' must not be negative");
+                    return std::nullopt;
+                }
+                service.maxFreeSessions = static_cast<size_t>(maxFree);
+            } else if (skey == "header_read_timeout_ms") {
+                CHECK_OR_NULLOPT(
+                    loadTimeout(svalue, "header_read_timeout_ms", service.headerReadTimeoutMs));
+            } else if (skey == "body_read_timeout_ms") {
+                CHECK_OR_NULLOPT(
+                    loadTimeout(svalue, "body_read_timeout_ms", service.bodyReadTimeoutMs));
+            } else if (skey == "keep_alive_idle_timeout_ms") {
+                CHECK_OR_NULLOPT(loadTimeout(
+                    svalue, "keep_alive_idle_timeout_ms", service.keepAliveIdleTimeoutMs));
+            } else if (skey == "send_timeout_ms") {
+                CHECK_OR_NULLOPT(loadTimeout(svalue, "send_timeout_ms", service.sendTimeoutMs));
             } else if (skey == "tls") {
                 if (!svalue.isDictionary()) {
                     slog::error("'tls' must be a dictionary");
@@ -467,6 +533,20 @@ std::optional<std::vector<Config::Service>> loadServices(const joml::Node& node)
 }
 }
 
+std::optional<Config::IoRingProfile> Config::parseIoRingProfile(std::string_view str)
+{
+    if (str == "auto") {
+        return IoRingProfile::Auto;
+    } else if (str == "plain") {
+        return IoRingProfile::Plain;
+    } else if (str == "taskrun") {
+        return IoRingProfile::TaskRun;
+    } else if (str == "sqpoll") {
+        return IoRingProfile::SqPoll;
+    }
+    return std::nullopt;
+}
+
 // Without all this generic schema stuff, this would be even larger and more complicated and more
 // annoying to write.
 bool Config::loadFromFile(const std::string& path)
@@ -505,8 +585,91 @@ bool Config::loadFromFile(const std::string& path)
                 return false;
             }
             copy.ioQueueSize = static_cast<size_t>(qs);
+        } else if (key == "io_ring_profile") {
+            if (!load(value, "io_ring_profile", copy.ioRingProfile)) {
+                return false;
+            }
+        } else if (key == "io_completion_queue_size") {
+            int64_t size = 0;
+            if (!load(value, "io_completion_queue_size", size)) {
+                return false;
+            }
+            if (size < 0 || size > 65536 || (size > 0 && !isPowerOfTwo(size))) {
+                slog::error("'io_completion_queue_size' must be 0 or a power of two in [1, 65536]");
+                return false;
+            }
+            copy.ioCompletionQueueSize = static_cast<uint32_t>(size);
         } else if (key == "io_submission_queue_polling") {
-            if (!load(value, "io_submission_queue_polling", copy.ioSubmissionQueuePolling)) {
+            // Deprecated in favor of io_ring_profile
+            bool sqPoll = false;
+            if (!load(value, "io_submission_queue_polling", sqPoll)) {
+                return false;
+            }
+            copy.ioRingProfile = sqPoll ? IoRingProfile::SqPoll : IoRingProfile::Plain;
+        } else if (key == "io_provided_buffers") {
+            int64_t num = 0;
+            if (!load(value, "io_provided_buffers", num)) {
+                return false;
+            }
+            if (num < 0 || num > 32768 || (num != 0 && !isPowerOfTwo(num))) {
+                slog::error("'io_provided_buffers' must be 0 or a power of two in [1, 32768]");
+                return false;
+            }
+            copy.ioProvidedBuffers = static_cast<uint32_t>(num);
+        } else if (key == "io_provided_buffer_size") {
+            int64_t size = 0;
+            if (!load(value, "io_provided_buffer_size", size)) {
+                return false;
+            }
+            if (size < 1 || size > 1024 * 1024) {
+                slog::error("'io_provided_buffer_size' must be in [1, 1048576]");
+                return false;
+            }
+            copy.ioProvidedBufferSize = static_cast<uint32_t>(size);
+        } else if (key == "io_fixed_files") {
+            int64_t num = 0;
+            if (!load(value, "io_fixed_files", num)) {
+                return false;
+            }
+            // IORING_MAX_FIXED_FILES
+            if (num < 0 || num > 1024 * 1024) {
+                slog::error("'io_fixed_files' must be in [0, 1048576]");
+                return false;
+            }
+            copy.ioFixedFiles = static_cast<uint32_t>(num);
+        } else if (key == "io_registered_buffers") {
+            int64_t num = 0;
+            if (!load(value, "io_registered_buffers", num)) {
+                return false;
+            }
+            // IORING_MAX_REG_BUFFERS
+            if (num < 0 || num > 16384) {
+                slog::error("'io_registered_buffers' must be in [0, 16384]");
+                return false;
+            }
+            copy.ioRegisteredBuffers = static_cast<uint32_t>(num);
+        } else if (key == "async_threads") {
+            int64_t num = 0;
+            if (!load(value, "async_threads", num)) {
+                return false;
+            }
+            if (num < 1 || num > 1024) {
+                slog::error("'async_threads' must be in [1, 1024]");
+                return false;
+            }
+            copy.asyncThreads = static_cast<uint32_t>(num);
+        } else if (key == "threads") {
+            int64_t num = 0;
+            if (!load(value, "threads", num)) {
+                return false;
+            }
+            if (num < 1 || num > 1024) {
+                slog::error("'threads' must be in [1, 1024]");
+                return false;
+            }
+            copy.threads = static_cast<uint32_t>(num);
+        } else if (key == "pin_threads") {
+            if (!load(value, "pin_threads", copy.pinThreads)) {
                 return false;
             }
         } else if (key == "services") {
@@ -550,6 +713,11 @@ bool Config::loadFromFile(const std::string& path)
     }
 #endif
 
+    if (copy.ioCompletionQueueSize > 0 && copy.ioCompletionQueueSize < copy.ioQueueSize) {
+        slog::error("'io_completion_queue_size' must not be smaller than 'io_queue_size'");
+        return false;
+    }
+
     if (!servicesFound) {
         slog::error("'services' is mandatory and must not be empty");
         return false;
@@ -2,6 +2,7 @@
 
 #include <optional>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <vector>
 
@@ -18,12 +19,31 @@ struct Config {
         bool accesLog = true;
 
         size_t listenBacklog = SOMAXCONN;
-        uint32_t fullReadTimeoutMs = 2000;
+        // Time to receive the request line and headers
+        uint32_t headerReadTimeoutMs = 2000;
+        // Time to receive the body, starting after the headers
+        uint32_t bodyReadTimeoutMs = 2000;
+        // Time a keep-alive connection may wait for its next request
+        uint32_t keepAliveIdleTimeoutMs = 5000;
+        // Time to send the complete response
+        uint32_t sendTimeoutMs = 5000;
         size_t maxUrlLength = 512;
         // maxRequestHeaderSize is actually the max size of request line + all headers
         // 1024 is enough for most requests, mostly less than MTU
         size_t maxRequestHeaderSize = 1024;
         size_t maxRequestBodySize = 1024;
+        // If there are more connections than this, idle keep-alive connections are closed (oldest
+        // first). 0 means there is no limit.
+        size_t idleConnectionWatermark = 0;
+        // Response bodies from the file cache that are at least this large are sent with
+        // zero-copy sends (if the kernel supports it). 0 disables them.
+        size_t zeroCopySendThreshold = 64 * 1024;
+        // Sessions of closed connections are kept for new connections (with the capacity of their
+        // buffers). This is the maximum number of them per thread.
+        size_t maxFreeSessions = 1024;
+        // Not configurable. This is set if there are multiple threads, which all listen on the
+        // same port (see Config::threads).
+        bool reusePort = false;
     };
 
     struct Service : public Server {
@@ -86,8 +106,46 @@ struct Config {
     std::unordered_map<std::string, Acme> acme; // the key is the domain
 #endif
 
+    enum class IoRingProfile {
+        // SqPoll if there are at least two CPUs per thread, otherwise TaskRun
+        Auto,
+        // The IoQueue thread submits with io_uring_enter and no setup flags
+        Plain,
+        // Like Plain, but with IORING_SETUP_SINGLE_ISSUER | DEFER_TASKRUN or COOP_TASKRUN (whatever
+        // the kernel supports), so the kernel does not interrupt the thread to complete
+        // operations. Falls back to Plain if neither is available.
+        TaskRun,
+        // A kernel thread per ring polls the SQ, so submitting needs no syscall while that thread
+        // is awake, but it also keeps a CPU busy. Falls back to TaskRun if not available.
+        SqPoll,
+    };
+
+    static std::optional<IoRingProfile> parseIoRingProfile(std::string_view str);
+
     uint32_t ioQueueSize = 2048; // power of two, >= 1, <= 4096
-    bool ioSubmissionQueuePolling = true;
+    IoRingProfile ioRingProfile = IoRingProfile::Auto;
+    // Multishot operations produce many CQEs for one SQE, so the default of twice the SQ size can
+    // be too small under load. The kernel does not drop CQEs if it overflows, but the overflow
+    // list is slow. 0 means the kernel default.
+    uint32_t ioCompletionQueueSize = 8192; // 0 or power of two, >= ioQueueSize, <= 65536
+    // Buffers the kernel receives requests into (if supported), so idle connections don't need
+    // buffers of their own. The size must be at least maxRequestHeaderSize for them to be used.
+    uint32_t ioProvidedBuffers = 4096; // power of two, 0 (disabled) or <= 32768
+    uint32_t ioProvidedBufferSize = 1024;
+    // Size of the fixed file table client sockets are accepted into (if supported). If it is
+    // full, regular fds are used. This counts towards RLIMIT_NOFILE. 0 disables it.
+    uint32_t ioFixedFiles = 1024;
+    // Buffers that are registered with the kernel for the TLS records of in-flight recvs and
+    // sends (only if there are TLS services). Connections fall back to a buffer of their own if
+    // all of them are in use. They are pinned (RLIMIT_MEMLOCK), 17 KiB each. 0 disables them.
+    uint32_t ioRegisteredBuffers = 256; // <= 16384
+    // Threads for blocking work like DNS lookups, serializing metrics and loading certificates
+    uint32_t asyncThreads = 4;
+    // Every thread has its own IoQueue and listen sockets for all services (SO_REUSEPORT) and
+    // the kernel distributes connections between them.
+    uint32_t threads = 1;
+    // Pin thread i to CPU i
+    bool pinThreads = false;
 
     std::vector<Service> services;
 
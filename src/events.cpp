@@ -16,7 +16,7 @@ EventFd::EventFd(IoQueue& io)
 bool EventFd::read(std::function<void(std::error_code, uint64_t)> cb)
 {
     assert(fd_ != -1);
-    return io_.read(fd_, &readBuf_, sizeof(readBuf_),
+    const auto handle = io_.read(fd_, &readBuf_, sizeof(readBuf_),
         [this, cb = std::move(cb)](std::error_code ec, int readBytes) {
             if (ec) {
                 cb(ec, 0);
@@ -28,6 +28,7 @@ bool EventFd::read(std::function<void(std::error_code, uint64_t)> cb)
             assert(readBytes == sizeof(uint64_t));
             cb(std::error_code(), readBuf_);
         });
+    return static_cast<bool>(handle);
 }
 
 void EventFd::write(uint64_t v)
@@ -1,10 +1,9 @@
 #pragma once
 
 #include <functional>
+#include <system_error>
 
 #include "fd.hpp"
-#include "log.hpp"
-#include "mpscqueue.hpp"
 
 class IoQueue;
 
@@ -30,52 +29,3 @@ private:
     Fd fd_;
     uint64_t readBuf_;
 };
-
-// This class provides a way send messages to the main thread where they can be handled
-// asynchronously. It's main purpose is to provide a way to have other threads to IO through the IO
-// Queue (e.g. the ACME client).
-// For something like that use an Event class that contains some parameters and a promise and use an
-// eventHandler that uses the parameters to start an asynchronous IO operation that fulfills the
-// promise when it completes.
-template <typename Event>
-class EventListener {
-public:
-    // The class needs to be constructed from the main thread
-    EventListener(IoQueue& io, std::function<void(Event&& event)> eventHandler)
-        : eventHandler_(std::move(eventHandler))
-        , eventFd_(io)
-    {
-        pollQueue();
-    }
-
-    // This can be called from any thread!
-    void emit(Event&& event)
-    {
-        queue_.produce(std::move(event));
-        eventFd_.write(1);
-    }
-
-private:
-    void pollQueue()
-    {
-        eventFd_.read([this](std::error_code ec, uint64_t) {
-            if (ec) {
-                slog::error("Error reading eventfd: ", ec.message());
-            } else {
-                while (true) {
-                    auto event = queue_.consume();
-                    if (!event) {
-                        break;
-                    }
-                    slog::debug("consume cb");
-                    eventHandler_(std::move(*event));
-                }
-            }
-            pollQueue();
-        });
-    }
-
-    std::function<void(Event&& event)> eventHandler_;
-    MpscQueue<Event> queue_;
-    EventFd eventFd_;
-};
@@ -10,45 +10,84 @@
 
 FileCache::FileCache(IoQueue& io)
     : io_(io)
-    , fileWatcher_(io)
+    , ownFileWatcher_(std::make_unique<FileWatcher>(io))
+    , fileWatcher_(*ownFileWatcher_)
 {
 }
 
-// As this server is fully single-threaded, we can get away with returning a reference
-// because the reference might only be invalidated after the handler that is using it
-// has finished. If this server was multi-threaded we should return shared_ptr here instead.
+FileCache::FileCache(IoQueue& io, FileWatcher& fileWatcher)
+    : io_(io)
+    , fileWatcher_(fileWatcher)
+{
+}
+
+// Every thread has its own IoQueue and FileCache (see Config::threads), so we can get away
+// with returning a reference, because the reference might only be invalidated after the
+// handler that is using it has finished. If a FileCache was shared between threads, we should
+// return shared_ptr here instead.
 // If std::optional<T&> was a thing, I would return that instead.
 const FileCache::Entry* FileCache::get(const std::string& path)
 {
-    Metrics::get().fileCacheQueries.labels(path).inc();
     auto it = entries_.find(path);
     if (it == entries_.end()) {
-        it = entries_.emplace(path, Entry { path }).first;
-        fileWatcher_.watch(path, [this](std::error_code ec, std::string_view path) {
-            if (ec) {
-                entries_.erase(std::string(path));
-                return;
-            }
-            slog::info("file changed: '", path, "'");
-            entries_.at(std::string(path)).dirty = true;
-        });
+        it = entries_
+                 .emplace(path,
+                     CachedEntry { Entry { path }, Metrics::get().fileCacheQueries.labels(path),
+                         Metrics::get().fileCacheHits.labels(path),
+                         Metrics::get().fileCacheFailures.labels(path) })
+                 .first;
+        watch(path);
     }
+    auto& cached = it->second;
+    cached.queries.inc();
 
-    if (it->second.dirty) {
-        it->second.reload();
+    if (cached.entry.dirty) {
+        cached.entry.reload();
         // Reset dirty either way (error or not), so that we don't repeatedly try to load a file
         // that e.g. does not exist.
         // We wait for another modification before we try again.
-        it->second.dirty = false;
+        cached.entry.dirty = false;
     } else {
-        Metrics::get().fileCacheHits.labels(path).inc();
+        cached.hits.inc();
     }
 
-    if (!it->second.contents) {
-        Metrics::get().fileCacheFailures.labels(path).inc();
+    if (!cached.entry.contents) {
+        cached.failures.inc();
         return nullptr;
     }
-    return &it->second;
+    return &cached.entry;
+}
+
+void FileCache::watch(const std::string& path)
+{
+    auto& watcherIo = fileWatcher_.getIoQueue();
+    if (&watcherIo == &io_) {
+        fileWatcher_.watch(path, [this](std::error_code ec, std::string_view path) {
+            onFileChanged(ec, std::string(path));
+        });
+        return;
+    }
+    // The watch is only added, when the watcher's thread gets to it, so if the file changes right
+    // after we loaded it for the first time, we might miss it. I think that is acceptable.
+    watcherIo.post([this, path]() {
+        fileWatcher_.watch(path, [this](std::error_code ec, std::string_view path) {
+            io_.post([this, ec, path = std::string(path)]() { onFileChanged(ec, path); });
+        });
+    });
+}
+
+void FileCache::onFileChanged(std::error_code ec, const std::string& path)
+{
+    if (ec) {
+        entries_.erase(path);
+        return;
+    }
+    // The entry might have been removed because of an error, while the change was posted to us
+    const auto it = entries_.find(path);
+    if (it != entries_.end()) {
+        slog::info("file changed: '", path, "'");
+        it->second.entry.dirty = true;
+    }
 }
 
 namespace {
@@ -83,7 +122,7 @@ std::optional<std::string> formatTm(const std::tm* tm)
 void FileCache::Entry::reload()
 {
     slog::info("reload file: '", path, "'");
-    const auto cont = readFile(path);
+    auto cont = readFile(path);
     if (!cont) {
         // Error already logged
         return;
@@ -133,7 +172,7 @@ void FileCache::Entry::reload()
         return;
     }
 
-    contents = *cont;
+    contents = std::make_shared<const std::string>(std::move(*cont));
     eTag = eTagBuf;
     lastModified = *lm;
 }
@@ -1,9 +1,12 @@
 #pragma once
 
+#include <memory>
 #include <optional>
 #include <string>
 #include <unordered_map>
 
+#include <cpprom/cpprom.hpp>
+
 #include "filewatcher.hpp"
 #include "ioqueue.hpp"
 
@@ -13,7 +16,9 @@ class FileCache {
 public:
     struct Entry {
         std::string path;
-        std::optional<std::string> contents = std::nullopt;
+        // Immutable and replaced on reload, so responses can reference it (see
+        // Response::sharedBody) without copying
+        std::shared_ptr<const std::string> contents = nullptr;
         std::string eTag = "";
         std::string lastModified = "";
         bool dirty = true;
@@ -21,16 +26,35 @@ public:
         void reload();
     };
 
+    // Creates its own FileWatcher on io
     FileCache(IoQueue& io);
 
-    // As this server is fully single-threaded, we can get away with returning a reference
-    // because the reference might only be invalidated after the handler that is using it
-    // has finished. If this server was multi-threaded we should return shared_ptr here instead.
+    // The FileWatcher may belong to another IoQueue and be shared by many FileCaches (see
+    // Config::threads), in which case watches are added and changes are reported through
+    // IoQueue::post.
+    FileCache(IoQueue& io, FileWatcher& fileWatcher);
+
+    // Every thread has its own IoQueue and FileCache (see Config::threads), so we can get away
+    // with returning a reference, because the reference might only be invalidated after the
+    // handler that is using it has finished. If a FileCache was shared between threads, we should
+    // return shared_ptr here instead.
     // If std::optional<T&> was a thing, I would return that instead.
     const Entry* get(const std::string& path);
 
 private:
+    // Looking up the labels of a metric allocates, so it's only done when an entry is created
+    struct CachedEntry {
+        Entry entry;
+        cpprom::Counter& queries;
+        cpprom::Counter& hits;
+        cpprom::Counter& failures;
+    };
+
+    void watch(const std::string& path);
+    void onFileChanged(std::error_code ec, const std::string& path);
+
     IoQueue& io_;
-    FileWatcher fileWatcher_;
-    std::unordered_map<std::string, Entry> entries_;
+    std::unique_ptr<FileWatcher> ownFileWatcher_;
+    FileWatcher& fileWatcher_;
+    std::unordered_map<std::string, CachedEntry> entries_;
 };
@@ -44,15 +44,20 @@ bool FileWatcher::watch(
     auto& dirWatch = it->second;
     const auto filename = lastSep == std::string_view::npos ? std::string(path)
                                                             : std::string(path.substr(lastSep + 1));
-    if (dirWatch.fileWatches.count(filename)) {
-        slog::error("Already watching ", path);
-        return false;
+    auto fit = dirWatch.fileWatches.find(filename);
+    if (fit == dirWatch.fileWatches.end()) {
+        fit = dirWatch.fileWatches.emplace(filename, FileWatch { std::string(path), filename })
+                  .first;
     }
-    dirWatch.fileWatches.emplace(
-        filename, FileWatch { std::string(path), filename, std::move(callback) });
+    fit->second.callbacks.push_back(std::move(callback));
     return true;
 }
 
+IoQueue& FileWatcher::getIoQueue()
+{
+    return io_;
+}
+
 void FileWatcher::read()
 {
     io_.read(inotifyFd_, eventBuffer_, eventBufferLen,
@@ -83,9 +88,11 @@ void FileWatcher::onRead(std::error_code ec, int readBytes)
             if (dirWatch.wd < 0) {
                 slog::error(
                     "Could not rewatch directory '", dirWatch.path, "': ", errnoToString(errno));
+                const auto ec = std::make_error_code(static_cast<std::errc>(errno));
                 for (const auto& [filename, fileWatch] : dirWatch.fileWatches) {
-                    fileWatch.callback(
-                        std::make_error_code(static_cast<std::errc>(errno)), fileWatch.path);
+                    for (const auto& callback : fileWatch.callbacks) {
+                        callback(ec, fileWatch.path);
+                    }
                 }
                 dirWatches_.erase(dirWatch.path);
             }
@@ -94,7 +101,9 @@ void FileWatcher::onRead(std::error_code ec, int readBytes)
             const auto filename = std::string(event->name);
             const auto fit = dirWatch.fileWatches.find(filename);
             if (fit != dirWatch.fileWatches.end()) {
-                fit->second.callback(std::error_code(), fit->second.path);
+                for (const auto& callback : fit->second.callbacks) {
+                    callback(std::error_code(), fit->second.path);
+                }
             }
         }
         i += sizeof(inotify_event) + event->len;
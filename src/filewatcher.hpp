@@ -3,6 +3,7 @@
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include <sys/inotify.h>
 
@@ -15,16 +16,20 @@ public:
 
     ~FileWatcher();
 
+    // A path may be watched multiple times, in which case all callbacks are called.
     bool watch(std::string_view path,
         std::function<void(std::error_code ec, std::string_view path)> callback);
 
+    // The callbacks are called on the thread of this IoQueue and watch must be called from it.
+    IoQueue& getIoQueue();
+
 private:
     static constexpr auto eventBufferLen = 8 * (sizeof(inotify_event) + NAME_MAX + 1);
 
     struct FileWatch {
         std::string path;
         std::string filename;
-        std::function<void(std::error_code ec, std::string_view path)> callback;
+        std::vector<std::function<void(std::error_code ec, std::string_view path)>> callbacks = {};
     };
 
     struct DirWatch {
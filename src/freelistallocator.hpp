@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// An allocator that keeps single objects that were deallocated in a per-thread free list and
+// hands them out again, instead of going to operator new and delete every time. It's meant for
+// small objects that are created and destroyed all the time, like the control blocks of
+// shared_ptrs (see the shared_ptr constructors taking an allocator and std::allocate_shared),
+// which is why it has to work with any (rebound) type.
+// Memory is only ever returned to operator delete if the free list is full or when the thread
+// exits, so MaxFree limits how much memory a burst of objects can keep around.
+template <typename T, size_t MaxFree = 1024>
+class FreeListAllocator {
+public:
+    // operator new does not know about over-aligned types
+    static_assert(alignof(T) <= __STDCPP_DEFAULT_NEW_ALIGNMENT__);
+
+    using value_type = T;
+
+    // std::allocator_traits can only rebind allocators with type template parameters
+    template <typename U>
+    struct rebind {
+        using other = FreeListAllocator<U, MaxFree>;
+    };
+
+    FreeListAllocator() = default;
+
+    template <typename U>
+    FreeListAllocator(const FreeListAllocator<U, MaxFree>&)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        auto& freeList = getFreeList();
+        if (n == 1 && !freeList.ptrs.empty()) {
+            auto ptr = freeList.ptrs.back();
+            freeList.ptrs.pop_back();
+            return static_cast<T*>(ptr);
+        }
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n)
+    {
+        auto& freeList = getFreeList();
+        if (n == 1 && freeList.ptrs.size() < MaxFree) {
+            freeList.ptrs.push_back(ptr);
+            return;
+        }
+        ::operator delete(ptr);
+    }
+
+    template <typename U>
+    bool operator==(const FreeListAllocator<U, MaxFree>&) const
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const FreeListAllocator<U, MaxFree>&) const
+    {
+        return false;
+    }
+
+private:
+    struct FreeList {
+        std::vector<void*> ptrs;
+
+        ~FreeList()
+        {
+            for (auto ptr : ptrs) {
+                ::operator delete(ptr);
+            }
+        }
+    };
+
+    // One free list per thread and type. Objects deallocated on another thread than they
+    // were allocated on simply end up in that thread's free list.
+    static FreeList& getFreeList()
+    {
+        thread_local FreeList freeList;
+        return freeList;
+    }
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace detail {
+inline std::atomic<size_t> functionHeapAllocations { 0 };
+}
+
+// Number of callables that did not fit into the inline storage of a Function and had to be
+// allocated on the heap. This is only meant for benchmarks and tests.
+inline size_t getFunctionHeapAllocations()
+{
+    return detail::functionHeapAllocations.load(std::memory_order_relaxed);
+}
+
+template <typename Signature, size_t InlineSize = 48>
+class Function;
+
+// std::function needs to be copyable, so it can't hold anything move-only and it will allocate
+// for anything bigger than two pointers or so (which is every handler that captures a shared_ptr
+// and anything else). Every queued IO operation used to be two of those.
+// This is a move-only replacement with enough inline storage for all the callbacks in the server.
+// Callables that don't fit are still supported, but they are allocated on the heap.
+template <typename Ret, typename... Args, size_t InlineSize>
+class Function<Ret(Args...), InlineSize> {
+public:
+    Function() = default;
+
+    Function(std::nullptr_t)
+    {
+    }
+
+    template <typename F,
+        typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, Function>
+            && std::is_invocable_r_v<Ret, std::decay_t<F>&, Args...>>>
+    Function(F&& func)
+    {
+        using Func = std::decay_t<F>;
+        if constexpr (fitsInline<Func>()) {
+            new (&storage_) Func(std::forward<F>(func));
+            ops_ = &inlineOps<Func>;
+        } else {
+            detail::functionHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+            *reinterpret_cast<Func**>(&storage_) = new Func(std::forward<F>(func));
+            ops_ = &heapOps<Func>;
+        }
+    }
+
+    ~Function()
+    {
+        reset();
+    }
+
+    Function(const Function&) = delete;
+    Function& operator=(const Function&) = delete;
+
+    Function(Function&& other) noexcept
+    {
+        moveFrom(other);
+    }
+
+    Function& operator=(Function&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            moveFrom(other);
+        }
+        return *this;
+    }
+
+    Function& operator=(std::nullptr_t)
+    {
+        reset();
+        return *this;
+    }
+
+    explicit operator bool() const
+    {
+        return ops_ != nullptr;
+    }
+
+    Ret operator()(Args... args) const
+    {
+        assert(ops_);
+        return ops_->invoke(&storage_, std::forward<Args>(args)...);
+    }
+
+    void reset()
+    {
+        if (ops_) {
+            ops_->destroy(&storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        Ret (*invoke)(void* storage, Args&&... args);
+        // Move constructs into dst and destroys src
+        void (*move)(void* dst, void* src);
+        void (*destroy)(void* storage);
+    };
+
+    template <typename Func>
+    static constexpr bool fitsInline()
+    {
+        return sizeof(Func) <= InlineSize && alignof(Func) <= alignof(void*)
+            && std::is_nothrow_move_constructible_v<Func>;
+    }
+
+    template <typename Func>
+    static Ret invokeInline(void* storage, Args&&... args)
+    {
+        return (*static_cast<Func*>(storage))(std::forward<Args>(args)...);
+    }
+
+    template <typename Func>
+    static void moveInline(void* dst, void* src)
+    {
+        new (dst) Func(std::move(*static_cast<Func*>(src)));
+        static_cast<Func*>(src)->~Func();
+    }
+
+    template <typename Func>
+    static void destroyInline(void* storage)
+    {
+        static_cast<Func*>(storage)->~Func();
+    }
+
+    template <typename Func>
+    static Ret invokeHeap(void* storage, Args&&... args)
+    {
+        return (**static_cast<Func**>(storage))(std::forward<Args>(args)...);
+    }
+
+    static void moveHeap(void* dst, void* src)
+    {
+        *static_cast<void**>(dst) = *static_cast<void**>(src);
+    }
+
+    template <typename Func>
+    static void destroyHeap(void* storage)
+    {
+        delete *static_cast<Func**>(storage);
+    }
+
+    template <typename Func>
+    static constexpr Ops inlineOps { &invokeInline<Func>, &moveInline<Func>, &destroyInline<Func> };
+
+    template <typename Func>
+    static constexpr Ops heapOps { &invokeHeap<Func>, &moveHeap, &destroyHeap<Func> };
+
+    void moveFrom(Function& other)
+    {
+        if (other.ops_) {
+            other.ops_->move(&storage_, &other.storage_);
+            ops_ = other.ops_;
+            other.ops_ = nullptr;
+        }
+    }
+
+    static_assert(InlineSize >= sizeof(void*));
+    alignas(void*) mutable unsigned char storage_[InlineSize];
+    const Ops* ops_ = nullptr;
+};
@@ -115,7 +115,7 @@ HostHandler::HostHandler(const HostHandler& other)
 void HostHandler::operator()(const Request& request, std::shared_ptr<Responder> responder) const
 {
     const Host* host = nullptr;
-    const auto hostHeader = request.headers.get("Host");
+    const auto hostHeader = request.getHeader(KnownHeader::Host);
     for (const auto& h : hosts_) {
         if (hostHeader && h.name == *hostHeader) {
             host = &h;
@@ -155,7 +155,7 @@ void HostHandler::operator()(const Request& request, std::shared_ptr<Responder>
 bool HostHandler::metrics(const HostHandler::Host& host, const Request& request,
     std::shared_ptr<Responder> responder) const
 {
-    if (!host.metrics || request.url.path != *host.metrics) {
+    if (!host.metrics || std::string_view(request.url.path) != *host.metrics) {
         return false;
     }
 
@@ -169,7 +169,7 @@ bool HostHandler::metrics(const HostHandler::Host& host, const Request& request,
             return Response(
                 cpprom::Registry::getDefault().serialize(), "text/plain; version=0.0.4");
         },
-        [&host, requestPath = request.url.path, responder = std::move(responder)](
+        [&host, requestPath = std::string(request.url.path), responder = std::move(responder)](
             std::error_code ec, Response&& response) mutable {
             assert(!ec);
             host.addHeaders(requestPath, response);
@@ -184,9 +184,9 @@ bool HostHandler::acmeChallenges(
     const Host& host, const Request& request, std::shared_ptr<Responder> responder) const
 {
     for (const auto& client : host.acmeChallenges) {
-        const auto challenges = client->getChallenges();
+        const auto challenges = client->getChallenges(io_);
         for (const auto& challenge : *challenges) {
-            if (challenge.path == request.url.path) {
+            if (std::string_view(challenge.path) == request.url.path) {
                 if (request.method != Method::Get) {
                     responder->respond(Response(StatusCode::MethodNotAllowed));
                     return true;
@@ -277,27 +277,30 @@ void HostHandler::respondFile(const HostHandler::Host& host, const std::string&
         return;
     }
 
-    const auto ifNoneMatch = request.headers.get("If-None-Match");
+    // The headers of these responses are allocated from the arena of the request
+    const auto ifNoneMatch = request.getHeader(KnownHeader::IfNoneMatch);
     if (ifNoneMatch && ifNoneMatch->find(f->eTag) != std::string_view::npos) {
         // It seems to me I don't have to include ETag and Last-Modified here, but I am not sure.
-        responder->respond(Response(StatusCode::NotModified));
+        responder->respond(Response(StatusCode::NotModified, request.getAllocator()));
         return;
     }
 
-    const auto ifModifiedSince = request.headers.get("If-Modified-Since");
+    const auto ifModifiedSince = request.getHeader(KnownHeader::IfModifiedSince);
     if (ifModifiedSince && f->lastModified == *ifModifiedSince) {
-        responder->respond(Response(StatusCode::NotModified));
+        responder->respond(Response(StatusCode::NotModified, request.getAllocator()));
         return;
     }
 
     const auto extDelim = path.find_last_of('.');
-    const auto ext = path.substr(std::min(extDelim + 1, path.size()));
-    auto resp = Response(StatusCode::Ok);
+    const auto ext = std::string_view(path).substr(std::min(extDelim + 1, path.size()));
+    auto resp = Response(StatusCode::Ok, request.getAllocator());
     resp.headers.add("ETag", f->eTag);
     resp.headers.add("Last-Modified", f->lastModified);
-    resp.headers.add("Content-Type", getMimeType(std::string(ext)));
+    resp.headers.add("Content-Type", getMimeType(ext));
     if (request.method == Method::Get) {
-        resp.body = f->contents.value();
+        // This is only a reference to the cached file, which stays alive until the response is
+        // sent, even if the file is reloaded in the meantime
+        resp.sharedBody = f->contents;
     } else {
         assert(request.method == Method::Head);
         resp.headers.add("Content-Length", std::to_string(f->contents->size()));
@@ -306,10 +309,11 @@ void HostHandler::respondFile(const HostHandler::Host& host, const std::string&
     responder->respond(std::move(resp));
 }
 
-std::string HostHandler::getMimeType(const std::string& fileExt)
+std::string_view HostHandler::getMimeType(std::string_view fileExt)
 {
     // https://developer.mozilla.org/en-US/docs/Web/HTTP/Basics_of_HTTP/MIME_types/Common_types
-    static std::unordered_map<std::string, std::string> mimeTypes {
+    // The keys are string literals, so we can look up string_views without a std::string.
+    static const std::unordered_map<std::string_view, std::string_view> mimeTypes {
         { "aac", "audio/aac" },
         { "abw", "application/x-abiword" },
         { "arc", "application/x-freearc" },
@@ -41,7 +41,7 @@ private:
         void addHeaders(std::string_view requestPath, Response& response) const;
     };
 
-    static std::string getMimeType(const std::string& fileExt);
+    static std::string_view getMimeType(std::string_view fileExt);
 
     bool metrics(const Host& host, const Request&, std::shared_ptr<Responder> responder) const;
 
@@ -1,4 +1,9 @@
+#include <algorithm>
 #include <filesystem>
+#include <thread>
+
+#include <pthread.h>
+#include <sched.h>
 
 #include <clipp.hpp>
 
@@ -21,6 +26,9 @@ struct clipp::Value<IpPort> {
 
 struct Args : clipp::ArgsBase {
     std::optional<IpPort> listen;
+    std::optional<size_t> threads;
+    std::optional<std::string> ringProfile;
+    std::optional<size_t> zeroCopyThreshold;
     bool debug = false;
     bool checkConfig = false;
     // bool followSymlinks;
@@ -31,6 +39,13 @@ struct Args : clipp::ArgsBase {
     void args()
     {
         flag(listen, "listen", 'l').valueNames("IPPORT").help("ip:port or port");
+        flag(threads, "threads", 't').help("Number of threads (overrides config)");
+        flag(ringProfile, "ring-profile")
+            .valueNames("PROFILE")
+            .help("auto, plain, taskrun or sqpoll (overrides config)");
+        flag(zeroCopyThreshold, "zero-copy-threshold")
+            .valueNames("BYTES")
+            .help("Minimum body size for zero-copy sends, 0 disables them (overrides config)");
         flag(debug, "debug").help("Enable debug logging");
         flag(checkConfig, "check-config").help("Check the configuration and exit");
         // flag(followSymlinks, "follow", 'f').help("Follow symlinks");
@@ -42,83 +57,122 @@ struct Args : clipp::ArgsBase {
     }
 };
 
-int main(int argc, char** argv)
+namespace {
+IoQueue::Setup getIoQueueSetup(const Config& config)
 {
-    auto parser = clipp::Parser(argv[0]);
-    const Args args = parser.parse<Args>(argc, argv).value();
-    slog::init(args.debug ? slog::Severity::Debug : slog::Severity::Info);
+    switch (config.ioRingProfile) {
+    case Config::IoRingProfile::Plain:
+        return IoQueue::Setup::Plain;
+    case Config::IoRingProfile::TaskRun:
+        return IoQueue::Setup::TaskRun;
+    case Config::IoRingProfile::SqPoll:
+        return IoQueue::Setup::SqPoll;
+    default: {
+        // Every ring gets its own polling thread, which spins on a CPU while there is load, so on
+        // small machines it just takes CPU time away from the IoQueue threads.
+        const auto numCpus = std::max(std::thread::hardware_concurrency(), 1u);
+        return numCpus >= 2 * config.threads && IoQueue::isSetupSupported(IORING_SETUP_SQPOLL)
+            ? IoQueue::Setup::SqPoll
+            : IoQueue::Setup::TaskRun;
+    }
+    }
+}
 
-    auto& config = Config::get();
-    if (std::filesystem::is_regular_file(args.arg.value())) {
-        if (!config.loadFromFile(*args.arg)) {
-            return 1;
-        }
-    } else if (std::filesystem::is_directory(args.arg.value())) {
-        auto& service = config.services.emplace_back();
-        Config::Service::Host host;
-        host.files.push_back({ Pattern::create("/*").value(), pathJoin(*args.arg, "$1") });
-        host.metrics = args.metrics;
-        host.headers.push_back(
-            { Pattern::create("*").value(), { { "Cache-Control", "no-store" } } });
-        service.hosts.emplace("*", std::move(host));
+std::string describeSetup(const IoQueue& io)
+{
+    const auto flags = io.getSetupFlags();
+    std::string str;
+    if (flags & IORING_SETUP_SQPOLL) {
+        str = "submission queue polling";
+    } else if (flags & IORING_SETUP_DEFER_TASKRUN) {
+        str = "single issuer, deferred task work";
+    } else if (flags & IORING_SETUP_COOP_TASKRUN) {
+        str = "cooperative task work";
     } else {
-        slog::error("Invalid argument. Must either be a config file or a directory to serve");
-        return 1;
+        str = "plain submission";
     }
+    if (io.hasRegisteredRingFd()) {
+        str += ", registered ring fd";
+    }
+    return str;
+}
 
-    if (args.checkConfig) {
-        return 0;
+void setupIoQueue(IoQueue& io, const Config& config)
+{
+    if (config.ioProvidedBuffers > 0
+        && !io.registerProvidedBuffers(config.ioProvidedBuffers, config.ioProvidedBufferSize)) {
+        slog::info("Provided buffers not available. Using per-connection buffers.");
+    }
+    if (config.ioFixedFiles > 0 && !io.registerFixedFiles(config.ioFixedFiles)) {
+        slog::info("Fixed files not available. Using regular file descriptors.");
+    }
+#ifdef TLS_SUPPORT_ENABLED
+    // Only SslConnection uses them and they are pinned, so they would just be wasted otherwise
+    const auto hasTls = std::any_of(config.services.begin(), config.services.end(),
+        [](const Config::Service& service) { return service.tls.has_value(); });
+    if (hasTls && config.ioRegisteredBuffers > 0
+        && !io.registerBuffers(config.ioRegisteredBuffers, SslConnection::IoBufferSize)) {
+        slog::info("Registered buffers not available. Using per-connection buffers for TLS.");
     }
+#endif
+    io.setNumAsyncThreads(config.asyncThreads);
+}
 
-    if (args.listen) {
-        if (args.listen->ip) {
-            config.services.back().listenAddress = *args.listen->ip;
-        }
-        config.services.back().listenPort = args.listen->port;
+void pinThread(size_t index)
+{
+    const auto numCpus = std::max(std::thread::hardware_concurrency(), 1u);
+    ::cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(index % numCpus, &cpus);
+    const auto res = ::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus);
+    if (res != 0) {
+        slog::error("Could not pin thread ", index, ": ", errnoToString(res));
     }
+}
 
-    IoQueue io(config.ioQueueSize, config.ioSubmissionQueuePolling);
+// The TLS context managers and ACME clients live on the main thread (they need to watch files and
+// do requests), but they are shared by the servers of all threads.
+struct ServiceFactories {
+#ifdef TLS_SUPPORT_ENABLED
+    std::optional<SslServerConnectionFactory> ssl;
+    std::optional<AcmeSslConnectionFactory> acme;
+#endif
+};
 
-    // We share a file cache, because we don't need multiple and if we made it a member of
-    // HostHandler, HostHandler would not be copyable anymore, which it needs to be to be part of
-    // std::function (std::function copyable requirement is annoying again..)
-    FileCache fileCache(io);
+// Every thread has its own IoQueue, file cache and servers (and listen sockets), so they hardly
+// need to synchronize with each other at all. Only the file watcher is shared, because watching
+// the same files multiple times is pointless. It tells the file caches about changes through
+// IoQueue::post.
+void serve(IoQueue& io, const Config& config,
+    [[maybe_unused]] const std::vector<ServiceFactories>& factories, FileWatcher& fileWatcher,
+    bool logHosts)
+{
+    // The servers of a thread share a file cache, because we don't need multiple and if we made it
+    // a member of HostHandler, HostHandler would not be copyable anymore, which it needs to be to
+    // be part of std::function (std::function copyable requirement is annoying again..)
+    FileCache fileCache(io, fileWatcher);
 
     std::vector<std::unique_ptr<Server<TcpConnectionFactory>>> tcpServers;
-
 #ifdef TLS_SUPPORT_ENABLED
     std::vector<std::unique_ptr<Server<SslServerConnectionFactory>>> sslServers;
     std::vector<std::unique_ptr<Server<AcmeSslConnectionFactory>>> acmeSslServers;
-
-    for (const auto& [name, config] : config.acme) {
-        registerAcmeClient(name, io, config);
-    }
 #endif
 
-    for (const auto& service : config.services) {
+    for (size_t i = 0; i < config.services.size(); ++i) {
+        const auto& service = config.services[i];
         HostHandler handler(io, fileCache, service.hosts);
 
 #ifdef TLS_SUPPORT_ENABLED
-        if (service.tls) {
-            if (service.tls->acme) {
-                auto factory = AcmeSslConnectionFactory { getAcmeClient(*service.tls->acme) };
-                auto server = std::make_unique<Server<AcmeSslConnectionFactory>>(
-                    io, std::move(factory), std::move(handler), service);
-                server->start();
-                acmeSslServers.push_back(std::move(server));
-            } else {
-                assert(service.tls->chain && service.tls->key);
-                auto factory
-                    = SslServerConnectionFactory(io, *service.tls->chain, *service.tls->key);
-                if (!factory.contextManager->getCurrentContext()) {
-                    return 1;
-                }
-
-                auto server = std::make_unique<Server<SslServerConnectionFactory>>(
-                    io, std::move(factory), std::move(handler), service);
-                server->start();
-                sslServers.push_back(std::move(server));
-            }
+        if (factories[i].acme) {
+            auto server = std::make_unique<Server<AcmeSslConnectionFactory>>(
+                io, *factories[i].acme, std::move(handler), service);
+            server->start();
+            acmeSslServers.push_back(std::move(server));
+        } else if (factories[i].ssl) {
+            auto server = std::make_unique<Server<SslServerConnectionFactory>>(
+                io, *factories[i].ssl, std::move(handler), service);
+            server->start();
+            sslServers.push_back(std::move(server));
         } else {
             auto server = std::make_unique<Server<TcpConnectionFactory>>(
                 io, TcpConnectionFactory {}, std::move(handler), service);
@@ -132,6 +186,9 @@ int main(int argc, char** argv)
         tcpServers.push_back(std::move(server));
 #endif
 
+        if (!logHosts) {
+            continue;
+        }
         for (const auto& [name, host] : service.hosts) {
             std::vector<std::string> hosting;
             if (host.files.size()) {
@@ -150,5 +207,120 @@ int main(int argc, char** argv)
         }
     }
     io.run();
+}
+}
+
+int main(int argc, char** argv)
+{
+    auto parser = clipp::Parser(argv[0]);
+    const Args args = parser.parse<Args>(argc, argv).value();
+    slog::init(args.debug ? slog::Severity::Debug : slog::Severity::Info);
+
+    auto& config = Config::get();
+    if (std::filesystem::is_regular_file(args.arg.value())) {
+        if (!config.loadFromFile(*args.arg)) {
+            return 1;
+        }
+    } else if (std::filesystem::is_directory(args.arg.value())) {
+        auto& service = config.services.emplace_back();
+        Config::Service::Host host;
+        host.files.push_back({ Pattern::create("/*").value(), pathJoin(*args.arg, "$1") });
+        host.metrics = args.metrics;
+        host.headers.push_back(
+            { Pattern::create("*").value(), { { "Cache-Control", "no-store" } } });
+        service.hosts.emplace("*", std::move(host));
+    } else {
+        slog::error("Invalid argument. Must either be a config file or a directory to serve");
+        return 1;
+    }
+
+    if (args.checkConfig) {
+        return 0;
+    }
+
+    if (args.listen) {
+        if (args.listen->ip) {
+            config.services.back().listenAddress = *args.listen->ip;
+        }
+        config.services.back().listenPort = args.listen->port;
+    }
+
+    if (args.threads) {
+        config.threads = static_cast<uint32_t>(std::max(*args.threads, size_t(1)));
+    }
+    if (config.threads > 1) {
+        for (auto& service : config.services) {
+            service.reusePort = true;
+        }
+    }
+
+    if (args.zeroCopyThreshold) {
+        for (auto& service : config.services) {
+            service.zeroCopySendThreshold = *args.zeroCopyThreshold;
+        }
+    }
+
+    if (args.ringProfile) {
+        const auto profile = Config::parseIoRingProfile(*args.ringProfile);
+        if (!profile) {
+            slog::error("Invalid ring profile '", *args.ringProfile, "'");
+            return 1;
+        }
+        config.ioRingProfile = *profile;
+    }
+
+    const auto ioSetup = getIoQueueSetup(config);
+    IoQueue io(config.ioQueueSize, ioSetup, config.ioCompletionQueueSize);
+    setupIoQueue(io, config);
+    slog::info("io_uring: ", describeSetup(io));
+
+    std::vector<ServiceFactories> factories(config.services.size());
+#ifdef TLS_SUPPORT_ENABLED
+    for (const auto& [name, config] : config.acme) {
+        registerAcmeClient(name, io, config);
+    }
+
+    for (size_t i = 0; i < config.services.size(); ++i) {
+        const auto& service = config.services[i];
+        if (!service.tls) {
+            continue;
+        }
+        if (service.tls->acme) {
+            factories[i].acme = AcmeSslConnectionFactory { getAcmeClient(*service.tls->acme) };
+        } else {
+            assert(service.tls->chain && service.tls->key);
+            factories[i].ssl.emplace(io, *service.tls->chain, *service.tls->key);
+            if (!factories[i].ssl->contextManager->getCurrentContext(io)) {
+                return 1;
+            }
+        }
+    }
+#endif
+
+    FileWatcher fileWatcher(io);
+
+    // The main thread is the first of the threads
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < config.threads; ++i) {
+        threads.emplace_back([i, ioSetup, &config, &factories, &fileWatcher]() {
+            if (config.pinThreads) {
+                pinThread(i);
+            }
+            IoQueue threadIo(config.ioQueueSize, ioSetup, config.ioCompletionQueueSize);
+            setupIoQueue(threadIo, config);
+            serve(threadIo, config, factories, fileWatcher, false);
+        });
+    }
+    if (config.threads > 1) {
+        slog::info("Running ", config.threads, " threads");
+    }
+    if (config.pinThreads) {
+        pinThread(0);
+    }
+    serve(io, config, factories, fileWatcher, true);
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
     return 0;
 }
@@ -1,6 +1,9 @@
 #include "http.hpp"
 
 #include <cassert>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
 
 #include "config.hpp"
 #include "log.hpp"
@@ -30,6 +33,54 @@ std::optional<Method> parseMethod(std::string_view method)
     return std::nullopt;
 }
 
+std::optional<KnownHeader> getKnownHeader(std::string_view name)
+{
+    // All of them have a different length, so we only need a single compare
+    const auto check = [name](std::string_view known, KnownHeader header) {
+        return ciEqual(name, known) ? std::optional<KnownHeader>(header) : std::nullopt;
+    };
+    switch (name.size()) {
+    case 4:
+        return check("Host", KnownHeader::Host);
+    case 5:
+        return check("Range", KnownHeader::Range);
+    case 10:
+        return check("Connection", KnownHeader::Connection);
+    case 13:
+        return check("If-None-Match", KnownHeader::IfNoneMatch);
+    case 14:
+        return check("Content-Length", KnownHeader::ContentLength);
+    case 15:
+        return check("Accept-Encoding", KnownHeader::AcceptEncoding);
+    case 17:
+        return check("If-Modified-Since", KnownHeader::IfModifiedSince);
+    default:
+        return std::nullopt;
+    }
+}
+
+std::string_view toString(KnownHeader header)
+{
+    switch (header) {
+    case KnownHeader::Host:
+        return "Host";
+    case KnownHeader::ContentLength:
+        return "Content-Length";
+    case KnownHeader::Connection:
+        return "Connection";
+    case KnownHeader::IfNoneMatch:
+        return "If-None-Match";
+    case KnownHeader::IfModifiedSince:
+        return "If-Modified-Since";
+    case KnownHeader::Range:
+        return "Range";
+    case KnownHeader::AcceptEncoding:
+        return "Accept-Encoding";
+    default:
+        return "";
+    }
+}
+
 std::string toString(Method method)
 {
     switch (method) {
@@ -56,9 +107,78 @@ std::string toString(Method method)
     }
 }
 
+namespace {
+// line must not contain the line break
+bool parseHeaderLine(std::string_view line, std::string_view& name, std::string_view& value)
+{
+    const auto colon = line.find(':');
+    if (colon == std::string_view::npos) {
+        slog::debug("No colon in header line");
+        return false;
+    }
+    name = line.substr(0, colon);
+    value = httpTrim(line.substr(colon + 1));
+    return true;
+}
+
+struct RequestLine {
+    Method method;
+    std::string_view url;
+    std::string_view version;
+};
+
+std::optional<RequestLine> parseRequestLine(std::string_view requestLine)
+{
+    const auto methodDelim = requestLine.find(' ');
+    if (methodDelim == std::string::npos) {
+        slog::debug("No method delimiter");
+        return std::nullopt;
+    }
+    const auto methodStr = requestLine.substr(0, methodDelim);
+    // We'll allow OPTIONS in HTTP/1.0 too
+    const auto method = parseMethod(methodStr);
+    if (!method) {
+        slog::debug("Invalid method");
+        return std::nullopt;
+    }
+
+    // I could skip all whitespace here to be more robust, but RFC2616 5.1 only mentions 1 SP
+    const auto urlStart = methodDelim + 1;
+    if (urlStart >= requestLine.size()) {
+        slog::debug("No URL");
+        return std::nullopt;
+    }
+    const auto urlLen = requestLine.substr(urlStart).find(' ');
+    if (urlLen == std::string::npos) {
+        slog::debug("No URL end");
+        return std::nullopt;
+    }
+
+    const auto versionStart = urlStart + urlLen + 1;
+    if (versionStart > requestLine.size()) {
+        slog::debug("No version start");
+        return std::nullopt;
+    }
+    const auto version = requestLine.substr(versionStart);
+    if (version.size() != 8 || version.substr(0, 7) != "HTTP/1."
+        || (version[7] != '0' && version[7] != '1')) {
+        slog::debug("Invalid version");
+        return std::nullopt;
+    }
+
+    return RequestLine { *method, requestLine.substr(urlStart, urlLen), version };
+}
+}
+
+template <typename StringType>
+HeaderMap<StringType>::HeaderMap(ArenaAllocator<char> alloc)
+    : headers_(alloc)
+{
+}
+
 template <typename StringType>
 HeaderMap<StringType>::HeaderMap(std::vector<std::pair<StringType, StringType>> h)
-    : headers_(std::move(h))
+    : headers_(std::make_move_iterator(h.begin()), std::make_move_iterator(h.end()))
 {
 }
 
@@ -94,7 +214,18 @@ std::vector<std::string_view> HeaderMap<StringType>::getAll(std::string_view nam
 template <typename StringType>
 void HeaderMap<StringType>::add(std::string_view name, std::string_view value)
 {
-    headers_.emplace_back(StringType(name), StringType(value));
+    if constexpr (std::is_same_v<StringType, ArenaString>) {
+        const auto alloc = headers_.get_allocator();
+        headers_.emplace_back(StringType(name, alloc), StringType(value, alloc));
+    } else {
+        headers_.emplace_back(StringType(name), StringType(value));
+    }
+}
+
+template <typename StringType>
+void HeaderMap<StringType>::reserve(size_t numHeaders)
+{
+    headers_.reserve(numHeaders);
 }
 
 template <typename StringType>
@@ -127,11 +258,17 @@ std::optional<std::string_view> HeaderMap<StringType>::operator[](std::string_vi
 }
 
 template <typename StringType>
-const std::vector<std::pair<StringType, StringType>>& HeaderMap<StringType>::getEntries() const
+const typename HeaderMap<StringType>::Entries& HeaderMap<StringType>::getEntries() const
 {
     return headers_;
 }
 
+template <typename StringType>
+ArenaAllocator<char> HeaderMap<StringType>::getAllocator() const
+{
+    return headers_.get_allocator();
+}
+
 template <typename StringType>
 void HeaderMap<StringType>::serialize(std::string& str) const
 {
@@ -151,13 +288,10 @@ bool HeaderMap<StringType>::parse(std::string_view str)
         const auto headerLineEnd = str.find("\r\n", cursor);
         const auto line = str.substr(cursor,
             headerLineEnd == std::string_view::npos ? headerLineEnd : headerLineEnd - cursor);
-        auto colon = line.find(':');
-        if (colon == std::string_view::npos) {
-            slog::debug("No colon in header line");
+        std::string_view name, value;
+        if (!parseHeaderLine(line, name, value)) {
             return false;
         }
-        const auto name = line.substr(0, colon);
-        const auto value = httpTrim(line.substr(colon + 1));
         add(name, value);
         if (headerLineEnd == std::string_view::npos) {
             break;
@@ -180,16 +314,17 @@ std::optional<size_t> HeaderMap<StringType>::find(std::string_view name) const
 
 template class HeaderMap<std::string_view>;
 template class HeaderMap<std::string>;
+template class HeaderMap<ArenaString>;
 
 namespace {
-std::string removeDotSegments(std::string_view input)
+ArenaString removeDotSegments(std::string_view input, ArenaAllocator<char> alloc)
 {
     // RFC3986, 5.2.4: Remove Dot Segments
     // This algorithm is a bit different, because of the following assert (ensured in Url::parse).
     // If we leave the trailing slashes in the input buffer, we know that after every step in the
     // loop below, inputLeft still starts with a slash.
     assert(!input.empty() && input[0] == '/');
-    std::string output;
+    ArenaString output(alloc);
     output.reserve(input.size());
     while (!input.empty()) {
         assert(input[0] == '/');
@@ -242,13 +377,12 @@ bool isSchemeChar(char ch)
 }
 }
 
-std::optional<Url> Url::parse(std::string_view urlStr)
+std::optional<Url> Url::parse(std::string_view urlStr, ArenaAllocator<char> alloc)
 {
     constexpr auto npos = std::string_view::npos;
 
     Url url;
     url.fullRaw = urlStr;
-    urlStr = std::string_view(url.fullRaw);
 
     // There was a case for urlStr == "*" before, but it was referencing a section in an RFC does
     // not exist. I'll leave this comment in case a more knowledgable me in the future knows what
@@ -337,15 +471,17 @@ std::optional<Url> Url::parse(std::string_view urlStr)
     if (urlStr.empty() || urlStr[0] != '/') {
         return std::nullopt;
     }
-    url.path = removeDotSegments(urlStr);
+    url.path = removeDotSegments(urlStr, alloc);
 
     return url;
 }
 
-std::optional<Request> Request::parse(std::string_view requestStr)
+std::optional<Request> Request::parse(std::string_view requestStr, ArenaAllocator<char> alloc)
 {
     // e.g.: GET /foobar/barbar HTTP/1.1\r\nHost: example.org\r\n\r\n
     Request req;
+    req.headers = HeaderMap<std::string_view>(alloc);
+    req.params = decltype(req.params)(alloc);
 
     const auto requestLineEnd = requestStr.find("\r\n");
     if (requestLineEnd == std::string::npos) {
@@ -354,50 +490,18 @@ std::optional<Request> Request::parse(std::string_view requestStr)
     }
     req.requestLine = requestStr.substr(0, requestLineEnd);
 
-    const auto methodDelim = req.requestLine.find(' ');
-    if (methodDelim == std::string::npos) {
-        slog::debug("No method delimiter");
-        return std::nullopt;
-    }
-    const auto methodStr = req.requestLine.substr(0, methodDelim);
-    // We'll allow OPTIONS in HTTP/1.0 too
-    const auto method = parseMethod(methodStr);
-    if (!method) {
-        slog::debug("Invalid method");
-        return std::nullopt;
-    }
-    req.method = *method;
-
-    // I could skip all whitespace here to be more robust, but RFC2616 5.1 only mentions 1 SP
-    const auto urlStart = methodDelim + 1;
-    if (urlStart >= req.requestLine.size()) {
-        slog::debug("No URL");
-        return std::nullopt;
-    }
-    const auto urlLen = req.requestLine.substr(urlStart).find(' ');
-    if (urlLen == std::string::npos) {
-        slog::debug("No URL end");
+    const auto requestLine = parseRequestLine(req.requestLine);
+    if (!requestLine) {
         return std::nullopt;
     }
-    const auto url = Url::parse(req.requestLine.substr(urlStart, urlLen));
+    req.method = requestLine->method;
+    auto url = Url::parse(requestLine->url, alloc);
     if (!url) {
         slog::debug("Invalid URL");
         return std::nullopt;
     }
-    req.url = url.value();
-
-    const auto versionStart = urlStart + urlLen + 1;
-    if (versionStart > req.requestLine.size()) {
-        slog::debug("No version start");
-        return std::nullopt;
-    }
-    req.version = req.requestLine.substr(versionStart);
-
-    if (req.version.size() != 8 || req.version.substr(0, 7) != "HTTP/1."
-        || (req.version[7] != '0' && req.version[7] != '1')) {
-        slog::debug("Invalid version");
-        return std::nullopt;
-    }
+    req.url = std::move(*url);
+    req.version = requestLine->version;
 
     const auto headersStart = requestLineEnd + 2;
     const auto headersEnd = requestStr.find("\r\n\r\n", headersStart);
@@ -412,11 +516,200 @@ std::optional<Request> Request::parse(std::string_view requestStr)
         return std::nullopt;
     }
 
+    req.resolveKnownHeaders();
+
     req.body = requestStr.substr(headersEnd + 4);
 
     return req;
 }
 
+ArenaAllocator<char> Request::getAllocator() const
+{
+    return headers.getAllocator();
+}
+
+std::optional<std::string_view> Request::getHeader(KnownHeader header) const
+{
+    if (!knownHeadersResolved) {
+        return headers.get(toString(header));
+    }
+    return knownHeaders[static_cast<size_t>(header)];
+}
+
+void Request::resolveKnownHeaders()
+{
+    knownHeaders = {};
+    for (const auto& [name, value] : headers.getEntries()) {
+        addKnownHeader(name, value);
+    }
+    knownHeadersResolved = true;
+}
+
+void Request::addKnownHeader(std::string_view name, std::string_view value)
+{
+    const auto header = getKnownHeader(name);
+    if (header) {
+        auto& slot = knownHeaders[static_cast<size_t>(*header)];
+        // HeaderMap::get returns the first one too
+        if (!slot) {
+            slot = value;
+        }
+    }
+}
+
+void RequestParser::reset(ArenaAllocator<char> alloc)
+{
+    alloc_ = alloc;
+    headerLines_ = decltype(headerLines_)(alloc);
+    // Browsers send about this many, so the vector does not have to grow (and leave all the old
+    // arrays behind in the arena) for a typical request.
+    // Without an arena this is most likely just the Session dropping the last request, so don't
+    // allocate anything then.
+    if (alloc.getArena()) {
+        headerLines_.reserve(16);
+    }
+    tokenizer_.reset();
+    state_ = State::RequestLine;
+    scanned_ = 0;
+    lineStart_ = 0;
+    headerSize_ = 0;
+    requestLineSize_ = 0;
+}
+
+RequestParser::Result RequestParser::parse(std::string_view data, Request& request)
+{
+    assert(headerSize_ == 0 && scanned_ <= data.size());
+    // Complete lines are processed once and only their offsets are saved, because data might be
+    // moved to another buffer between calls (see Session::continueRequestHeader).
+    if (state_ == State::RequestLine) {
+        // A request line must not contain control characters, so the first one has to be the CR
+        // before the LF. This skips HTAB, but it never checked that before either.
+        const auto end = tokenizer_.findFieldValueEnd(data, scanned_);
+        if (end == data.size()) {
+            scanned_ = end;
+            return Result::Incomplete;
+        }
+        if (data[end] != '\r') {
+            slog::debug("Request line does not end with CRLF");
+            return Result::Error;
+        }
+        const auto requestLine = parseRequestLine(data.substr(0, end));
+        if (!requestLine) {
+            return Result::Error;
+        }
+        method_ = requestLine->method;
+        urlOffset_ = requestLine->url.data() - data.data();
+        urlSize_ = requestLine->url.size();
+        requestLineSize_ = end;
+        scanned_ = end + 1;
+        state_ = State::HeaderLineEnd;
+    }
+
+    // The states are checked in the order a header line goes through them, so a complete line is
+    // handled in one iteration without jumping around (which the branch predictor does not like).
+    while (true) {
+        if (state_ == State::HeaderLineEnd || state_ == State::HeadersEnd) {
+            if (scanned_ == data.size()) {
+                return Result::Incomplete;
+            }
+            if (data[scanned_] != '\n') {
+                slog::debug("Line does not end with CRLF");
+                return Result::Error;
+            }
+            scanned_++;
+            if (state_ == State::HeadersEnd) {
+                headerSize_ = scanned_;
+                return finish(data, request) ? Result::Complete : Result::Error;
+            }
+            lineStart_ = scanned_;
+            state_ = State::HeaderName;
+        }
+
+        if (state_ == State::HeaderName) {
+            const auto end = tokenizer_.findTokenEnd(data, scanned_);
+            if (end == data.size()) {
+                scanned_ = end;
+                return Result::Incomplete;
+            }
+            scanned_ = end + 1;
+            if (data[end] == ':' && end > lineStart_) {
+                colon_ = end;
+                state_ = State::HeaderValue;
+            } else if (data[end] == '\r' && end == lineStart_) {
+                state_ = State::HeadersEnd;
+                continue;
+            } else {
+                // This includes whitespace before the colon and obsolete line folding, which
+                // must be rejected (RFC9112, 5.1 and 5.2)
+                slog::debug("Invalid character in header name");
+                return Result::Error;
+            }
+        }
+
+        assert(state_ == State::HeaderValue);
+        const auto end = tokenizer_.findFieldValueEnd(data, scanned_);
+        if (end == data.size()) {
+            scanned_ = end;
+            return Result::Incomplete;
+        }
+        if (data[end] != '\r') {
+            slog::debug("Invalid character in header value");
+            return Result::Error;
+        }
+        // This is httpTrim, but it runs for every header line and the call alone costs more than
+        // skipping the single space most values start with.
+        auto valueStart = colon_ + 1;
+        while (valueStart < end && (data[valueStart] == ' ' || data[valueStart] == '\t')) {
+            valueStart++;
+        }
+        auto valueEnd = end;
+        while (valueEnd > valueStart && (data[valueEnd - 1] == ' ' || data[valueEnd - 1] == '\t')) {
+            valueEnd--;
+        }
+        headerLines_.push_back(HeaderLine {
+            static_cast<uint32_t>(lineStart_),
+            static_cast<uint32_t>(colon_ - lineStart_),
+            static_cast<uint32_t>(valueStart),
+            static_cast<uint32_t>(valueEnd - valueStart),
+        });
+        scanned_ = end + 1;
+        state_ = State::HeaderLineEnd;
+    }
+}
+
+size_t RequestParser::getHeaderSize() const
+{
+    return headerSize_;
+}
+
+bool RequestParser::finish(std::string_view data, Request& request)
+{
+    // Now data will not move anymore and we can create the views
+    request.requestLine = data.substr(0, requestLineSize_);
+    request.method = method_;
+    auto url = Url::parse(data.substr(urlOffset_, urlSize_), alloc_);
+    if (!url) {
+        slog::debug("Invalid URL");
+        return false;
+    }
+    request.url = std::move(*url);
+    // The version is always "HTTP/1.x" (see parseRequestLine)
+    request.version = data.substr(requestLineSize_ - 8, 8);
+    request.headers = HeaderMap<std::string_view>(alloc_);
+    request.headers.reserve(headerLines_.size());
+    request.knownHeaders = {};
+    for (const auto& line : headerLines_) {
+        const auto name = data.substr(line.nameOffset, line.nameSize);
+        const auto value = data.substr(line.valueOffset, line.valueSize);
+        request.headers.add(name, value);
+        request.addKnownHeader(name, value);
+    }
+    request.knownHeadersResolved = true;
+    request.body = data.substr(headerSize_);
+    request.params = decltype(request.params)(alloc_);
+    return true;
+}
+
 Response::Response()
     : status(StatusCode::Invalid)
 {
@@ -448,6 +741,13 @@ Response::Response(StatusCode status)
     addServerHeader();
 }
 
+Response::Response(StatusCode status, ArenaAllocator<char> alloc)
+    : status(status)
+    , headers(alloc)
+{
+    addServerHeader();
+}
+
 Response::Response(StatusCode status, std::string body, std::string_view contentType)
     : status(status)
     , body(std::move(body))
@@ -456,6 +756,18 @@ Response::Response(StatusCode status, std::string body, std::string_view content
     headers.add("Content-Type", contentType);
 }
 
+Response::Response(std::shared_ptr<const std::string> body, std::string_view contentType)
+    : sharedBody(std::move(body))
+{
+    addServerHeader();
+    headers.add("Content-Type", contentType);
+}
+
+std::string_view Response::getBody() const
+{
+    return sharedBody ? std::string_view(*sharedBody) : std::string_view(body);
+}
+
 void Response::addServerHeader()
 {
     // I think it's useful to provide this header so clients can work around issues,
@@ -466,29 +778,29 @@ void Response::addServerHeader()
     headers.add("Server", "htcpp");
 }
 
-std::string Response::string(std::string_view httpVersion) const
+void Response::serializeHeader(std::string& s, std::string_view httpVersion) const
 {
-    std::string s;
-    s.reserve(512);
-    auto size = 12 + 2; // status line
-    const auto headerEntries = headers.getEntries();
-    for (const auto& [name, value] : headerEntries) {
-        size += name.size() + value.size() + 4;
-    }
-    size += 2;
-    size += body.size();
     s.append(httpVersion);
     s.append(" ");
     s.append(std::to_string(static_cast<int>(status)));
     // The reason phrase may be empty, but the separator space is not optional
     s.append(" \r\n");
     headers.serialize(s);
+    const auto body = getBody();
     if (!headers.contains("Content-Length") && !body.empty()) {
         s.append("Content-Length: ");
         s.append(std::to_string(body.size()));
         s.append("\r\n");
     }
     s.append("\r\n");
+}
+
+std::string Response::string(std::string_view httpVersion) const
+{
+    const auto body = getBody();
+    std::string s;
+    s.reserve(512 + body.size());
+    serializeHeader(s, httpVersion);
     s.append(body);
     return s;
 }
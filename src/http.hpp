@@ -1,11 +1,16 @@
 #pragma once
 
+#include <array>
 #include <cassert>
+#include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <vector>
 
+#include "arena.hpp"
+#include "httptokenizer.hpp"
 #include "string.hpp"
 
 enum class Method {
@@ -100,19 +105,46 @@ enum class StatusCode : uint32_t {
     NetworkAuthenticationRequired = 511,
 };
 
+// Request headers the server looks at itself. They are resolved once while parsing, so that
+// Request::getHeader is an array access instead of a case-insensitive compare with every header.
+enum class KnownHeader : uint8_t {
+    Host,
+    ContentLength,
+    Connection,
+    IfNoneMatch,
+    IfModifiedSince,
+    Range,
+    AcceptEncoding,
+    Count,
+};
+
+// Case-insensitive
+std::optional<KnownHeader> getKnownHeader(std::string_view name);
+std::string_view toString(KnownHeader header);
+
+// A std::string that may be allocated from an Arena
+using ArenaString = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+
 template <typename StringType = std::string>
 class HeaderMap {
 public:
+    using Entry = std::pair<StringType, StringType>;
+    using Entries = std::vector<Entry, ArenaAllocator<Entry>>;
+
     HeaderMap() = default;
+    // The entries are allocated with alloc and for ArenaString the names and values as well
+    explicit HeaderMap(ArenaAllocator<char> alloc);
     HeaderMap(std::vector<std::pair<StringType, StringType>> h);
 
     bool contains(std::string_view name) const;
     std::optional<std::string_view> get(std::string_view name) const;
     std::vector<std::string_view> getAll(std::string_view name) const;
     std::optional<std::string_view> operator[](std::string_view name) const; // get
-    const std::vector<std::pair<StringType, StringType>>& getEntries() const;
+    const Entries& getEntries() const;
+    ArenaAllocator<char> getAllocator() const;
 
     void add(std::string_view name, std::string_view value);
+    void reserve(size_t numHeaders);
     size_t set(std::string_view name, std::string_view value);
     size_t remove(std::string_view name);
 
@@ -122,27 +154,29 @@ public:
 private:
     std::optional<size_t> find(std::string_view name) const;
 
-    std::vector<std::pair<StringType, StringType>> headers_;
+    Entries headers_;
 };
 
 extern template class HeaderMap<std::string_view>;
 extern template class HeaderMap<std::string>;
+extern template class HeaderMap<ArenaString>;
 
 struct Url {
-    std::string fullRaw;
-    // Most of these are view referencing 'fullRaw'.
+    // All of these except path are views referencing the string passed to parse, which has to
+    // outlive the Url.
+    std::string_view fullRaw;
     std::string_view scheme;
     std::string_view netLoc;
     std::string_view host; // this is a substring of netLoc
     uint16_t port = 0;
-    // This is not a view because of the removal of dot segments.
     std::string_view targetRaw;
-    std::string path;
+    // This is not a view because of the removal of dot segments.
+    ArenaString path;
     std::string_view params;
     std::string_view query;
     std::string_view fragment; // This is not technically considered part of the URL (RFC1808)
 
-    static std::optional<Url> parse(std::string_view urlStr);
+    static std::optional<Url> parse(std::string_view urlStr, ArenaAllocator<char> alloc = {});
 };
 
 struct Request {
@@ -153,15 +187,104 @@ struct Request {
     HeaderMap<std::string_view> headers;
     std::string_view body;
 
-    std::unordered_map<std::string_view, std::string_view> params;
+    std::unordered_map<std::string_view, std::string_view, std::hash<std::string_view>,
+        std::equal_to<std::string_view>,
+        ArenaAllocator<std::pair<const std::string_view, std::string_view>>>
+        params;
+
+    // The first value of every KnownHeader that is in headers. Only filled if
+    // knownHeadersResolved is set.
+    std::array<std::optional<std::string_view>, static_cast<size_t>(KnownHeader::Count)>
+        knownHeaders = {};
+    // Set by parse, RequestParser and resolveKnownHeaders. If you build a Request yourself and
+    // don't call resolveKnownHeaders, getHeader just searches headers.
+    bool knownHeadersResolved = false;
+
+    // Everything the Request has to allocate, is allocated with alloc. The Session parses the
+    // request with the allocator of an arena that is reset before the next request.
+    static std::optional<Request> parse(
+        std::string_view requestStr, ArenaAllocator<char> alloc = {});
+
+    // The allocator the request was parsed with. Handlers can pass it to Response, so the
+    // response headers are allocated from the same arena.
+    ArenaAllocator<char> getAllocator() const;
+
+    // Same as headers.get(name), but without the linear search (if knownHeadersResolved)
+    std::optional<std::string_view> getHeader(KnownHeader header) const;
+
+    // Fills knownHeaders from headers. Call it again if you change headers afterwards.
+    void resolveKnownHeaders();
 
-    static std::optional<Request> parse(std::string_view requestStr);
+    // Adds the header to knownHeaders, if it is one of them. headers is not touched.
+    void addKnownHeader(std::string_view name, std::string_view value);
+};
+
+// Parses a request header incrementally, so it can be fed the data as it arrives. Every call
+// only looks at the bytes that were not there in the last call. Header names and values are
+// validated while looking for their end (see httptokenizer.hpp), so broken requests are rejected
+// early.
+class RequestParser {
+public:
+    enum class Result {
+        Incomplete,
+        Complete,
+        Error,
+    };
+
+    // Must be called before every request. headerLines_ and the Request are allocated with alloc.
+    void reset(ArenaAllocator<char> alloc = {});
+
+    // data must contain everything that was passed before (plus whatever arrived since), but it
+    // may be a different buffer. If it returns Complete, request references data (and the body
+    // is whatever follows the header in data). It must not be called again after that.
+    Result parse(std::string_view data, Request& request);
+
+    // Size of the request line and headers including the empty line (only if complete)
+    size_t getHeaderSize() const;
+
+private:
+    enum class State {
+        RequestLine,
+        HeaderName,
+        HeaderValue,
+        HeaderLineEnd, // LF after the request line or a header line
+        HeadersEnd, // LF of the empty line
+    };
+
+    // Offsets into data
+    struct HeaderLine {
+        uint32_t nameOffset;
+        uint32_t nameSize;
+        uint32_t valueOffset;
+        uint32_t valueSize;
+    };
+
+    bool finish(std::string_view data, Request& request);
+
+    ArenaAllocator<char> alloc_;
+    HttpTokenizer tokenizer_;
+    std::vector<HeaderLine, ArenaAllocator<HeaderLine>> headerLines_;
+    State state_ = State::RequestLine;
+    // Everything before this was looked at already
+    size_t scanned_ = 0;
+    size_t lineStart_ = 0;
+    size_t colon_ = 0;
+    size_t headerSize_ = 0;
+    // 0 until the request line is complete
+    size_t requestLineSize_ = 0;
+    Method method_ = Method::Get;
+    size_t urlOffset_ = 0;
+    size_t urlSize_ = 0;
 };
 
 struct Response {
     StatusCode status = StatusCode::Ok;
-    HeaderMap<std::string> headers;
+    HeaderMap<ArenaString> headers;
     std::string body = {};
+    // If this is set, it is sent instead of body. It's immutable and shared (e.g. with the
+    // FileCache), so that large bodies don't need to be copied for every response. The Session
+    // holds on to it until the response is sent, so the owner may replace it at any time.
+    std::shared_ptr<const std::string> sharedBody = nullptr;
 
     Response();
 
@@ -171,12 +294,24 @@ struct Response {
 
     Response(StatusCode status);
 
+    // The headers are allocated with alloc (e.g. Request::getAllocator)
+    Response(StatusCode status, ArenaAllocator<char> alloc);
+
     Response(StatusCode status, std::string body);
 
     Response(StatusCode status, std::string body, std::string_view contentType);
 
+    Response(std::shared_ptr<const std::string> body, std::string_view contentType);
+
+    // sharedBody if it is set, body otherwise
+    std::string_view getBody() const;
+
     void addServerHeader();
 
+    // Appends the status line and headers (including the empty line), but not the body, so they
+    // can be sent separately without copying the body.
+    void serializeHeader(std::string& str, std::string_view httpVersion = "HTTP/1.1") const;
+
     std::string string(std::string_view httpVersion = "HTTP/1.1") const;
 
     static std::optional<Response> parse(std::string_view responseStr);
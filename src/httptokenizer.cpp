@@ -0,0 +1,258 @@
+#include "httptokenizer.hpp"
+
+#include <array>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HTTP_TOKENIZER_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+constexpr bool isTchar(uint8_t ch)
+{
+    if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || (ch >= '0' && ch <= '9')) {
+        return true;
+    }
+    switch (ch) {
+    case '!':
+    case '#':
+    case '$':
+    case '%':
+    case '&':
+    case '\'':
+    case '*':
+    case '+':
+    case '-':
+    case '.':
+    case '^':
+    case '_':
+    case '`':
+    case '|':
+    case '~':
+        return true;
+    default:
+        return false;
+    }
+}
+
+// VCHAR, SP, HTAB and obs-text
+constexpr bool isFieldValueChar(uint8_t ch)
+{
+    return ch == '\t' || (ch >= 0x20 && ch != 0x7f);
+}
+
+constexpr std::array<uint8_t, 256> makeClassTable()
+{
+    std::array<uint8_t, 256> table {};
+    for (size_t i = 0; i < table.size(); ++i) {
+        const auto ch = static_cast<uint8_t>(i);
+        table[i] = static_cast<uint8_t>((isTchar(ch) ? 0 : 1) | (isFieldValueChar(ch) ? 0 : 2));
+    }
+    return table;
+}
+}
+
+constexpr std::array<uint8_t, 256> charClassTable = makeClassTable();
+
+namespace {
+CharClasses classifyCharsScalar(const char* data)
+{
+    CharClasses classes = { 0, 0 };
+    for (size_t i = 0; i < 64; i += 8) {
+        // One class byte per character. The multiplication moves bit 0 (or 1) of every byte into
+        // the top byte.
+        uint64_t cls = 0;
+        for (size_t j = 0; j < 8; ++j) {
+            const auto ch = static_cast<uint8_t>(data[i + j]);
+            cls |= static_cast<uint64_t>(charClassTable[ch]) << (j * 8);
+        }
+        constexpr uint64_t lowBits = 0x0101010101010101;
+        constexpr uint64_t gather = 0x0102040810204080;
+        classes.nonTchar |= (((cls & lowBits) * gather) >> 56) << i;
+        classes.nonFieldValue |= ((((cls >> 1) & lowBits) * gather) >> 56) << i;
+    }
+    return classes;
+}
+
+#ifdef HTTP_TOKENIZER_X86
+// The characters are classified with table lookups (PSHUFB), one for the low nibble and one for
+// the high nibble: lo[ch & 0xf] has bit h set if (h << 4 | (ch & 0xf)) is in the class and
+// hi[ch >> 4] is 1 << (ch >> 4). If they have a bit in common, ch is in the class. hi is 0 above
+// 0x7f, so the tables have to describe the characters that are never above 0x7f: tchars and the
+// characters not allowed in field values. The tables are repeated, because VPSHUFB works on each
+// 128-bit lane separately.
+template <bool (*Pred)(uint8_t)>
+constexpr std::array<uint8_t, 32> makeLoTable()
+{
+    std::array<uint8_t, 32> table {};
+    for (size_t lo = 0; lo < 16; ++lo) {
+        uint8_t bits = 0;
+        for (size_t hi = 0; hi < 8; ++hi) {
+            if (Pred(static_cast<uint8_t>(hi << 4 | lo))) {
+                bits |= static_cast<uint8_t>(1 << hi);
+            }
+        }
+        table[lo] = table[lo + 16] = bits;
+    }
+    return table;
+}
+
+constexpr bool isNotFieldValueChar(uint8_t ch)
+{
+    return !isFieldValueChar(ch);
+}
+
+constexpr std::array<uint8_t, 32> makeHiTable()
+{
+    std::array<uint8_t, 32> table {};
+    for (size_t hi = 0; hi < 8; ++hi) {
+        table[hi] = table[hi + 16] = static_cast<uint8_t>(1 << hi);
+    }
+    return table;
+}
+
+alignas(32) constexpr auto tcharLoTable = makeLoTable<isTchar>();
+alignas(32) constexpr auto nonFieldValueLoTable = makeLoTable<isNotFieldValueChar>();
+alignas(32) constexpr auto hiTable = makeHiTable();
+
+__attribute__((target("ssse3"))) CharClasses classifyCharsSsse3(const char* data)
+{
+    const auto tcharLo = _mm_load_si128(reinterpret_cast<const __m128i*>(tcharLoTable.data()));
+    const auto nonFieldValueLo
+        = _mm_load_si128(reinterpret_cast<const __m128i*>(nonFieldValueLoTable.data()));
+    const auto hiBits = _mm_load_si128(reinterpret_cast<const __m128i*>(hiTable.data()));
+    const auto nibbleMask = _mm_set1_epi8(0x0f);
+    const auto zero = _mm_setzero_si128();
+    uint64_t tchar = 0, fieldValue = 0;
+    for (size_t i = 0; i < 64; i += 16) {
+        const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const auto lo = _mm_and_si128(chunk, nibbleMask);
+        const auto hi
+            = _mm_shuffle_epi8(hiBits, _mm_and_si128(_mm_srli_epi16(chunk, 4), nibbleMask));
+        const auto notTchar
+            = _mm_cmpeq_epi8(_mm_and_si128(_mm_shuffle_epi8(tcharLo, lo), hi), zero);
+        const auto notNonFieldValue
+            = _mm_cmpeq_epi8(_mm_and_si128(_mm_shuffle_epi8(nonFieldValueLo, lo), hi), zero);
+        tchar |= static_cast<uint64_t>(_mm_movemask_epi8(notTchar) & 0xffff) << i;
+        fieldValue |= static_cast<uint64_t>(_mm_movemask_epi8(notNonFieldValue) & 0xffff) << i;
+    }
+    return CharClasses { tchar, ~fieldValue };
+}
+
+__attribute__((target("avx2"))) CharClasses classifyCharsAvx2(const char* data)
+{
+    const auto tcharLo = _mm256_load_si256(reinterpret_cast<const __m256i*>(tcharLoTable.data()));
+    const auto nonFieldValueLo
+        = _mm256_load_si256(reinterpret_cast<const __m256i*>(nonFieldValueLoTable.data()));
+    const auto hiBits = _mm256_load_si256(reinterpret_cast<const __m256i*>(hiTable.data()));
+    const auto nibbleMask = _mm256_set1_epi8(0x0f);
+    const auto zero = _mm256_setzero_si256();
+    uint64_t tchar = 0, fieldValue = 0;
+    for (size_t i = 0; i < 64; i += 32) {
+        const auto chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const auto lo = _mm256_and_si256(chunk, nibbleMask);
+        const auto hi = _mm256_shuffle_epi8(
+            hiBits, _mm256_and_si256(_mm256_srli_epi16(chunk, 4), nibbleMask));
+        const auto notTchar
+            = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_shuffle_epi8(tcharLo, lo), hi), zero);
+        const auto notNonFieldValue = _mm256_cmpeq_epi8(
+            _mm256_and_si256(_mm256_shuffle_epi8(nonFieldValueLo, lo), hi), zero);
+        tchar |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(notTchar))) << i;
+        fieldValue
+            |= static_cast<uint64_t>(static_cast<uint32_t>(_mm256_movemask_epi8(notNonFieldValue)))
+            << i;
+    }
+    return CharClasses { tchar, ~fieldValue };
+}
+#endif
+
+using ClassifyFunc = CharClasses (*)(const char* data);
+
+struct Tokenizer {
+    TokenizerImpl impl;
+    ClassifyFunc classify;
+};
+
+bool isSupported(TokenizerImpl impl)
+{
+    switch (impl) {
+    case TokenizerImpl::Scalar:
+        return true;
+#ifdef HTTP_TOKENIZER_X86
+    case TokenizerImpl::Ssse3:
+        return __builtin_cpu_supports("ssse3");
+    case TokenizerImpl::Avx2:
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return false;
+    }
+}
+
+Tokenizer getTokenizerFor(TokenizerImpl impl)
+{
+    switch (impl) {
+#ifdef HTTP_TOKENIZER_X86
+    case TokenizerImpl::Avx2:
+        return Tokenizer { impl, classifyCharsAvx2 };
+    case TokenizerImpl::Ssse3:
+        return Tokenizer { impl, classifyCharsSsse3 };
+#endif
+    default:
+        return Tokenizer { TokenizerImpl::Scalar, classifyCharsScalar };
+    }
+}
+
+Tokenizer detectTokenizer()
+{
+#ifdef HTTP_TOKENIZER_X86
+    // This runs during static initialization, possibly before libgcc initialized the CPU model
+    // __builtin_cpu_supports reads.
+    __builtin_cpu_init();
+#endif
+    for (const auto impl : { TokenizerImpl::Avx2, TokenizerImpl::Ssse3 }) {
+        if (isSupported(impl)) {
+            return getTokenizerFor(impl);
+        }
+    }
+    return getTokenizerFor(TokenizerImpl::Scalar);
+}
+
+// This is not a function-local static, so the calls below don't need a guard. Nothing parses
+// requests during static initialization.
+Tokenizer tokenizer = detectTokenizer();
+}
+
+CharClasses classifyChars(const char* data)
+{
+    return tokenizer.classify(data);
+}
+
+TokenizerImpl getTokenizerImpl()
+{
+    return tokenizer.impl;
+}
+
+bool setTokenizerImpl(TokenizerImpl impl)
+{
+    if (!isSupported(impl)) {
+        return false;
+    }
+    tokenizer = getTokenizerFor(impl);
+    return true;
+}
+
+std::string_view toString(TokenizerImpl impl)
+{
+    switch (impl) {
+    case TokenizerImpl::Scalar:
+        return "scalar";
+    case TokenizerImpl::Ssse3:
+        return "ssse3";
+    case TokenizerImpl::Avx2:
+        return "avx2";
+    default:
+        return "invalid";
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// The request parser needs to know where header names and values end and that they only contain
+// valid characters. Instead of scanning every field separately, the data is classified in blocks
+// of 64 bytes (vectorized with SSSE3 or AVX2 if the CPU supports it) and the parser only looks at
+// the resulting bit masks. Every byte is classified once, however many fields a block contains.
+// The implementation is chosen at runtime, so the binary still runs everywhere.
+// A few bytes at the end of the data are scanned one byte at a time instead, so if a request
+// arrives in small pieces, every new byte is looked at once (and not the whole tail every time).
+
+enum class TokenizerImpl {
+    Scalar,
+    Ssse3,
+    Avx2,
+};
+
+struct CharClasses {
+    // Bit i is set if data[i] is not a tchar (RFC9110, 5.6.2), e.g. the colon after a header name
+    uint64_t nonTchar;
+    // Bit i is set if data[i] is not allowed in a field value (RFC9110, 5.5), i.e. it is a control
+    // character other than HTAB. For a valid line that's the CR at the end.
+    uint64_t nonFieldValue;
+};
+
+// Classifies the 64 bytes at data
+CharClasses classifyChars(const char* data);
+
+// Bit 0 is set for characters that are not tchars (RFC9110, 5.6.2), bit 1 for characters that are
+// not allowed in field values (RFC9110, 5.5).
+extern const std::array<uint8_t, 256> charClassTable;
+
+// Returns the position of the first character at or after pos that has classBit (1 or 2, see
+// charClassTable) set or data.size() if there is none. Without SIMD, classifying whole blocks costs
+// more than it saves, so this is also what the scalar implementation does.
+inline size_t findCharClassScalar(std::string_view data, size_t pos, uint8_t classBit)
+{
+    while (pos < data.size() && !(charClassTable[static_cast<uint8_t>(data[pos])] & classBit)) {
+        pos++;
+    }
+    return pos;
+}
+
+TokenizerImpl getTokenizerImpl();
+
+// Returns false if the CPU does not support impl. This is for benchmarks and tests and must not be
+// called while other threads are parsing.
+bool setTokenizerImpl(TokenizerImpl impl);
+
+std::string_view toString(TokenizerImpl impl);
+
+// Finds the end of header names and values in data. Positions must only ever increase.
+// The last block is kept between calls, so if more data arrived in the meantime, it is not
+// classified again. data may be a different buffer every time, but it must start with the data
+// that was passed before.
+class HttpTokenizer {
+public:
+    // Must be called before every request
+    void reset()
+    {
+        scalar_ = getTokenizerImpl() == TokenizerImpl::Scalar;
+        blockStart_ = 0;
+        blockEnd_ = 0;
+    }
+
+    // Returns the position of the first character at or after pos that is not a tchar or
+    // data.size() if there is none.
+    size_t findTokenEnd(std::string_view data, size_t pos)
+    {
+        return find(data, pos, &CharClasses::nonTchar, 1);
+    }
+
+    // Returns the position of the first character at or after pos that is not allowed in a field
+    // value or data.size() if there is none.
+    size_t findFieldValueEnd(std::string_view data, size_t pos)
+    {
+        return find(data, pos, &CharClasses::nonFieldValue, 2);
+    }
+
+private:
+    size_t find(std::string_view data, size_t pos, uint64_t CharClasses::*mask, uint8_t classBit)
+    {
+        if (scalar_) {
+            return findCharClassScalar(data, pos, classBit);
+        }
+        while (pos < data.size()) {
+            if (pos >= blockEnd_) {
+                // We must not read past the end of data, so if there is less than a block left,
+                // the block ends at data.size() instead. Classifying the bytes before pos again is
+                // still cheaper than scanning the rest, unless that is only a few bytes, e.g. if
+                // the request arrives one byte at a time. The scan stops at the first match and
+                // positions only increase, so it never looks at a byte twice.
+                if (data.size() - pos >= 64) {
+                    loadBlock(data, pos);
+                } else if (data.size() - pos >= 16 && data.size() >= 64) {
+                    loadBlock(data, data.size() - 64);
+                } else {
+                    return findCharClassScalar(data, pos, classBit);
+                }
+            }
+            const auto bits = (classes_.*mask) >> (pos - blockStart_);
+            if (bits) {
+                return pos + __builtin_ctzll(bits);
+            }
+            pos = blockEnd_;
+        }
+        return data.size();
+    }
+
+    void loadBlock(std::string_view data, size_t pos)
+    {
+        blockStart_ = pos;
+        blockEnd_ = pos + 64;
+        classes_ = classifyChars(data.data() + pos);
+    }
+
+    bool scalar_ = false;
+    size_t blockStart_ = 0;
+    size_t blockEnd_ = 0;
+    CharClasses classes_ = {};
+};
@@ -1,14 +1,124 @@
 #include "ioqueue.hpp"
 
+#include <cstring>
 #include <time.h>
 
 #include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 
 #include "log.hpp"
 #include "metrics.hpp"
+#include "string.hpp"
 #include "util.hpp"
 
+namespace {
+// SOCKET_URING_OP_GETSOCKOPT (Linux 6.7), which is missing from older headers
+constexpr uint32_t SocketUringOpGetSockOpt = 2;
+
+uint64_t getMonotonicNs()
+{
+    ::timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+const char* getOpName(uint8_t opcode)
+{
+    switch (opcode) {
+    case IORING_OP_NOP:
+        return "nop";
+    case IORING_OP_ACCEPT:
+        return "accept";
+    case IORING_OP_CONNECT:
+        return "connect";
+    case IORING_OP_SEND:
+        return "send";
+    case IORING_OP_SENDMSG:
+        return "sendmsg";
+    case IORING_OP_RECV:
+        return "recv";
+    case IORING_OP_READ:
+        return "read";
+    case IORING_OP_READ_FIXED:
+        return "read_fixed";
+    case IORING_OP_WRITE_FIXED:
+        return "write_fixed";
+    case IORING_OP_CLOSE:
+        return "close";
+    case IORING_OP_SHUTDOWN:
+        return "shutdown";
+    case IORING_OP_POLL_ADD:
+        return "poll_add";
+    case IORING_OP_TIMEOUT:
+        return "timeout";
+    case IORING_OP_ASYNC_CANCEL:
+        return "async_cancel";
+    case IORING_OP_MSG_RING:
+        return "msg_ring";
+    case IORING_OP_SEND_ZC:
+        return "send_zc";
+    case IORING_OP_SENDMSG_ZC:
+        return "sendmsg_zc";
+    default:
+        return "other";
+    }
+}
+
+struct OpMetrics {
+    cpprom::Gauge& inFlight;
+    cpprom::Histogram& duration;
+};
+
+// Labels are only looked up once per opcode. Opcodes we don't know share the "other" labels,
+// including the ones newer than our headers, which all go to the entry after the last one.
+const OpMetrics& getOpMetrics(uint8_t opcode)
+{
+    static const auto metrics = []() {
+        std::vector<OpMetrics> ms;
+        for (size_t op = 0; op < IORING_OP_LAST; ++op) {
+            const auto name = std::string(getOpName(static_cast<uint8_t>(op)));
+            ms.push_back(OpMetrics { Metrics::get().ioQueueOpsInFlight.labels(name),
+                Metrics::get().ioQueueOpDuration.labels(name) });
+        }
+        ms.push_back(OpMetrics { Metrics::get().ioQueueOpsInFlight.labels("other"),
+            Metrics::get().ioQueueOpDuration.labels("other") });
+        return ms;
+    }();
+    return metrics[std::min<size_t>(opcode, IORING_OP_LAST)];
+}
+
+// There is no way to probe for support of flags for an opcode (only the opcodes themselves), so
+// for some features we have to check the kernel version instead.
+bool kernelVersionAtLeast(uint32_t major, uint32_t minor)
+{
+    ::utsname uts;
+    if (::uname(&uts) != 0) {
+        return false;
+    }
+    // e.g. "5.19.0-46-generic"
+    const auto parts = split(uts.release, '.');
+    if (parts.size() < 2) {
+        return false;
+    }
+    const auto relMajor = parseInt<uint32_t>(parts[0]);
+    auto minorStr = parts[1];
+    size_t minorLen = 0;
+    while (minorLen < minorStr.size() && isDigit(minorStr[minorLen])) {
+        minorLen++;
+    }
+    const auto relMinor = parseInt<uint32_t>(minorStr.substr(0, minorLen));
+    if (!relMajor || !relMinor) {
+        return false;
+    }
+    return *relMajor > major || (*relMajor == major && *relMinor >= minor);
+}
+
+// The IoQueue that is running on this thread, if any (see IoQueue::post)
+thread_local IoQueue* currentIoQueue = nullptr;
+}
+
 void IoQueue::setRelativeTimeout(Timespec* ts, uint64_t milliseconds)
 {
     ts->tv_sec = milliseconds / 1000;
@@ -25,12 +135,85 @@ void IoQueue::setAbsoluteTimeout(Timespec* ts, uint64_t milliseconds)
     ts->tv_nsec = ts->tv_nsec % (1000 * 1000 * 1000);
 }
 
-IoQueue::IoQueue(size_t size, bool submissionQueuePolling)
+IoQueue::RequestHandle::RequestHandle(uint64_t userData)
+    : userData_(userData)
+{
+}
+
+IoQueue::RequestHandle::operator bool() const
+{
+    return userData_ != Ignore;
+}
+
+uint64_t IoQueue::RequestHandle::getUserData() const
+{
+    return userData_;
+}
+
+bool IoQueue::isSetupSupported(uint32_t flags)
+{
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    params.flags = flags;
+    const auto fd = static_cast<int>(::syscall(__NR_io_uring_setup, 1, &params));
+    if (fd < 0) {
+        return false;
+    }
+    ::close(fd);
+    return true;
+}
+
+IoQueue::IoQueue(size_t size, Setup setup, uint32_t completionQueueSize)
     : completionHandlers_(size)
+    , nowNs_(getMonotonicNs())
+    , now_(nowNs_ / (1000 * 1000))
+    , timers_(*this)
+    , workers_(*this)
+    , messageEventFd_(*this)
 {
-    if (!ring_.init(size, submissionQueuePolling)) {
-        slog::fatal("Could not create io_uring: ", errnoToString(errno));
-        std::exit(1);
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    if (completionQueueSize > 0) {
+        params.flags |= IORING_SETUP_CQSIZE;
+        params.cq_entries = completionQueueSize;
+    }
+
+    // The ring is the probe: If a flag is unknown (EINVAL) or not permitted (EPERM for SQPOLL
+    // without privileges on older kernels), we just try again with fewer flags.
+    std::vector<uint32_t> candidates;
+    if (setup == Setup::SqPoll) {
+        candidates.push_back(IORING_SETUP_SQPOLL);
+    }
+    if (setup != Setup::Plain) {
+        candidates.push_back(IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN);
+        candidates.push_back(IORING_SETUP_COOP_TASKRUN);
+    }
+    candidates.push_back(0);
+    const auto baseFlags = params.flags;
+    for (const auto flags : candidates) {
+        params.flags = baseFlags | flags;
+        if (flags & IORING_SETUP_SQPOLL) {
+            params.sq_thread_idle = 2000; // ms
+        }
+        if (ring_.init(size, params)) {
+            break;
+        }
+        if (flags == 0) {
+            slog::fatal("Could not create io_uring: ", errnoToString(errno));
+            std::exit(1);
+        }
+        if (flags & IORING_SETUP_SQPOLL) {
+            slog::warning("Submission queue polling not available (", errnoToString(errno),
+                "). Falling back to regular submission.");
+        } else {
+            slog::debug("io_uring setup flags ", flags, " not supported: ", errnoToString(errno));
+        }
+    }
+    sqPoll_ = ring_.getParams().flags & IORING_SETUP_SQPOLL;
+    // Saves looking up the ring file on every io_uring_enter (5.18). The registration belongs to
+    // this thread, which is fine, because only this thread submits.
+    if (!ring_.registerRingFd()) {
+        slog::debug("Could not register ring fd: ", errnoToString(errno));
     }
     if (!(ring_.getParams().features & IORING_FEAT_NODROP)) {
         slog::fatal("io_uring does not support NODROP");
@@ -40,6 +223,23 @@ IoQueue::IoQueue(size_t size, bool submissionQueuePolling)
         slog::fatal("io_uring does not support SUBMIT_STABLE");
         std::exit(1);
     }
+    multishotAccept_ = kernelVersionAtLeast(5, 19);
+    if (!multishotAccept_) {
+        slog::info("Multishot accept not supported. Falling back to regular accept.");
+    }
+    multishotRecv_ = kernelVersionAtLeast(6, 0);
+    msgRing_ = kernelVersionAtLeast(5, 18);
+    // SEND_ZC is 6.0, but SENDMSG_ZC is 6.1 and we want both
+    zeroCopySend_ = kernelVersionAtLeast(6, 1);
+    zeroCopyReportUsage_ = kernelVersionAtLeast(6, 2);
+    getPeerName_ = kernelVersionAtLeast(6, 7);
+    readMessageEventFd();
+}
+
+IoQueue::~IoQueue()
+{
+    // The nodes of the queue are not freed otherwise
+    while (messages_.consume()) { }
 }
 
 size_t IoQueue::getSize() const
@@ -52,63 +252,418 @@ size_t IoQueue::getCapacity() const
     return ring_.getSqeCapacity();
 }
 
-bool IoQueue::accept(int fd, sockaddr_in* addr, socklen_t* addrlen, HandlerEcRes cb)
+bool IoQueue::hasSubmissionQueuePolling() const
+{
+    return sqPoll_;
+}
+
+uint32_t IoQueue::getSetupFlags() const
+{
+    return ring_.getParams().flags;
+}
+
+bool IoQueue::hasRegisteredRingFd() const
+{
+    return ring_.hasRegisteredRingFd();
+}
+
+uint64_t IoQueue::getNow() const
+{
+    return now_;
+}
+
+TimerWheel& IoQueue::getTimers()
+{
+    return timers_;
+}
+
+void IoQueue::setNumAsyncThreads(size_t numThreads)
+{
+    workers_.setNumThreads(numThreads);
+}
+
+IoQueue::RequestHandle IoQueue::accept(
+    int fd, sockaddr_in* addr, socklen_t* addrlen, HandlerEcRes cb)
 {
     return addSqe(
-        ring_.prepareAccept(fd, reinterpret_cast<sockaddr*>(addr), addrlen), std::move(cb));
+        [fd, addr, addrlen](IoURing& ring) {
+            return ring.prepareAccept(fd, reinterpret_cast<sockaddr*>(addr), addrlen);
+        },
+        std::move(cb));
+}
+
+bool IoQueue::hasMultishotAccept() const
+{
+    return multishotAccept_;
+}
+
+bool IoQueue::registerProvidedBuffers(size_t numBuffers, size_t bufferSize)
+{
+    return providedBuffers_.init(ring_.getFd(), 0, numBuffers, bufferSize);
+}
+
+bool IoQueue::hasProvidedBuffers() const
+{
+    return providedBuffers_.isInitialized();
+}
+
+size_t IoQueue::getProvidedBufferSize() const
+{
+    return providedBuffers_.getBufferSize();
 }
 
-bool IoQueue::connect(int sockfd, const ::sockaddr* addr, socklen_t addrlen, HandlerEc cb)
+bool IoQueue::hasMultishotRecv() const
 {
-    return addSqe(ring_.prepareConnect(sockfd, addr, addrlen), std::move(cb));
+    return multishotRecv_ && providedBuffers_.isInitialized();
 }
 
-bool IoQueue::send(int sockfd, const void* buf, size_t len, HandlerEcRes cb)
+bool IoQueue::registerBuffers(size_t numBuffers, size_t bufferSize)
 {
-    return addSqe(ring_.prepareSend(sockfd, buf, len), std::move(cb));
+    return registeredBuffers_.init(ring_.getFd(), numBuffers, bufferSize);
 }
 
-bool IoQueue::send(int sockfd, const void* buf, size_t len, IoQueue::Timespec* timeout,
-    bool timeoutIsAbsolute, HandlerEcRes cb)
+bool IoQueue::hasRegisteredBuffers() const
+{
+    return registeredBuffers_.isInitialized();
+}
+
+size_t IoQueue::getRegisteredBufferSize() const
+{
+    return registeredBuffers_.getBufferSize();
+}
+
+RegisteredBuffer IoQueue::acquireRegisteredBuffer()
+{
+    return registeredBuffers_.acquire();
+}
+
+bool IoQueue::registerFixedFiles(size_t numFiles)
+{
+    assert(numFixedFiles_ == 0 && numFiles > 0);
+    // A sparse table, i.e. all slots are empty
+    ::io_uring_rsrc_register reg = {};
+    reg.nr = static_cast<uint32_t>(numFiles);
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (::syscall(__NR_io_uring_register, ring_.getFd(), IORING_REGISTER_FILES2, &reg, sizeof(reg))
+        != 0) {
+        // EINVAL on kernels older than 5.19, EMFILE if numFiles > RLIMIT_NOFILE
+        slog::info("Could not register fixed file table: ", errnoToString(errno));
+        return false;
+    }
+    numFixedFiles_ = numFiles;
+    // Every thread has its own IoQueue and they all add to the same gauges
+    Metrics::get().ioFixedFiles.labels().inc(numFixedFiles_);
+    return true;
+}
+
+bool IoQueue::hasFixedFiles() const
+{
+    // Direct accept with IORING_FILE_INDEX_ALLOC was added together with multishot accept
+    return numFixedFiles_ > 0 && multishotAccept_;
+}
+
+size_t IoQueue::getNumFreeFixedFiles() const
+{
+    return numFixedFiles_ - numFixedFilesInUse_;
+}
+
+IoQueue::RequestHandle IoQueue::acceptMultishot(int fd, HandlerEcResMore cb)
+{
+    assert(multishotAccept_);
+    return addSqe(
+        [fd](IoURing& ring) {
+            auto sqe = ring.prepareAccept(fd, nullptr, nullptr);
+            sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+            return sqe;
+        },
+        std::move(cb));
+}
+
+IoQueue::RequestHandle IoQueue::acceptDirect(
+    int fd, sockaddr_in* addr, socklen_t* addrlen, HandlerEcRes cb)
+{
+    assert(hasFixedFiles());
+    return addSqe(
+        [fd, addr, addrlen](IoURing& ring) {
+            auto sqe = ring.prepareAccept(fd, reinterpret_cast<sockaddr*>(addr), addrlen);
+            sqe->file_index = IORING_FILE_INDEX_ALLOC;
+            return sqe;
+        },
+        HandlerEcRes([this, cb = std::move(cb)](std::error_code ec, int res) {
+            if (!ec) {
+                updateFixedFilesInUse(1);
+            }
+            cb(ec, res);
+        }));
+}
+
+IoQueue::RequestHandle IoQueue::acceptMultishotDirect(int fd, HandlerEcResMore cb)
+{
+    assert(hasFixedFiles());
+    return addSqe(
+        [fd](IoURing& ring) {
+            auto sqe = ring.prepareAccept(fd, nullptr, nullptr);
+            sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+            sqe->file_index = IORING_FILE_INDEX_ALLOC;
+            return sqe;
+        },
+        HandlerEcResMore([this, cb = std::move(cb)](std::error_code ec, int res, bool more) {
+            if (!ec) {
+                updateFixedFilesInUse(1);
+            }
+            cb(ec, res, more);
+        }));
+}
+
+bool IoQueue::hasGetPeerName() const
+{
+    return getPeerName_;
+}
+
+IoQueue::RequestHandle IoQueue::getPeerName(Descriptor sockfd, ::sockaddr_in* addr, HandlerEc cb)
+{
+    assert(getPeerName_);
+    return addSqe(
+        [sockfd, addr](IoURing& ring) {
+            auto sqe = setFixedFile(ring.prepare(IORING_OP_URING_CMD, sockfd.fd, 0, nullptr, 0),
+                sockfd);
+            // Older headers don't have the names for these fields: level and optname share addr,
+            // optlen is in file_index and optval in addr3.
+            sqe->cmd_op = SocketUringOpGetSockOpt;
+            sqe->addr = static_cast<uint64_t>(SO_PEERNAME) << 32 | SOL_SOCKET;
+            // SO_PEERNAME fails with EINVAL if this is larger than the address
+            sqe->file_index = sizeof(::sockaddr_in);
+            sqe->addr3 = reinterpret_cast<uint64_t>(addr);
+            return sqe;
+        },
+        std::move(cb));
+}
+
+IoQueue::RequestHandle IoQueue::connect(
+    int sockfd, const ::sockaddr* addr, socklen_t addrlen, HandlerEc cb)
+{
+    return addSqe(
+        [sockfd, addr, addrlen](IoURing& ring) {
+            return ring.prepareConnect(sockfd, addr, addrlen);
+        },
+        std::move(cb));
+}
+
+IoQueue::RequestHandle IoQueue::send(
+    Descriptor sockfd, const void* buf, size_t len, HandlerEcRes cb)
+{
+    return addSqe(
+        [sockfd, buf, len](IoURing& ring) {
+            return setFixedFile(ring.prepareSend(sockfd.fd, buf, len), sockfd);
+        },
+        std::move(cb));
+}
+
+IoQueue::RequestHandle IoQueue::send(Descriptor sockfd, const void* buf, size_t len,
+    IoQueue::Timespec* timeout, bool timeoutIsAbsolute, HandlerEcRes cb)
 {
     if (!timeout) {
         return send(sockfd, buf, len, std::move(cb));
     }
-    return addSqe(ring_.prepareSend(sockfd, buf, len), timeout, timeoutIsAbsolute, std::move(cb));
+    return addSqe(
+        [sockfd, buf, len](IoURing& ring) {
+            return setFixedFile(ring.prepareSend(sockfd.fd, buf, len), sockfd);
+        },
+        timeout, timeoutIsAbsolute, std::move(cb));
 }
 
-bool IoQueue::recv(int sockfd, void* buf, size_t len, HandlerEcRes cb)
+IoQueue::RequestHandle IoQueue::sendmsg(
+    Descriptor sockfd, const ::msghdr* msg, int flags, HandlerEcRes cb)
 {
-    return addSqe(ring_.prepareRecv(sockfd, buf, len), std::move(cb));
+    return addSqe(
+        [sockfd, msg, flags](IoURing& ring) {
+            auto sqe = setFixedFile(ring.prepare(IORING_OP_SENDMSG, sockfd.fd, 0, msg, 1), sockfd);
+            sqe->msg_flags = static_cast<uint32_t>(flags);
+            return sqe;
+        },
+        std::move(cb));
+}
+
+bool IoQueue::hasZeroCopySend() const
+{
+    return zeroCopySend_;
+}
+
+IoQueue::RequestHandle IoQueue::sendZc(
+    Descriptor sockfd, const void* buf, size_t len, HandlerEcRes cb, HandlerEc released)
+{
+    assert(zeroCopySend_);
+    return addSqe(
+        [sockfd, buf, len, reportUsage = zeroCopyReportUsage_](IoURing& ring) {
+            auto sqe
+                = setFixedFile(ring.prepare(IORING_OP_SEND_ZC, sockfd.fd, 0, buf, len), sockfd);
+            // The notification tells us whether the kernel had to copy after all (Linux 6.2)
+            sqe->ioprio = reportUsage ? IORING_SEND_ZC_REPORT_USAGE : 0;
+            return sqe;
+        },
+        ZeroCopyHandler { std::move(cb), std::move(released) });
+}
+
+IoQueue::RequestHandle IoQueue::sendmsgZc(
+    Descriptor sockfd, const ::msghdr* msg, int flags, HandlerEcRes cb, HandlerEc released)
+{
+    assert(zeroCopySend_);
+    return addSqe(
+        [sockfd, msg, flags, reportUsage = zeroCopyReportUsage_](IoURing& ring) {
+            auto sqe
+                = setFixedFile(ring.prepare(IORING_OP_SENDMSG_ZC, sockfd.fd, 0, msg, 1), sockfd);
+            sqe->msg_flags = static_cast<uint32_t>(flags);
+            sqe->ioprio = reportUsage ? IORING_SEND_ZC_REPORT_USAGE : 0;
+            return sqe;
+        },
+        ZeroCopyHandler { std::move(cb), std::move(released) });
+}
+
+IoQueue::RequestHandle IoQueue::sendFixed(Descriptor sockfd, const RegisteredBuffer& buffer,
+    size_t offset, size_t len, Timespec* timeout, bool timeoutIsAbsolute, HandlerEcRes cb)
+{
+    assert(buffer && offset + len <= buffer.size());
+    // The offset is the file offset, which must be 0 for sockets
+    return addSqe(
+        [sockfd, buf = buffer.data() + offset, len, index = buffer.getIndex()](IoURing& ring) {
+            auto sqe = setFixedFile(
+                ring.prepare(IORING_OP_WRITE_FIXED, sockfd.fd, 0, buf, len), sockfd);
+            sqe->buf_index = index;
+            return sqe;
+        },
+        timeout, timeoutIsAbsolute, std::move(cb));
+}
+
+IoQueue::RequestHandle IoQueue::recvFixed(Descriptor sockfd, const RegisteredBuffer& buffer,
+    size_t offset, size_t len, Timespec* timeout, bool timeoutIsAbsolute, HandlerEcRes cb)
+{
+    assert(buffer && offset + len <= buffer.size());
+    return addSqe(
+        [sockfd, buf = buffer.data() + offset, len, index = buffer.getIndex()](IoURing& ring) {
+            auto sqe
+                = setFixedFile(ring.prepare(IORING_OP_READ_FIXED, sockfd.fd, 0, buf, len), sockfd);
+            sqe->buf_index = index;
+            return sqe;
+        },
+        timeout, timeoutIsAbsolute, std::move(cb));
 }
 
-bool IoQueue::recv(int sockfd, void* buf, size_t len, IoQueue::Timespec* timeout,
-    bool timeoutIsAbsolute, HandlerEcRes cb)
+IoQueue::RequestHandle IoQueue::recv(Descriptor sockfd, void* buf, size_t len, HandlerEcRes cb)
+{
+    return addSqe(
+        [sockfd, buf, len](IoURing& ring) {
+            return setFixedFile(ring.prepareRecv(sockfd.fd, buf, len), sockfd);
+        },
+        std::move(cb));
+}
+
+IoQueue::RequestHandle IoQueue::recv(Descriptor sockfd, void* buf, size_t len,
+    IoQueue::Timespec* timeout, bool timeoutIsAbsolute, HandlerEcRes cb)
 {
     if (!timeout) {
         return recv(sockfd, buf, len, std::move(cb));
     }
-    return addSqe(ring_.prepareRecv(sockfd, buf, len), timeout, timeoutIsAbsolute, std::move(cb));
+    return addSqe(
+        [sockfd, buf, len](IoURing& ring) {
+            return setFixedFile(ring.prepareRecv(sockfd.fd, buf, len), sockfd);
+        },
+        timeout, timeoutIsAbsolute, std::move(cb));
 }
 
-bool IoQueue::read(int fd, void* buf, size_t count, HandlerEcRes cb)
+IoQueue::RequestHandle IoQueue::recv(Descriptor sockfd, size_t len, IoQueue::Timespec* timeout,
+    bool timeoutIsAbsolute, HandlerEcBuffer cb)
 {
-    return addSqe(ring_.prepareRead(fd, buf, count), std::move(cb));
+    assert(providedBuffers_.isInitialized());
+    auto prepare = [sockfd, len = std::min(len, providedBuffers_.getBufferSize()),
+                       group = providedBuffers_.getGroupId()](IoURing& ring) {
+        auto sqe = setFixedFile(ring.prepareRecv(sockfd.fd, nullptr, len), sockfd);
+        sqe->flags |= IOSQE_BUFFER_SELECT;
+        sqe->buf_group = group;
+        return sqe;
+    };
+    if (!timeout) {
+        return addSqe(std::move(prepare), std::move(cb));
+    }
+    return addSqe(std::move(prepare), timeout, timeoutIsAbsolute, std::move(cb));
 }
 
-bool IoQueue::close(int fd, HandlerEc cb)
+IoQueue::RequestHandle IoQueue::recvMultishot(Descriptor sockfd, HandlerEcBufferMore cb)
 {
-    return addSqe(ring_.prepareClose(fd), std::move(cb));
+    assert(hasMultishotRecv());
+    return addSqe(
+        [sockfd, group = providedBuffers_.getGroupId()](IoURing& ring) {
+            // len must be 0 for multishot recv. The buffer size limits the size of each
+            // completion.
+            auto sqe = setFixedFile(ring.prepareRecv(sockfd.fd, nullptr, 0), sockfd);
+            sqe->ioprio |= IORING_RECV_MULTISHOT;
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = group;
+            return sqe;
+        },
+        std::move(cb));
 }
 
-bool IoQueue::shutdown(int fd, int how, HandlerEc cb)
+IoQueue::RequestHandle IoQueue::read(int fd, void* buf, size_t count, HandlerEcRes cb)
 {
-    return addSqe(ring_.prepareShutdown(fd, how), std::move(cb));
+    return addSqe(
+        [fd, buf, count](IoURing& ring) { return ring.prepareRead(fd, buf, count); },
+        std::move(cb));
 }
 
-bool IoQueue::poll(int fd, short events, HandlerEcRes cb)
+IoQueue::RequestHandle IoQueue::close(Descriptor fd, HandlerEc cb)
 {
-    return addSqe(ring_.preparePollAdd(fd, events), std::move(cb));
+    if (!fd.fixed) {
+        return addSqe([fd](IoURing& ring) { return ring.prepareClose(fd.fd); }, std::move(cb));
+    }
+    return addSqe(
+        [fd](IoURing& ring) {
+            // Direct descriptors are closed by passing the slot in file_index (and not with
+            // IOSQE_FIXED_FILE). This frees the slot, so the kernel can hand it out again.
+            auto sqe = ring.prepareClose(0);
+            sqe->file_index = static_cast<uint32_t>(fd.fd + 1);
+            return sqe;
+        },
+        HandlerEc([this, cb = std::move(cb)](std::error_code ec) {
+            // If it failed, the slot might still be taken, so it's better not to count it as free
+            if (!ec) {
+                updateFixedFilesInUse(-1);
+            }
+            cb(ec);
+        }));
+}
+
+IoQueue::RequestHandle IoQueue::shutdown(Descriptor fd, int how, HandlerEc cb)
+{
+    return addSqe(
+        [fd, how](IoURing& ring) { return setFixedFile(ring.prepareShutdown(fd.fd, how), fd); },
+        std::move(cb));
+}
+
+IoQueue::RequestHandle IoQueue::poll(int fd, short events, HandlerEcRes cb)
+{
+    return addSqe(
+        [fd, events](IoURing& ring) { return ring.preparePollAdd(fd, events); }, std::move(cb));
+}
+
+IoQueue::RequestHandle IoQueue::timeout(Timespec* ts, bool isAbsolute, HandlerEc cb)
+{
+    return addSqe(
+        [ts, isAbsolute](IoURing& ring) {
+            return ring.prepareTimeout(ts, 0, isAbsolute ? IORING_TIMEOUT_ABS : 0);
+        },
+        std::move(cb));
+}
+
+bool IoQueue::cancel(RequestHandle handle, HandlerEc cb)
+{
+    if (!handle) {
+        return false;
+    }
+    return static_cast<bool>(addSqe(
+        [userData = handle.getUserData()](IoURing& ring) {
+            return ring.prepareAsyncCancel(userData);
+        },
+        std::move(cb)));
 }
 
 IoQueue::NotifyHandle::NotifyHandle(std::shared_ptr<EventFd> eventFd)
@@ -146,26 +701,110 @@ IoQueue::NotifyHandle IoQueue::wait(std::function<void(std::error_code, uint64_t
     }
 }
 
-void IoQueue::run()
+void IoQueue::post(Function<void()> fn)
 {
-    while (completionHandlers_.size() > 0) {
-        const auto res = ring_.submitSqes(1);
-        if (res < 0) {
-            slog::error("Error submitting SQEs: ", errnoToString(errno));
-            continue;
+    messages_.produce(std::move(fn));
+    const auto current = currentIoQueue;
+    if (current == this) {
+        // A completion is enough to get back into the loop, so a NOP will do.
+        addSqe([](IoURing& ring) { return ring.prepareNop(); },
+            HandlerEc([this](std::error_code) { runMessages(); }));
+    } else if (current && current->msgRing_) {
+        // The message CQE does not belong to any operation on the target ring, but the MSG_RING
+        // operation itself completes on the sending ring. It fails if the target's CQ overflows.
+        current->addSqe(
+            [fd = ring_.getFd()](IoURing& ring) {
+                return ring.prepare(IORING_OP_MSG_RING, fd, Message, nullptr, 0);
+            },
+            HandlerEc([this](std::error_code ec) {
+                if (ec) {
+                    messageEventFd_.write(1);
+                }
+            }));
+    } else {
+        messageEventFd_.write(1);
+    }
+}
+
+void IoQueue::readMessageEventFd()
+{
+    messageEventFd_.read([this](std::error_code ec, uint64_t) {
+        if (ec) {
+            slog::error("Error reading message eventfd: ", ec.message());
         }
-        const auto cqe = ring_.peekCqe();
-        assert(cqe);
+        runMessages();
+        readMessageEventFd();
+    });
+}
+
+void IoQueue::runMessages()
+{
+    // Every message is announced separately (and the message is always produced before that), so
+    // if consume misses a message, because it's produced right now, a later call will run it.
+    while (auto message = messages_.consume()) {
+        (*message)();
+    }
+}
+
+void IoQueue::run()
+{
+    static auto& cqesPerIteration = Metrics::get().ioQueueCqesPerIteration.labels();
+    static auto& sqFill = Metrics::get().ioQueueSqFill.labels();
+    static auto& cqFill = Metrics::get().ioQueueCqFill.labels();
+    static auto& opsQueued = Metrics::get().ioQueueOpsQueued.labels();
+    const auto prevIoQueue = currentIoQueue;
+    currentIoQueue = this;
+    // The read on the message eventfd is always queued, so it does not count.
+    while (completionHandlers_.size() > 1) {
+        // Operations that did not fit into the SQ in the last iteration go first
+        flushPendingSqes();
+        // This submits all SQEs the handlers of the last iteration added at once and waits for at
+        // least one completion, so under load there is one io_uring_enter for many completions.
+        const auto numSqEntries = ring_.getNumSqeEntries();
+        sqFill.observe(
+            static_cast<double>(numSqEntries - ring_.getSqeCapacity()) / numSqEntries);
+        submitSqes(1);
+        nowNs_ = getMonotonicNs();
+        now_ = nowNs_ / (1000 * 1000);
 
-        if (cqe->user_data != Ignore) {
-            assert(completionHandlers_.contains(cqe->user_data));
-            Metrics::get().ioQueueOpsQueued.labels().dec();
-            auto ch = std::move(completionHandlers_[cqe->user_data]);
-            ch(cqe);
-            completionHandlers_.remove(cqe->user_data);
+        size_t numCqes = 0;
+        while (const auto cqe = ring_.peekCqe()) {
+            if (cqe->user_data == Message) {
+                runMessages();
+            } else if (cqe->user_data != Ignore) {
+                const auto index = getHandlerIndex(cqe->user_data);
+                assert(completionHandlers_.contains(index));
+                // We need to move the handler out of the slot map, because the handler might add
+                // new handlers, which might resize the slot map and move the handler while it's
+                // running.
+                auto ch = std::move(completionHandlers_[index]);
+                ch(cqe);
+                if (cqe->flags & IORING_CQE_F_MORE) {
+                    // Multishot operation that will produce more CQEs, so we need to keep the
+                    // handler
+                    completionHandlers_[index] = std::move(ch);
+                    // For zero-copy sends the duration includes the wait for the notification,
+                    // which is how long the buffers are held, so it's still interesting.
+                    const auto opcode = opInfos_[index].opcode;
+                    if (opcode != IORING_OP_SEND_ZC && opcode != IORING_OP_SENDMSG_ZC) {
+                        opInfos_[index].multishot = true;
+                    }
+                } else {
+                    opsQueued.dec();
+                    recordCompletion(index);
+                    completionHandlers_.remove(index);
+                }
+            }
+            ring_.advanceCq();
+            numCqes++;
+        }
+        if (numCqes > 0) {
+            cqesPerIteration.observe(static_cast<double>(numCqes));
+            // We always reap everything, so this is about how full the CQ was
+            cqFill.observe(static_cast<double>(numCqes) / ring_.getParams().cq_entries);
         }
-        ring_.advanceCq();
     }
+    currentIoQueue = prevIoQueue;
 }
 
 size_t IoQueue::addHandler(HandlerEc&& cb)
@@ -190,38 +829,212 @@ size_t IoQueue::addHandler(HandlerEcRes&& cb)
     });
 }
 
-template <typename Callback>
-bool IoQueue::addSqe(io_uring_sqe* sqe, Callback cb)
+size_t IoQueue::addHandler(HandlerEcResMore&& cb)
 {
-    if (!sqe) {
-        slog::warning("io_uring full");
-        return false;
+    return completionHandlers_.emplace([cb = std::move(cb)](const io_uring_cqe* cqe) {
+        const bool more = cqe->flags & IORING_CQE_F_MORE;
+        if (cqe->res < 0) {
+            cb(std::make_error_code(static_cast<std::errc>(-cqe->res)), -1, more);
+        } else {
+            cb(std::error_code(), cqe->res, more);
+        }
+    });
+}
+
+size_t IoQueue::getHandlerIndex(uint64_t userData)
+{
+    return static_cast<size_t>(userData & 0xffff'ffff);
+}
+
+ProvidedBuffer IoQueue::getProvidedBuffer(const io_uring_cqe* cqe)
+{
+    // Even if the result is 0 (EOF), a buffer might have been consumed
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        if (cqe->res == -ENOBUFS) {
+            Metrics::get().ioProvidedBuffersExhausted.labels().inc();
+        }
+        return ProvidedBuffer();
+    }
+    const auto id = static_cast<uint16_t>(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    providedBuffers_.markInUse(id);
+    return ProvidedBuffer(&providedBuffers_, id, cqe->res > 0 ? cqe->res : 0);
+}
+
+size_t IoQueue::addHandler(HandlerEcBuffer&& cb)
+{
+    return completionHandlers_.emplace([this, cb = std::move(cb)](const io_uring_cqe* cqe) {
+        auto buffer = getProvidedBuffer(cqe);
+        if (cqe->res < 0) {
+            cb(std::make_error_code(static_cast<std::errc>(-cqe->res)), std::move(buffer));
+        } else {
+            cb(std::error_code(), std::move(buffer));
+        }
+    });
+}
+
+size_t IoQueue::addHandler(HandlerEcBufferMore&& cb)
+{
+    return completionHandlers_.emplace([this, cb = std::move(cb)](const io_uring_cqe* cqe) {
+        const bool more = cqe->flags & IORING_CQE_F_MORE;
+        auto buffer = getProvidedBuffer(cqe);
+        if (cqe->res < 0) {
+            cb(std::make_error_code(static_cast<std::errc>(-cqe->res)), std::move(buffer), more);
+        } else {
+            cb(std::error_code(), std::move(buffer), more);
+        }
+    });
+}
+
+size_t IoQueue::addHandler(ZeroCopyHandler&& handler)
+{
+    // The first CQE has the result. If it has IORING_CQE_F_MORE, the kernel still references the
+    // buffers and a notification CQE (IORING_CQE_F_NOTIF) follows, once it's done with them.
+    // If the send failed before anything was queued, there is no notification.
+    return completionHandlers_.emplace([this, h = std::move(handler)](const io_uring_cqe* cqe) {
+        if (cqe->flags & IORING_CQE_F_NOTIF) {
+            if (zeroCopyReportUsage_) {
+                static auto& zeroCopied = Metrics::get().ioZeroCopySends.labels("false");
+                static auto& copied = Metrics::get().ioZeroCopySends.labels("true");
+                (cqe->res & IORING_NOTIF_USAGE_ZC_COPIED ? copied : zeroCopied).inc();
+            }
+            h.released(std::error_code());
+            return;
+        }
+        if (cqe->res < 0) {
+            h.cb(std::make_error_code(static_cast<std::errc>(-cqe->res)), -1);
+        } else {
+            h.cb(std::error_code(), cqe->res);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            h.released(std::error_code());
+        }
+    });
+}
+
+void IoQueue::recordCompletion(size_t handlerIndex)
+{
+    assert(handlerIndex < opInfos_.size());
+    const auto& info = opInfos_[handlerIndex];
+    const auto& metrics = getOpMetrics(info.opcode);
+    metrics.inFlight.dec();
+    // For multishot operations this would just be how long they lived, which is not interesting
+    if (!info.multishot) {
+        metrics.duration.observe(static_cast<double>(nowNs_ - info.submitNs) / 1e9);
+    }
+}
+
+io_uring_sqe* IoQueue::setFixedFile(io_uring_sqe* sqe, Descriptor fd)
+{
+    if (fd.fixed) {
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    return sqe;
+}
+
+void IoQueue::updateFixedFilesInUse(int delta)
+{
+    assert(delta > 0 || numFixedFilesInUse_ > 0);
+    numFixedFilesInUse_ += delta;
+    Metrics::get().ioFixedFilesInUse.labels().inc(delta);
+}
+
+bool IoQueue::prepareSqe(PendingSqe& op)
+{
+    const size_t numSqes = op.timeout ? 2 : 1;
+    if (ring_.getSqeCapacity() < numSqes) {
+        // Hand everything in the SQ to the kernel to make room. Without SQPOLL the kernel consumes
+        // all of them right away.
+        submitSqes(0);
+        if (ring_.getSqeCapacity() < numSqes) {
+            return false;
+        }
     }
-    Metrics::get().ioQueueOpsQueued.labels().inc();
-    sqe->user_data = addHandler(std::move(cb));
+    auto sqe = op.prepare(ring_);
+    assert(sqe);
+    sqe->user_data = op.userData;
+    // This is the time the CQEs of the last iteration were reaped, not when this will actually be
+    // submitted (at the start of the next iteration), but getting the time for every operation
+    // would be a lot more expensive.
+    const auto index = getHandlerIndex(op.userData);
+    if (index >= opInfos_.size()) {
+        opInfos_.resize(std::max(index + 1, opInfos_.size() * 2));
+    }
+    opInfos_[index] = OpInfo { nowNs_, sqe->opcode, false };
+    getOpMetrics(sqe->opcode).inFlight.inc();
+    if (op.timeout) {
+        sqe->flags |= IOSQE_IO_LINK;
+        auto timeoutSqe = ring_.prepareLinkTimeout(
+            op.timeout, op.timeoutIsAbsolute ? IORING_TIMEOUT_ABS : 0);
+        assert(timeoutSqe);
+        timeoutSqe->user_data = Ignore;
+    }
+    static auto& sqesTotal = Metrics::get().ioQueueSqesTotal.labels();
+    sqesTotal.inc(numSqes);
     return true;
 }
 
-template bool IoQueue::addSqe<IoQueue::HandlerEc>(io_uring_sqe* sqe, IoQueue::HandlerEc cb);
-template bool IoQueue::addSqe<IoQueue::HandlerEcRes>(io_uring_sqe* sqe, IoQueue::HandlerEcRes cb);
+void IoQueue::flushPendingSqes()
+{
+    static auto& pendingSqes = Metrics::get().ioQueuePendingSqes.labels();
+    while (!pendingSqes_.empty() && prepareSqe(pendingSqes_.front())) {
+        pendingSqes_.pop_front();
+        pendingSqes.dec();
+    }
+}
+
+int IoQueue::submitSqes(uint32_t waitCqes)
+{
+    static auto& submits = Metrics::get().ioQueueSubmits.labels();
+    const auto res = ring_.submitSqes(waitCqes);
+    submits.inc();
+    // EBUSY means the CQ overflowed and the kernel wants us to reap completions first. We will
+    // do that in the next iteration of the event loop.
+    if (res < 0 && errno != EBUSY) {
+        slog::error("Error submitting SQEs: ", errnoToString(errno));
+    }
+    return res;
+}
 
 template <typename Callback>
-bool IoQueue::addSqe(io_uring_sqe* sqe, Timespec* timeout, bool timeoutIsAbsolute, Callback cb)
+IoQueue::RequestHandle IoQueue::addSqe(
+    PrepareSqe prepare, Timespec* timeout, bool timeoutIsAbsolute, Callback cb)
 {
-    if (!sqe) {
-        slog::warning("io_uring full");
-        return false;
+    static auto& opsQueued = Metrics::get().ioQueueOpsQueued.labels();
+    opsQueued.inc();
+    const auto index = addHandler(std::move(cb));
+    assert(index < 0xffff'ffff);
+    const auto userData = static_cast<uint64_t>(generation_++) << 32 | index;
+    PendingSqe op { std::move(prepare), userData, timeout, timeoutIsAbsolute };
+    // Operations must be submitted in order (e.g. a shutdown before a close), so if anything is
+    // pending already, this has to wait as well.
+    if (!pendingSqes_.empty() || !prepareSqe(op)) {
+        static auto& pendingTotal = Metrics::get().ioQueuePendingSqesTotal.labels();
+        static auto& pendingSqes = Metrics::get().ioQueuePendingSqes.labels();
+        pendingTotal.inc();
+        pendingSqes_.push_back(std::move(op));
+        pendingSqes.inc();
     }
-    sqe->user_data = addHandler(std::move(cb));
-    sqe->flags |= IOSQE_IO_LINK;
-    // If the timeout does not fit into the SQ, that's fine. We don't want to undo the whole thing.
-    // In the future the use of timeouts might be more critical and this should be reconsidered.
-    auto timeoutSqe = ring_.prepareLinkTimeout(timeout, timeoutIsAbsolute ? IORING_TIMEOUT_ABS : 0);
-    timeoutSqe->user_data = Ignore;
-    return true;
+    return RequestHandle(userData);
+}
+
+template <typename Callback>
+IoQueue::RequestHandle IoQueue::addSqe(PrepareSqe prepare, Callback cb)
+{
+    return addSqe(std::move(prepare), nullptr, false, std::move(cb));
 }
 
-template bool IoQueue::addSqe<IoQueue::HandlerEc>(
-    io_uring_sqe* sqe, Timespec* timeout, bool timeoutIsAbsolute, IoQueue::HandlerEc cb);
-template bool IoQueue::addSqe<IoQueue::HandlerEcRes>(
-    io_uring_sqe* sqe, Timespec* timeout, bool timeoutIsAbsolute, IoQueue::HandlerEcRes cb);
+template IoQueue::RequestHandle IoQueue::addSqe<IoQueue::HandlerEc>(
+    PrepareSqe prepare, IoQueue::HandlerEc cb);
+template IoQueue::RequestHandle IoQueue::addSqe<IoQueue::HandlerEcRes>(
+    PrepareSqe prepare, IoQueue::HandlerEcRes cb);
+template IoQueue::RequestHandle IoQueue::addSqe<IoQueue::HandlerEcResMore>(
+    PrepareSqe prepare, IoQueue::HandlerEcResMore cb);
+template IoQueue::RequestHandle IoQueue::addSqe<IoQueue::HandlerEcBuffer>(
+    PrepareSqe prepare, IoQueue::HandlerEcBuffer cb);
+template IoQueue::RequestHandle IoQueue::addSqe<IoQueue::HandlerEcBufferMore>(
+    PrepareSqe prepare, IoQueue::HandlerEcBufferMore cb);
+
+template IoQueue::RequestHandle IoQueue::addSqe<IoQueue::HandlerEcRes>(
+    PrepareSqe prepare, Timespec* timeout, bool timeoutIsAbsolute, IoQueue::HandlerEcRes cb);
+template IoQueue::RequestHandle IoQueue::addSqe<IoQueue::HandlerEcBuffer>(
+    PrepareSqe prepare, Timespec* timeout, bool timeoutIsAbsolute, IoQueue::HandlerEcBuffer cb);
@@ -1,68 +1,246 @@
 #pragma once
 
+#include <deque>
 #include <functional>
-#include <future>
 #include <limits>
 #include <system_error>
-#include <thread>
+#include <vector>
 
 #include <netinet/in.h>
+#include <sys/socket.h>
 
 #include "events.hpp"
+#include "function.hpp"
 #include "iouring.hpp"
 #include "log.hpp"
+#include "mpscqueue.hpp"
+#include "providedbuffers.hpp"
+#include "registeredbuffers.hpp"
 #include "slotmap.hpp"
+#include "timerwheel.hpp"
+#include "workerpool.hpp"
 
 class IoQueue {
 private:
-    using CompletionHandler = std::function<void(const io_uring_cqe*)>;
+    // The handlers passed by the user are wrapped in a completion handler that also captures
+    // `this`, so make room for both to avoid an allocation.
+    using CompletionHandler
+        = Function<void(const io_uring_cqe*), sizeof(void*) + sizeof(Function<void()>)>;
 
     static constexpr auto Ignore = std::numeric_limits<uint64_t>::max();
+    // user_data of the CQEs IORING_OP_MSG_RING posts to this ring (see post)
+    static constexpr auto Message = Ignore - 1;
 
 public:
-    using HandlerEc = std::function<void(std::error_code ec)>;
-    using HandlerEcRes = std::function<void(std::error_code ec, int res)>;
+    // These are move-only and do not allocate for captures up to 48 bytes (see Function).
+    using HandlerEc = Function<void(std::error_code ec)>;
+    using HandlerEcRes = Function<void(std::error_code ec, int res)>;
+    // For multishot operations. `more` is false if this is the last completion for this operation
+    // and it has to be queued up again, if desired.
+    using HandlerEcResMore = Function<void(std::error_code ec, int res, bool more)>;
+    // The buffer might be empty (e.g. in case of an error)
+    using HandlerEcBuffer = Function<void(std::error_code ec, ProvidedBuffer buffer)>;
+    using HandlerEcBufferMore
+        = Function<void(std::error_code ec, ProvidedBuffer buffer, bool more)>;
     using Timespec = IoURing::Timespec;
 
+    // Identifies a queued operation, so that it can be cancelled.
+    class RequestHandle {
+    public:
+        RequestHandle() = default;
+        explicit RequestHandle(uint64_t userData);
+
+        // False for a default constructed handle, which does not refer to any operation.
+        // Operations are always queued (see addSqe), so a handle returned by IoQueue is never
+        // false.
+        explicit operator bool() const;
+
+        uint64_t getUserData() const;
+
+    private:
+        uint64_t userData_ = Ignore;
+    };
+
+    // Either a regular file descriptor or a direct descriptor, i.e. an index into the registered
+    // file table (see registerFixedFiles). The kernel does not need to look up a direct descriptor
+    // in the process' file table for every operation.
+    struct Descriptor {
+        Descriptor(int fd, bool fixed = false)
+            : fd(fd)
+            , fixed(fixed)
+        {
+        }
+
+        int fd;
+        bool fixed;
+    };
+
     // These are both relative with respect to their arguments, but naming these is hard.
     static void setRelativeTimeout(Timespec* ts, uint64_t milliseconds);
     static void setAbsoluteTimeout(Timespec* ts, uint64_t milliseconds);
 
-    IoQueue(size_t size = 1024, bool submissionQueuePolling = false);
+    // Whether a ring can be created with the given IORING_SETUP_* flags. This creates (and
+    // destroys) a tiny ring, so it's not free.
+    static bool isSetupSupported(uint32_t flags);
+
+    enum class Setup {
+        // No setup flags, every submit is an io_uring_enter
+        Plain,
+        // IORING_SETUP_SINGLE_ISSUER | DEFER_TASKRUN (6.1), so completions are only processed when
+        // we wait for them anyway, or IORING_SETUP_COOP_TASKRUN (5.19), which at least avoids the
+        // IPIs for task work. This requires that the IoQueue is only used (and run) on the thread
+        // that created it, which is the case anyway.
+        TaskRun,
+        // A kernel thread polls the SQ (see Config::IoRingProfile::SqPoll)
+        SqPoll,
+    };
+
+    // Flags that are not supported (or not permitted) are dropped one after the other, i.e.
+    // SqPoll falls back to TaskRun, which falls back to Plain.
+    // If completionQueueSize is 0, the kernel default (twice the size) is used.
+    IoQueue(size_t size = 1024, Setup setup = Setup::Plain, uint32_t completionQueueSize = 0);
+    ~IoQueue();
+
+    IoQueue(const IoQueue&) = delete;
+    IoQueue& operator=(const IoQueue&) = delete;
 
     size_t getSize() const;
 
     size_t getCapacity() const;
 
-    // TODO: Support cancellation by returning a RequestHandle wrapping an uint64_t containing the
-    // SQE userData. Add an operator bool to replicate the old behaviour and add
-    // cancel(RequestHandle), that generates an IORING_OP_ASYNC_CANCEL with the wrapped userData.
+    bool hasSubmissionQueuePolling() const;
+
+    // The IORING_SETUP_* flags the ring was actually created with
+    uint32_t getSetupFlags() const;
+
+    bool hasRegisteredRingFd() const;
+
+    // Monotonic time in milliseconds. This is only updated once per event loop iteration, so it
+    // is cheap, but might lag behind a little.
+    uint64_t getNow() const;
+
+    // For deadlines of operations. These are much cheaper than linked timeouts.
+    TimerWheel& getTimers();
+
+    // Multishot accept is available since Linux 5.19. If it is not supported, acceptMultishot
+    // must not be used.
+    bool hasMultishotAccept() const;
+
+    // Register a ring of provided buffers for recv (Linux 5.19). Returns false if that is not
+    // possible, in which case the recv overloads taking a HandlerEcBuffer must not be used.
+    bool registerProvidedBuffers(size_t numBuffers, size_t bufferSize);
+    bool hasProvidedBuffers() const;
+    size_t getProvidedBufferSize() const;
+
+    // Multishot recv is available since Linux 6.0 and requires provided buffers.
+    bool hasMultishotRecv() const;
+
+    // See RegisteredBufferPool. Returns false if the buffers could not be registered (e.g.
+    // because of RLIMIT_MEMLOCK), in which case acquireRegisteredBuffer always returns an empty
+    // buffer.
+    bool registerBuffers(size_t numBuffers, size_t bufferSize);
+    bool hasRegisteredBuffers() const;
+    size_t getRegisteredBufferSize() const;
+    // Might return an empty buffer, if all of them are in use
+    RegisteredBuffer acquireRegisteredBuffer();
+
+    // Register a sparse table of fixed files, which accepted sockets can be installed into
+    // directly (Linux 5.19). Returns false if that is not possible, in which case the direct
+    // accept functions must not be used.
+    // Note that the table counts towards RLIMIT_NOFILE.
+    bool registerFixedFiles(size_t numFiles);
+    bool hasFixedFiles() const;
+    // The kernel picks the slots (IORING_FILE_INDEX_ALLOC), we only keep track of how many are
+    // in use, so callers can fall back to regular file descriptors if the table is full.
+    size_t getNumFreeFixedFiles() const;
 
     // res argument is socket fd
-    bool accept(int fd, sockaddr_in* addr, socklen_t* addrlen, HandlerEcRes cb);
+    RequestHandle accept(int fd, sockaddr_in* addr, socklen_t* addrlen, HandlerEcRes cb);
+
+    // A single SQE that will produce a CQE for every accepted connection, until the kernel
+    // terminates it (more = false), e.g. because of an error. There is no address argument,
+    // because a single buffer would be overwritten by subsequent accepts before the handler could
+    // read it. Use getpeername instead.
+    RequestHandle acceptMultishot(int fd, HandlerEcResMore cb);
 
-    bool connect(int sockfd, const ::sockaddr* addr, socklen_t addrlen, HandlerEc cb);
+    // Like the functions above, but the accepted socket is installed into the fixed file table
+    // and res is the index of a direct descriptor (Descriptor { res, true }) instead of an fd.
+    // If the table is full, the result is ENFILE and the connection is dropped by the kernel.
+    // Direct descriptors must be closed with close.
+    RequestHandle acceptDirect(int fd, sockaddr_in* addr, socklen_t* addrlen, HandlerEcRes cb);
+    RequestHandle acceptMultishotDirect(int fd, HandlerEcResMore cb);
+
+    // getpeername does not work on direct descriptors, but getsockopt(SO_PEERNAME) through
+    // IORING_OP_URING_CMD does (Linux 6.7). So this is the way to get the address of a connection
+    // accepted with acceptMultishotDirect. addr must stay valid until the operation completes.
+    bool hasGetPeerName() const;
+    RequestHandle getPeerName(Descriptor sockfd, ::sockaddr_in* addr, HandlerEc cb);
+
+    RequestHandle connect(int sockfd, const ::sockaddr* addr, socklen_t addrlen, HandlerEc cb);
 
     // res argument is sent bytes
-    bool send(int sockfd, const void* buf, size_t len, HandlerEcRes cb);
+    RequestHandle send(Descriptor sockfd, const void* buf, size_t len, HandlerEcRes cb);
 
     // timeout may be nullptr for convenience (which is equivalent to the function above)
-    bool send(int sockfd, const void* buf, size_t len, Timespec* timeout, bool timeoutIsAbsolute,
-        HandlerEcRes cb);
+    RequestHandle send(Descriptor sockfd, const void* buf, size_t len, Timespec* timeout,
+        bool timeoutIsAbsolute, HandlerEcRes cb);
+
+    // IORING_OP_SENDMSG, to send multiple buffers in one operation (scatter-gather).
+    // msg and the iovecs it points to must stay valid until the operation completes.
+    RequestHandle sendmsg(Descriptor sockfd, const ::msghdr* msg, int flags, HandlerEcRes cb);
+
+    // IORING_OP_SEND_ZC and IORING_OP_SENDMSG_ZC (Linux 6.1). The kernel sends straight from the
+    // buffers instead of copying them into the socket buffer, so they must not be modified or
+    // freed before `released` is called, which might be long after cb (once the data has been
+    // acked). released is always called after cb, even if the send failed.
+    // Pinning the pages is not free either, so this is only worth it for large buffers and on
+    // loopback the kernel copies anyway.
+    bool hasZeroCopySend() const;
+    RequestHandle sendZc(
+        Descriptor sockfd, const void* buf, size_t len, HandlerEcRes cb, HandlerEc released);
+    RequestHandle sendmsgZc(
+        Descriptor sockfd, const ::msghdr* msg, int flags, HandlerEcRes cb, HandlerEc released);
+
+    // IORING_OP_WRITE_FIXED and IORING_OP_READ_FIXED, which behave like send and recv (without
+    // flags) on sockets. They send from or receive into [offset, offset + len) of buffer, which
+    // must not be released before the operation completes.
+    RequestHandle sendFixed(Descriptor sockfd, const RegisteredBuffer& buffer, size_t offset,
+        size_t len, Timespec* timeout, bool timeoutIsAbsolute, HandlerEcRes cb);
+    RequestHandle recvFixed(Descriptor sockfd, const RegisteredBuffer& buffer, size_t offset,
+        size_t len, Timespec* timeout, bool timeoutIsAbsolute, HandlerEcRes cb);
 
     // res argument is received bytes
-    bool recv(int sockfd, void* buf, size_t len, HandlerEcRes cb);
+    RequestHandle recv(Descriptor sockfd, void* buf, size_t len, HandlerEcRes cb);
+
+    RequestHandle recv(Descriptor sockfd, void* buf, size_t len, Timespec* timeout,
+        bool timeoutIsAbsolute, HandlerEcRes cb);
 
-    bool recv(int sockfd, void* buf, size_t len, Timespec* timeout, bool timeoutIsAbsolute,
-        HandlerEcRes cb);
+    // The kernel picks a buffer from the provided buffer ring, once data arrives.
+    // len may be smaller than the buffer size to limit the number of received bytes.
+    RequestHandle recv(Descriptor sockfd, size_t len, Timespec* timeout, bool timeoutIsAbsolute,
+        HandlerEcBuffer cb);
 
-    bool read(int fd, void* buf, size_t count, HandlerEcRes cb);
+    // Produces a CQE with a provided buffer every time data arrives, until the kernel terminates
+    // it (more = false), e.g. on EOF, error or if no provided buffers are available (ENOBUFS).
+    // Timeouts can not be linked to multishot operations and closing the socket does not
+    // terminate it, shutting it down does.
+    RequestHandle recvMultishot(Descriptor sockfd, HandlerEcBufferMore cb);
 
-    bool close(int fd, HandlerEc cb);
+    RequestHandle read(int fd, void* buf, size_t count, HandlerEcRes cb);
 
-    bool shutdown(int fd, int how, HandlerEc cb);
+    RequestHandle close(Descriptor fd, HandlerEc cb);
 
-    bool poll(int fd, short events, HandlerEcRes cb);
+    RequestHandle shutdown(Descriptor fd, int how, HandlerEc cb);
+
+    RequestHandle poll(int fd, short events, HandlerEcRes cb);
+
+    // A regular expiration will result in ETIME.
+    RequestHandle timeout(Timespec* ts, bool isAbsolute, HandlerEc cb);
+
+    // IORING_OP_ASYNC_CANCEL. The cancelled operation will complete with ECANCELED.
+    // The result of cb is ENOENT if the operation already completed and EALREADY if it is running
+    // and can't be cancelled anymore. It is safe to pass handles of completed operations.
+    bool cancel(RequestHandle handle, HandlerEc cb);
 
     class NotifyHandle {
     public:
@@ -88,48 +266,134 @@ public:
     // The value passed to NotifyHandle::notify will be passed to the handler cb.
     NotifyHandle wait(std::function<void(std::error_code, uint64_t)> cb);
 
+    // Runs func on a worker thread (see WorkerPool) and cb with its result on this thread.
     template <typename Result>
     bool async(std::function<Result()> func, std::function<void(std::error_code, Result&&)> cb)
     {
-        // std::function content needs to be copyable :)
-        // Only a minimal amount of hair has been ripped out of my skull because of this.
-        auto prom = std::make_shared<std::promise<Result>>();
-        auto fut = std::make_shared<std::future<Result>>(prom->get_future());
-        auto handle = wait(
-            [fut = std::move(fut), cb = std::move(cb)](std::error_code ec, uint64_t) mutable {
-                if (ec) {
-                    cb(ec, Result());
-                } else {
-                    cb(std::error_code(), std::move(fut->get()));
-                }
-            });
-        if (!handle) {
-            return false;
-        }
-
-        // Simply detaching a thread is really not very clean, but it's easy and enough for my
-        // current use cases.
-        std::thread t(
-            [func = std::move(func), prom = std::move(prom), handle = std::move(handle)]() mutable {
-                prom->set_value(func());
-                handle.notify();
-            });
-        t.detach();
+        workers_.submit(std::make_unique<AsyncJob<Result>>(std::move(func), std::move(cb)));
         return true;
     }
 
+    // The number of worker threads for async. Only has an effect before the first call to async.
+    void setNumAsyncThreads(size_t numThreads);
+
+    // Runs fn on the thread of this IoQueue. This can be called from any thread.
+    // If the calling thread is running an IoQueue itself, the message is sent with
+    // IORING_OP_MSG_RING (Linux 5.18), which posts a CQE to this ring directly. Otherwise (or if
+    // that fails) the message is announced through an eventfd, which costs a write syscall here and
+    // a read on the other side.
+    void post(Function<void()> fn);
+
+    // Returns once there are no more operations pending. Note that posted messages do not keep
+    // the IoQueue running, so someone needs to have an operation queued to receive them.
     void run();
 
 private:
+    template <typename Result>
+    class AsyncJob : public WorkerPool::Job {
+    public:
+        AsyncJob(std::function<Result()> func, std::function<void(std::error_code, Result&&)> cb)
+            : func_(std::move(func))
+            , cb_(std::move(cb))
+        {
+        }
+
+        void run() override { result_ = func_(); }
+
+        void complete() override { cb_(std::error_code(), std::move(result_)); }
+
+    private:
+        std::function<Result()> func_;
+        std::function<void(std::error_code, Result&&)> cb_;
+        Result result_;
+    };
+
     size_t addHandler(HandlerEc&& cb);
     size_t addHandler(HandlerEcRes&& cb);
+    size_t addHandler(HandlerEcResMore&& cb);
+    size_t addHandler(HandlerEcBuffer&& cb);
+    size_t addHandler(HandlerEcBufferMore&& cb);
+
+    struct ZeroCopyHandler {
+        HandlerEcRes cb;
+        HandlerEc released;
+    };
+    size_t addHandler(ZeroCopyHandler&& handler);
+
+    // The user data of an SQE is the index of its completion handler and a generation counter, so
+    // that handles of completed operations never refer to an operation that reused the index.
+    static size_t getHandlerIndex(uint64_t userData);
+
+    ProvidedBuffer getProvidedBuffer(const io_uring_cqe* cqe);
+
+    // Called for the last CQE of an operation
+    void recordCompletion(size_t handlerIndex);
 
+    static io_uring_sqe* setFixedFile(io_uring_sqe* sqe, Descriptor fd);
+    void updateFixedFilesInUse(int delta);
+
+    // Fills in an SQE, which is guaranteed to be available. If the SQ is full, the operation is
+    // deferred and this is called later, so it must capture everything by value.
+    using PrepareSqe = Function<io_uring_sqe*(IoURing& ring)>;
+
+    struct PendingSqe {
+        PrepareSqe prepare;
+        uint64_t userData;
+        Timespec* timeout;
+        bool timeoutIsAbsolute;
+    };
+
+    // If there is no room in the SQ, even after submitting everything in it, the operation is
+    // put into pendingSqes_ and submitted as soon as there is room again, instead of being
+    // dropped. Under overload this makes everything slower, but nothing gets lost.
     template <typename Callback>
-    bool addSqe(io_uring_sqe* sqe, Callback cb);
+    RequestHandle addSqe(PrepareSqe prepare, Callback cb);
 
+    // timeout may be nullptr
     template <typename Callback>
-    bool addSqe(io_uring_sqe* sqe, Timespec* timeout, bool timeoutIsAbsolute, Callback cb);
+    RequestHandle addSqe(
+        PrepareSqe prepare, Timespec* timeout, bool timeoutIsAbsolute, Callback cb);
+
+    // Returns false if there is no room in the SQ
+    bool prepareSqe(PendingSqe& op);
+    void flushPendingSqes();
+    int submitSqes(uint32_t waitCqes);
+
+    void readMessageEventFd();
+    void runMessages();
 
     IoURing ring_;
+    // Completion handlers might own ProvidedBuffers (through the Session), so they have to be
+    // destroyed before the ring.
+    ProvidedBufferRing providedBuffers_;
+    // Same for RegisteredBuffers (through the SslConnection)
+    RegisteredBufferPool registeredBuffers_;
     SlotMap<CompletionHandler> completionHandlers_;
+    std::deque<PendingSqe> pendingSqes_;
+    bool multishotAccept_ = false;
+    bool multishotRecv_ = false;
+    bool msgRing_ = false;
+    bool zeroCopySend_ = false;
+    bool getPeerName_ = false;
+    bool zeroCopyReportUsage_ = false;
+    bool sqPoll_ = false;
+    size_t numFixedFiles_ = 0;
+    size_t numFixedFilesInUse_ = 0;
+    uint32_t generation_ = 0;
+    uint64_t nowNs_ = 0;
+    uint64_t now_ = 0;
+    // For the per-opcode metrics, indexed by handler index like completionHandlers_, so they don't
+    // need an allocation or label lookup per operation.
+    struct OpInfo {
+        uint64_t submitNs;
+        uint8_t opcode;
+        bool multishot;
+    };
+    std::vector<OpInfo> opInfos_;
+    // Destroyed before the completion handlers, which might own timers (through the Session), so
+    // it unlinks all of them.
+    TimerWheel timers_;
+    WorkerPool workers_;
+    MpscQueue<Function<void()>> messages_;
+    EventFd messageEventFd_;
 };
@@ -1,6 +1,7 @@
 #include "log.hpp"
 
 #include <cassert>
+#include <cstdlib>
 #include <ctime>
 #include <thread>
 
@@ -76,6 +77,9 @@ void init(Severity severity)
     logThread() = std::thread { logThreadFunc };
     // Maybe I also need to think of something for abnormal termination
     std::atexit(logAtExit);
+    // The microbenchmarks leave with quick_exit, because the server loop never terminates, but
+    // they still want to see their results.
+    std::at_quick_exit(logAtExit);
 }
 
 namespace detail {
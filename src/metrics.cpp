@@ -8,10 +8,22 @@ Metrics& Metrics::get()
         = cpprom::Registry::getDefault().registerCollector(cpprom::makeProcessMetricsCollector());
     static auto durationBuckets = cpprom::Histogram::defaultBuckets();
     static auto sizeBuckets = cpprom::Histogram::exponentialBuckets(256.0, 4.0, 7);
+    static auto batchBuckets = cpprom::Histogram::exponentialBuckets(1.0, 2.0, 10);
+    // 1/64 to 1
+    static auto fillBuckets = cpprom::Histogram::exponentialBuckets(1.0 / 64.0, 2.0, 7);
+    // 1us to ~4s. Most IO operations are much faster than the default buckets.
+    static auto opDurationBuckets = cpprom::Histogram::exponentialBuckets(1e-6, 4.0, 12);
     static Metrics metrics {
         reg.counter("htcpp_connections_accepted", {}, "Number of connections accepted"),
         reg.counter("htcpp_connections_dropped", {}, "Number of connections dropped"),
         reg.gauge("htcpp_connections_active", {}, "Number of active connections"),
+        reg.counter("htcpp_connections_reaped", {},
+            "Number of idle connections closed, because there were too many connections"),
+        reg.counter("htcpp_connections_timed_out", {},
+            "Number of connections closed, because a read or send deadline expired"),
+        reg.counter("htcpp_connections_recv_paused", {},
+            "Number of times a multishot recv was cancelled, because the client kept sending while "
+            "its request was processed"),
 
         reg.counter(
             "htcpp_requests_total", { "method", "url", "status" }, "Number of received requests"),
@@ -44,6 +56,48 @@ Metrics& Metrics::get()
 
         reg.gauge("htcpp_io_queued_total", { /*"op"*/ },
             "Number of operations currently queued in the IO queue"),
+        reg.counter("htcpp_io_sqes_total", {}, "Number of SQEs added to the IO queue"),
+        reg.counter(
+            "htcpp_io_submits_total", {}, "Number of calls to submit SQEs (io_uring_enter)"),
+        reg.histogram("htcpp_io_cqes_per_iteration", {}, batchBuckets,
+            "Number of CQEs handled per event loop iteration"),
+        reg.histogram("htcpp_io_sq_fill_ratio", {}, fillBuckets,
+            "Fraction of the submission queue that is filled, when it is submitted"),
+        reg.histogram("htcpp_io_cq_fill_ratio", {}, fillBuckets,
+            "Fraction of the completion queue that is filled, when it is reaped"),
+        reg.gauge("htcpp_io_ops_in_flight", { "op" },
+            "Number of operations submitted to the kernel, that have not completed yet"),
+        reg.histogram("htcpp_io_op_duration_seconds", { "op" }, opDurationBuckets,
+            "Time from submission to completion of (non-multishot) operations"),
+        reg.gauge("htcpp_io_pending_sqes", {},
+            "Number of operations waiting for room in the submission queue"),
+        reg.counter("htcpp_io_pending_sqes_total", {},
+            "Number of operations that had to wait for room in the submission queue"),
+        reg.gauge("htcpp_io_provided_buffers", {}, "Number of buffers in the provided buffer ring"),
+        reg.gauge("htcpp_io_provided_buffers_in_use", {},
+            "Number of buffers from the provided buffer ring that are currently in use"),
+        reg.counter("htcpp_io_provided_buffers_exhausted_total", {},
+            "Number of receives that failed, because no provided buffers were available"),
+        reg.gauge("htcpp_io_fixed_files", {}, "Number of slots in the fixed file table"),
+        reg.gauge("htcpp_io_fixed_files_in_use", {},
+            "Number of slots in the fixed file table that are currently in use"),
+        reg.gauge("htcpp_io_registered_buffers", {}, "Number of registered buffers"),
+        reg.gauge("htcpp_io_registered_buffers_in_use", {},
+            "Number of registered buffers that are currently in use"),
+        reg.counter("htcpp_io_registered_buffers_exhausted_total", {},
+            "Number of times no registered buffer was available"),
+        reg.counter("htcpp_io_zero_copy_sends_total", { "copied" },
+            "Number of zero-copy sends and whether the kernel had to copy the data anyway"),
+
+        reg.gauge("htcpp_async_threads", {}, "Number of worker threads for async tasks"),
+        reg.gauge("htcpp_async_threads_busy", {},
+            "Number of worker threads that are currently running a task"),
+        reg.gauge("htcpp_async_queue_depth", {}, "Number of async tasks waiting for a thread"),
+        reg.counter("htcpp_async_tasks_total", {}, "Number of async tasks completed"),
+        reg.histogram("htcpp_async_task_wait_duration_seconds", {}, durationBuckets,
+            "Time async tasks waited in the queue for a thread"),
+        reg.histogram("htcpp_async_task_duration_seconds", {}, durationBuckets,
+            "Time it took to run async tasks"),
     };
     return metrics;
 }
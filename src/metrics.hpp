@@ -17,6 +17,9 @@ struct Metrics {
     cpprom::MetricFamily<cpprom::Counter>& connAccepted;
     cpprom::MetricFamily<cpprom::Counter>& connDropped;
     cpprom::MetricFamily<cpprom::Gauge>& connActive;
+    cpprom::MetricFamily<cpprom::Counter>& connReaped;
+    cpprom::MetricFamily<cpprom::Counter>& connTimedOut;
+    cpprom::MetricFamily<cpprom::Counter>& connRecvPaused;
 
     cpprom::MetricFamily<cpprom::Counter>& reqsTotal;
     cpprom::MetricFamily<cpprom::Histogram>& reqHeaderSize;
@@ -37,7 +40,31 @@ struct Metrics {
     cpprom::MetricFamily<cpprom::Histogram>& fileReadDuration;
 
     cpprom::MetricFamily<cpprom::Gauge>& ioQueueOpsQueued;
-    // cpprom::MetricFamily<cpprom::Histogram>& ioQueueOpDuration;
+    cpprom::MetricFamily<cpprom::Counter>& ioQueueSqesTotal;
+    cpprom::MetricFamily<cpprom::Counter>& ioQueueSubmits;
+    cpprom::MetricFamily<cpprom::Histogram>& ioQueueCqesPerIteration;
+    cpprom::MetricFamily<cpprom::Histogram>& ioQueueSqFill;
+    cpprom::MetricFamily<cpprom::Histogram>& ioQueueCqFill;
+    cpprom::MetricFamily<cpprom::Gauge>& ioQueueOpsInFlight;
+    cpprom::MetricFamily<cpprom::Histogram>& ioQueueOpDuration;
+    cpprom::MetricFamily<cpprom::Gauge>& ioQueuePendingSqes;
+    cpprom::MetricFamily<cpprom::Counter>& ioQueuePendingSqesTotal;
+    cpprom::MetricFamily<cpprom::Gauge>& ioProvidedBuffers;
+    cpprom::MetricFamily<cpprom::Gauge>& ioProvidedBuffersInUse;
+    cpprom::MetricFamily<cpprom::Counter>& ioProvidedBuffersExhausted;
+    cpprom::MetricFamily<cpprom::Gauge>& ioFixedFiles;
+    cpprom::MetricFamily<cpprom::Gauge>& ioFixedFilesInUse;
+    cpprom::MetricFamily<cpprom::Gauge>& ioRegisteredBuffers;
+    cpprom::MetricFamily<cpprom::Gauge>& ioRegisteredBuffersInUse;
+    cpprom::MetricFamily<cpprom::Counter>& ioRegisteredBuffersExhausted;
+    cpprom::MetricFamily<cpprom::Counter>& ioZeroCopySends;
+
+    cpprom::MetricFamily<cpprom::Gauge>& asyncThreads;
+    cpprom::MetricFamily<cpprom::Gauge>& asyncThreadsBusy;
+    cpprom::MetricFamily<cpprom::Gauge>& asyncQueueDepth;
+    cpprom::MetricFamily<cpprom::Counter>& asyncTasks;
+    cpprom::MetricFamily<cpprom::Histogram>& asyncTaskWaitDuration;
+    cpprom::MetricFamily<cpprom::Histogram>& asyncTaskDuration;
 
     static Metrics& get();
 };
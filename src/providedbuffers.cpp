@@ -0,0 +1,188 @@
+#include "providedbuffers.hpp"
+
+#include <cassert>
+#include <cstddef>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.hpp"
+#include "metrics.hpp"
+#include "util.hpp"
+
+ProvidedBuffer::ProvidedBuffer(ProvidedBufferRing* ring, uint16_t id, size_t size)
+    : ring_(ring)
+    , id_(id)
+    , size_(size)
+{
+}
+
+ProvidedBuffer::~ProvidedBuffer()
+{
+    reset();
+}
+
+ProvidedBuffer::ProvidedBuffer(ProvidedBuffer&& other)
+    : ring_(other.ring_)
+    , id_(other.id_)
+    , size_(other.size_)
+{
+    other.ring_ = nullptr;
+}
+
+ProvidedBuffer& ProvidedBuffer::operator=(ProvidedBuffer&& other)
+{
+    reset();
+    ring_ = other.ring_;
+    id_ = other.id_;
+    size_ = other.size_;
+    other.ring_ = nullptr;
+    return *this;
+}
+
+ProvidedBuffer::operator bool() const
+{
+    return ring_ != nullptr;
+}
+
+std::string_view ProvidedBuffer::view() const
+{
+    assert(ring_);
+    return std::string_view(ring_->getBuffer(id_), size_);
+}
+
+size_t ProvidedBuffer::size() const
+{
+    return size_;
+}
+
+void ProvidedBuffer::reset()
+{
+    if (ring_) {
+        ring_->release(id_);
+        ring_ = nullptr;
+    }
+    size_ = 0;
+}
+
+ProvidedBufferRing::~ProvidedBufferRing()
+{
+    if (!bufRing_) {
+        return;
+    }
+    ::io_uring_buf_reg reg = {};
+    reg.bgid = groupId_;
+    ::syscall(__NR_io_uring_register, ringFd_, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+    ::munmap(bufRing_, numBuffers_ * sizeof(::io_uring_buf));
+}
+
+bool ProvidedBufferRing::init(int ringFd, uint16_t groupId, size_t numBuffers, size_t bufferSize)
+{
+    assert(!bufRing_);
+    assert(numBuffers > 0 && numBuffers <= 32768 && (numBuffers & (numBuffers - 1)) == 0);
+
+    // The ring memory must be page aligned, which mmap guarantees
+    const auto ringSize = numBuffers * sizeof(::io_uring_buf);
+    auto mem = ::mmap(
+        nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED) {
+        slog::error("Could not allocate provided buffer ring: ", errnoToString(errno));
+        return false;
+    }
+
+    ::io_uring_buf_reg reg = {};
+    reg.ring_addr = reinterpret_cast<uint64_t>(mem);
+    reg.ring_entries = static_cast<uint32_t>(numBuffers);
+    reg.bgid = groupId;
+    if (::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        // EINVAL on kernels older than 5.19
+        slog::info("Could not register provided buffer ring: ", errnoToString(errno));
+        ::munmap(mem, ringSize);
+        return false;
+    }
+
+    ringFd_ = ringFd;
+    groupId_ = groupId;
+    numBuffers_ = numBuffers;
+    bufferSize_ = bufferSize;
+    bufRing_ = static_cast<::io_uring_buf_ring*>(mem);
+    // The pages are only backed by physical memory once a buffer is actually used
+    buffers_.reset(new char[numBuffers_ * bufferSize_]);
+    tail_ = 0;
+    for (size_t i = 0; i < numBuffers_; ++i) {
+        add(static_cast<uint16_t>(i));
+    }
+    publish();
+    Metrics::get().ioProvidedBuffers.labels().inc(numBuffers_);
+    return true;
+}
+
+bool ProvidedBufferRing::isInitialized() const
+{
+    return bufRing_ != nullptr;
+}
+
+uint16_t ProvidedBufferRing::getGroupId() const
+{
+    return groupId_;
+}
+
+size_t ProvidedBufferRing::getNumBuffers() const
+{
+    return numBuffers_;
+}
+
+size_t ProvidedBufferRing::getBufferSize() const
+{
+    return bufferSize_;
+}
+
+size_t ProvidedBufferRing::getNumInUse() const
+{
+    return numInUse_;
+}
+
+const char* ProvidedBufferRing::getBuffer(uint16_t id) const
+{
+    assert(id < numBuffers_);
+    return buffers_.get() + id * bufferSize_;
+}
+
+void ProvidedBufferRing::markInUse(uint16_t id)
+{
+    assert(id < numBuffers_);
+    assert(numInUse_ < numBuffers_);
+    numInUse_++;
+    Metrics::get().ioProvidedBuffersInUse.labels().inc();
+}
+
+void ProvidedBufferRing::release(uint16_t id)
+{
+    assert(numInUse_ > 0);
+    add(id);
+    publish();
+    numInUse_--;
+    Metrics::get().ioProvidedBuffersInUse.labels().dec();
+}
+
+void ProvidedBufferRing::add(uint16_t id)
+{
+    const auto mask = static_cast<uint16_t>(numBuffers_ - 1);
+    // Not bufRing_->bufs: In C++ the empty struct in __DECLARE_FLEX_ARRAY (linux/stddef.h) has a
+    // size of 1, so bufs would be at offset 8 instead of 0. Every entry would be written 8 bytes
+    // off and the last one past the end of the ring (into whatever is mapped after it, e.g. the
+    // SQEs). The entries start at the beginning of the ring and the tail overlays the first one.
+    static_assert(offsetof(::io_uring_buf_ring, tail) == offsetof(::io_uring_buf, resv));
+    auto& buf = reinterpret_cast<::io_uring_buf*>(bufRing_)[tail_ & mask];
+    buf.addr = reinterpret_cast<uint64_t>(getBuffer(id));
+    buf.len = static_cast<uint32_t>(bufferSize_);
+    buf.bid = id;
+    tail_++;
+}
+
+void ProvidedBufferRing::publish()
+{
+    // The kernel reads the tail without any locking, so make sure it sees the buffers first
+    __atomic_store_n(&bufRing_->tail, tail_, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+#include "iouring.hpp"
+
+class ProvidedBufferRing;
+
+// A buffer that was picked by the kernel from a ProvidedBufferRing, when data arrived.
+// It is returned to the ring when this object is destroyed (or reset).
+class ProvidedBuffer {
+public:
+    ProvidedBuffer() = default;
+    ProvidedBuffer(ProvidedBufferRing* ring, uint16_t id, size_t size);
+    ~ProvidedBuffer();
+
+    ProvidedBuffer(const ProvidedBuffer&) = delete;
+    ProvidedBuffer& operator=(const ProvidedBuffer&) = delete;
+    ProvidedBuffer(ProvidedBuffer&& other);
+    ProvidedBuffer& operator=(ProvidedBuffer&& other);
+
+    explicit operator bool() const;
+
+    // The part of the buffer that contains received data
+    std::string_view view() const;
+    size_t size() const;
+
+    void reset();
+
+private:
+    ProvidedBufferRing* ring_ = nullptr;
+    uint16_t id_ = 0;
+    size_t size_ = 0;
+};
+
+// IORING_REGISTER_PBUF_RING (Linux 5.19): A ring of buffers that the kernel picks from, only when
+// data actually arrives. This way connections that are waiting for data do not need to have their
+// own buffer.
+class ProvidedBufferRing {
+public:
+    ProvidedBufferRing() = default;
+    ~ProvidedBufferRing();
+
+    ProvidedBufferRing(const ProvidedBufferRing&) = delete;
+    ProvidedBufferRing& operator=(const ProvidedBufferRing&) = delete;
+
+    // numBuffers must be a power of two and <= 32768
+    bool init(int ringFd, uint16_t groupId, size_t numBuffers, size_t bufferSize);
+
+    bool isInitialized() const;
+    uint16_t getGroupId() const;
+    size_t getNumBuffers() const;
+    size_t getBufferSize() const;
+    size_t getNumInUse() const;
+
+    const char* getBuffer(uint16_t id) const;
+
+    // Called when the kernel picked a buffer (IORING_CQE_F_BUFFER)
+    void markInUse(uint16_t id);
+
+    // Give a buffer back to the kernel
+    void release(uint16_t id);
+
+private:
+    void add(uint16_t id);
+    void publish();
+
+    int ringFd_ = -1;
+    uint16_t groupId_ = 0;
+    size_t numBuffers_ = 0;
+    size_t bufferSize_ = 0;
+    size_t numInUse_ = 0;
+    uint16_t tail_ = 0;
+    io_uring_buf_ring* bufRing_ = nullptr;
+    std::unique_ptr<char[]> buffers_;
+};
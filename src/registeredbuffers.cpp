@@ -0,0 +1,151 @@
+#include "registeredbuffers.hpp"
+
+#include <cassert>
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.hpp"
+#include "metrics.hpp"
+#include "util.hpp"
+
+RegisteredBuffer::RegisteredBuffer(RegisteredBufferPool* pool, uint16_t index)
+    : pool_(pool)
+    , index_(index)
+{
+}
+
+RegisteredBuffer::~RegisteredBuffer()
+{
+    reset();
+}
+
+RegisteredBuffer::RegisteredBuffer(RegisteredBuffer&& other)
+    : pool_(other.pool_)
+    , index_(other.index_)
+{
+    other.pool_ = nullptr;
+}
+
+RegisteredBuffer& RegisteredBuffer::operator=(RegisteredBuffer&& other)
+{
+    reset();
+    pool_ = other.pool_;
+    index_ = other.index_;
+    other.pool_ = nullptr;
+    return *this;
+}
+
+RegisteredBuffer::operator bool() const
+{
+    return pool_ != nullptr;
+}
+
+char* RegisteredBuffer::data() const
+{
+    assert(pool_);
+    return pool_->getBuffer(index_);
+}
+
+size_t RegisteredBuffer::size() const
+{
+    assert(pool_);
+    return pool_->getBufferSize();
+}
+
+uint16_t RegisteredBuffer::getIndex() const
+{
+    return index_;
+}
+
+void RegisteredBuffer::reset()
+{
+    if (pool_) {
+        pool_->release(index_);
+        pool_ = nullptr;
+    }
+}
+
+RegisteredBufferPool::~RegisteredBufferPool()
+{
+    if (!buffers_) {
+        return;
+    }
+    // In-flight operations keep the pages pinned, so this is safe, even if there are still some
+    ::syscall(__NR_io_uring_register, ringFd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+}
+
+bool RegisteredBufferPool::init(int ringFd, size_t numBuffers, size_t bufferSize)
+{
+    assert(!buffers_);
+    // IORING_MAX_REG_BUFFERS
+    assert(numBuffers > 0 && numBuffers <= 16384 && bufferSize > 0);
+
+    std::unique_ptr<char[]> buffers(new char[numBuffers * bufferSize]);
+    std::vector<::iovec> iovecs(numBuffers);
+    for (size_t i = 0; i < numBuffers; ++i) {
+        iovecs[i] = ::iovec { buffers.get() + i * bufferSize, bufferSize };
+    }
+    // This pins (and therefore faults in) all of the pages right away
+    if (::syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_BUFFERS, iovecs.data(),
+            static_cast<unsigned>(numBuffers))
+        != 0) {
+        // ENOMEM if it exceeds RLIMIT_MEMLOCK
+        slog::info("Could not register buffers: ", errnoToString(errno));
+        return false;
+    }
+
+    ringFd_ = ringFd;
+    numBuffers_ = numBuffers;
+    bufferSize_ = bufferSize;
+    buffers_ = std::move(buffers);
+    // This is used as a stack, so the buffer that was released last (and is probably still in
+    // the cache) is handed out first.
+    freeList_.reserve(numBuffers_);
+    for (size_t i = numBuffers_; i > 0; --i) {
+        freeList_.push_back(static_cast<uint16_t>(i - 1));
+    }
+    Metrics::get().ioRegisteredBuffers.labels().inc(numBuffers_);
+    return true;
+}
+
+bool RegisteredBufferPool::isInitialized() const
+{
+    return buffers_ != nullptr;
+}
+
+size_t RegisteredBufferPool::getBufferSize() const
+{
+    return bufferSize_;
+}
+
+RegisteredBuffer RegisteredBufferPool::acquire()
+{
+    static auto& inUse = Metrics::get().ioRegisteredBuffersInUse.labels();
+    if (freeList_.empty()) {
+        if (buffers_) {
+            Metrics::get().ioRegisteredBuffersExhausted.labels().inc();
+        }
+        return RegisteredBuffer();
+    }
+    const auto index = freeList_.back();
+    freeList_.pop_back();
+    inUse.inc();
+    return RegisteredBuffer(this, index);
+}
+
+char* RegisteredBufferPool::getBuffer(uint16_t index) const
+{
+    assert(index < numBuffers_);
+    return buffers_.get() + index * bufferSize_;
+}
+
+void RegisteredBufferPool::release(uint16_t index)
+{
+    static auto& inUse = Metrics::get().ioRegisteredBuffersInUse.labels();
+    assert(index < numBuffers_ && freeList_.size() < numBuffers_);
+    freeList_.push_back(index);
+    inUse.dec();
+}
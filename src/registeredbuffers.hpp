@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class RegisteredBufferPool;
+
+// A buffer from a RegisteredBufferPool. It is returned to the pool when this object is destroyed
+// (or reset).
+class RegisteredBuffer {
+public:
+    RegisteredBuffer() = default;
+    RegisteredBuffer(RegisteredBufferPool* pool, uint16_t index);
+    ~RegisteredBuffer();
+
+    RegisteredBuffer(const RegisteredBuffer&) = delete;
+    RegisteredBuffer& operator=(const RegisteredBuffer&) = delete;
+    RegisteredBuffer(RegisteredBuffer&& other);
+    RegisteredBuffer& operator=(RegisteredBuffer&& other);
+
+    explicit operator bool() const;
+
+    char* data() const;
+    size_t size() const;
+    // For io_uring_sqe::buf_index
+    uint16_t getIndex() const;
+
+    void reset();
+
+private:
+    RegisteredBufferPool* pool_ = nullptr;
+    uint16_t index_ = 0;
+};
+
+// IORING_REGISTER_BUFFERS: Buffers that are mapped into the kernel once, so that
+// IORING_OP_READ_FIXED and IORING_OP_WRITE_FIXED don't have to pin and unpin the pages on every
+// operation. Unlike provided buffers we pick the buffer ourselves, so they can be used for sends
+// too, but it also means a buffer has to be taken out of the pool before the operation starts.
+// All buffers are pinned as long as the pool exists, which counts towards RLIMIT_MEMLOCK.
+class RegisteredBufferPool {
+public:
+    RegisteredBufferPool() = default;
+    ~RegisteredBufferPool();
+
+    RegisteredBufferPool(const RegisteredBufferPool&) = delete;
+    RegisteredBufferPool& operator=(const RegisteredBufferPool&) = delete;
+
+    // numBuffers must be <= 16384
+    bool init(int ringFd, size_t numBuffers, size_t bufferSize);
+
+    bool isInitialized() const;
+    size_t getBufferSize() const;
+
+    // Returns an empty buffer if all of them are in use
+    RegisteredBuffer acquire();
+
+    char* getBuffer(uint16_t index) const;
+
+    void release(uint16_t index);
+
+private:
+    int ringFd_ = -1;
+    size_t numBuffers_ = 0;
+    size_t bufferSize_ = 0;
+    std::unique_ptr<char[]> buffers_;
+    std::vector<uint16_t> freeList_;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "ioqueue.hpp"
+
+// A value that is read all the time by the IoQueue threads (see Config::threads), but changes
+// rarely and might be changed from any thread, like the current TLS context.
+// Every IoQueue thread has its own copy, which it can read without any synchronization, and
+// updates are posted to all copies (IoQueue::post), so there is no shared cache line that every
+// connection has to touch.
+// A thread's copy is created on its first call to get, so this can be created before the threads.
+// Like most things here, a Replicated is assumed to live until the end of the program.
+template <typename T>
+class Replicated {
+public:
+    Replicated(T value = T {})
+        : value_(std::move(value))
+    {
+    }
+
+    Replicated(const Replicated&) = delete;
+    Replicated& operator=(const Replicated&) = delete;
+
+    // Must be called from the thread running io and always with the same io on that thread.
+    // Updates from set arrive with a delay, i.e. when io handles the message.
+    const T& get(IoQueue& io)
+    {
+        auto& replicas = getThreadReplicas();
+        const auto it = replicas.find(this);
+        if (it != replicas.end()) {
+            return it->second;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        // The references stay valid, because std::unordered_map does not move its nodes
+        auto& replica = replicas.emplace(this, value_).first->second;
+        replicas_.emplace_back(&io, &replica);
+        return replica;
+    }
+
+    // This can be called from any thread
+    void set(T value)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        value_ = std::move(value);
+        for (const auto& [io, replica] : replicas_) {
+            io->post(
+                [replica = replica, value = value_]() mutable { *replica = std::move(value); });
+        }
+    }
+
+private:
+    static std::unordered_map<const Replicated*, T>& getThreadReplicas()
+    {
+        static thread_local std::unordered_map<const Replicated*, T> replicas;
+        return replicas;
+    }
+
+    // Guards value_ and replicas_
+    std::mutex mutex_;
+    T value_;
+    std::vector<std::pair<IoQueue*, T*>> replicas_;
+};
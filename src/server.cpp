@@ -9,7 +9,7 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-Fd createTcpListenSocket(uint16_t listenPort, uint32_t listenAddr, int backlog)
+Fd createTcpListenSocket(uint16_t listenPort, uint32_t listenAddr, int backlog, bool reusePort)
 {
     Fd fd { ::socket(AF_INET, SOCK_STREAM, 0) };
     if (fd == -1)
@@ -27,6 +27,11 @@ Fd createTcpListenSocket(uint16_t listenPort, uint32_t listenAddr, int backlog)
         return Fd {};
     }
 
+    if (reusePort && ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+        slog::error("Could not set sockopt SO_REUSEPORT");
+        return Fd {};
+    }
+
     if (::bind(fd, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr)) == -1) {
         slog::error("Could not bind to port ", listenPort);
         return Fd {};
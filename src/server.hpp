@@ -1,11 +1,16 @@
 #pragma once
 
+#include <array>
+#include <deque>
+#include <map>
 #include <memory>
 #include <string>
 #include <vector>
 
+#include "arena.hpp"
 #include "config.hpp"
 #include "fd.hpp"
+#include "freelistallocator.hpp"
 #include "http.hpp"
 #include "ioqueue.hpp"
 #include "log.hpp"
@@ -15,8 +20,12 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
-Fd createTcpListenSocket(uint16_t listenPort, uint32_t listenAddr, int backlog);
+// With reusePort (SO_REUSEPORT) multiple sockets can listen on the same port and the kernel
+// distributes the connections between them.
+Fd createTcpListenSocket(
+    uint16_t listenPort, uint32_t listenAddr, int backlog, bool reusePort = false);
 
 struct Responder {
     virtual ~Responder() = default;
@@ -42,8 +51,8 @@ public:
     Server(IoQueue& io, ConnectionFactory factory, RequestHandler handler,
         Config::Server config = Config::Server {})
         : io_(io)
-        , listenSocket_(
-              createTcpListenSocket(config.listenPort, config.listenAddress, config.listenBacklog))
+        , listenSocket_(createTcpListenSocket(
+              config.listenPort, config.listenAddress, config.listenBacklog, config.reusePort))
         , handler_(std::move(handler))
         , connectionFactory_(std::move(factory))
         , config_(std::move(config))
@@ -64,40 +73,143 @@ public:
 private:
     class Session;
 
+    // The labels of a metric are std::strings, so looking them up allocates. The metrics of every
+    // path are only looked up once per Server (i.e. thread), which makes them basically free after
+    // that. Like the metrics themselves, this grows with every path that is requested.
+    struct StatusMetrics {
+        cpprom::Counter& reqsTotal;
+        cpprom::Counter& respTotal;
+        cpprom::Histogram& respSize;
+    };
+
+    struct PathMetrics {
+        std::string method;
+        std::string path;
+        cpprom::Histogram& reqHeaderSize;
+        cpprom::Histogram& reqBodySize;
+        cpprom::Histogram& reqDuration;
+        std::map<StatusCode, StatusMetrics> statuses = {};
+
+        StatusMetrics& getStatusMetrics(StatusCode status)
+        {
+            auto it = statuses.find(status);
+            if (it == statuses.end()) {
+                const auto s = std::to_string(static_cast<int>(status));
+                it = statuses
+                         .emplace(status,
+                             StatusMetrics { Metrics::get().reqsTotal.labels(method, path, s),
+                                 Metrics::get().respTotal.labels(method, path, s),
+                                 Metrics::get().respSize.labels(method, path, s) })
+                         .first;
+            }
+            return it->second;
+        }
+    };
+
+    // Every Session has one of these and the handler gets a shared_ptr to it, that shares
+    // ownership with the session (aliasing constructor), so it keeps the session alive and
+    // handing it out does not allocate.
     struct SessionResponder : public Responder {
-        // shared_ptr on the session to keep it alive as long as this lives
-        std::shared_ptr<Session> session;
+        Session& session;
 
-        SessionResponder(std::shared_ptr<Session> session)
-            : session(std::move(session))
+        SessionResponder(Session& session)
+            : session(session)
         {
         }
 
-        void respond(Response&& response) override { session->respond(std::move(response)); }
+        void respond(Response&& response) override { session.respond(std::move(response)); }
     };
 
     // A Session will have ownership of itself and decide on its own when it's time to be
-    // destroyed
+    // closed. It is not destroyed then, but given back to the server, which will reuse it for
+    // another connection (see Server::createSession).
     class Session : public std::enable_shared_from_this<Session> {
     public:
-        Session(std::unique_ptr<Connection> connection, RequestHandler& handler,
-            std::string remoteAddr, const Config::Server& serverConfig)
-            : connection_(std::move(connection))
+        Session(Server& server, IoQueue& io, RequestHandler& handler,
+            const Config::Server& serverConfig)
+            : server_(server)
+            , io_(io)
             , handler_(handler)
-            , remoteAddr_(std::move(remoteAddr))
-            , trackInProgressHandle_(Metrics::get().connActive.labels().trackInProgress())
+            , responder_(*this)
             , serverConfig_(serverConfig)
         {
-            requestHeaderBuffer_.reserve(serverConfig_.maxRequestHeaderSize);
-            requestBodyBuffer_.reserve(serverConfig_.maxRequestBodySize);
         }
 
-        ~Session() = default;
+        ~Session()
+        {
+            if (connection_) {
+                close();
+            }
+        }
+
+        Session(const Session&) = delete;
+        Session(Session&&) = delete;
+        Session& operator=(const Session&) = delete;
+        Session& operator=(Session&&) = delete;
+
+        void open(std::unique_ptr<Connection> connection, std::string_view remoteAddr)
+        {
+            assert(!connection_);
+            static auto& connActive = Metrics::get().connActive.labels();
+            connActive.inc();
+            connection_ = std::move(connection);
+            remoteAddr_.assign(remoteAddr);
+            server_.numSessions_++;
+        }
+
+        // Only for direct descriptors, which getpeername doesn't work on (see Server::accept).
+        // This completes right away (the socket is connected already), so usually the address is
+        // there long before the first access log entry.
+        void resolveRemoteAddr(IoQueue::Descriptor fd)
+        {
+            io_.getPeerName(fd, &peerAddr_, [this, self = this->shared_from_this()](
+                                                std::error_code ec) {
+                if (ec) {
+                    slog::debug("Could not get peer address: ", ec.message());
+                    return;
+                }
+                remoteAddr_.assign(::inet_ntoa(peerAddr_.sin_addr));
+            });
+        }
+
+        // Called when the last reference to the session is gone. Everything that belongs to the
+        // connection is released, but the buffers keep their capacity for the next connection.
+        void close()
+        {
+            assert(connection_);
+            static auto& connActive = Metrics::get().connActive.labels();
+            connActive.dec();
+            if (idle_) {
+                server_.removeIdle(this);
+            }
+            server_.numSessions_--;
+            if (reaped_) {
+                server_.numReaped_--;
+            }
+            io_.getTimers().cancel(timer_);
+            connection_.reset();
 
-        Session(const Session&) = default;
-        Session(Session&&) = default;
-        Session& operator=(const Session&) = default;
-        Session& operator=(Session&&) = default;
+            providedBuffer_.reset();
+            pendingBuffers_.clear();
+            requestHeaderBuffer_.clear();
+            requestBodyBuffer_.clear();
+            responseBuffer_.clear();
+            responseHeader_ = std::string_view();
+            responseBody_ = std::string_view();
+            zeroCopyHeader_.reset();
+            // This might hold on to a sharedBody (e.g. a cached file)
+            resetRequest();
+            requestHeaderSize_ = 0;
+            contentLength_ = 0;
+            readState_ = ReadState::None;
+            multishotRecv_ = false;
+            recvPaused_ = false;
+            responseSendOffset_ = 0;
+            zeroCopy_ = false;
+            idle_ = false;
+            reaped_ = false;
+            timedOut_ = false;
+        }
 
         void start()
         {
@@ -109,7 +221,21 @@ private:
             readRequest();
         }
 
+        // Called by the Server, when there are too many connections. The session must have been
+        // removed from the idle list already.
+        void reap()
+        {
+            assert(!idle_ && !reaped_);
+            reaped_ = true;
+            server_.numReaped_++;
+            Metrics::get().connReaped.labels().inc();
+            // The pending recv will fail with ECANCELED and the connection will be closed
+            io_.getTimers().cancel(timer_);
+            connection_->cancel();
+        }
+
     private:
+        friend class Server;
         friend class SessionResponder;
 
         // Inspired by this: https://github.com/expressjs/morgan#predefined-formats
@@ -122,92 +248,425 @@ private:
             }
         }
 
+        // Everything that was allocated from the arena has to be destroyed before it is reset
+        void resetRequest()
+        {
+            request_ = Request();
+            response_ = Response();
+            requestMetrics_ = nullptr;
+            requestParser_.reset();
+            arena_.reset();
+        }
+
         void readRequest()
         {
+            resetRequest();
+            requestParser_.reset(&arena_);
             requestHeaderBuffer_.clear();
             requestBodyBuffer_.clear();
-            IoQueue::setAbsoluteTimeout(&recvTimeout_, serverConfig_.fullReadTimeoutMs);
+            // Give the buffer of the last request back before we wait for the next one
+            providedBuffer_.reset();
+            // A keep-alive connection waiting for its next request is idle
+            setDeadline(idle_ ? serverConfig_.keepAliveIdleTimeoutMs
+                              : serverConfig_.headerReadTimeoutMs);
+
+            if constexpr (Connection::SupportsProvidedBuffers) {
+                if (connection_->hasProvidedBuffers()
+                    && connection_->getProvidedBufferSize() >= serverConfig_.maxRequestHeaderSize) {
+                    if (connection_->hasMultishotRecv()) {
+                        readRequestMultishot();
+                    } else {
+                        readRequestProvided();
+                    }
+                    return;
+                }
+            }
+            readRequestOwned();
+        }
+
+        // A single multishot recv stays armed for the whole lifetime of the connection, so a
+        // keep-alive connection does not need any SQEs to wait for the next request.
+        void readRequestMultishot()
+        {
+            readState_ = ReadState::Header;
+            continueMultishot();
+        }
+
+        void armMultishotRecv()
+        {
+            if (!multishotRecv_) {
+                multishotRecv_ = true;
+                connection_->recvMultishot([this, self = this->shared_from_this()](
+                                               std::error_code ec, ProvidedBuffer buffer,
+                                               bool more) {
+                    onMultishotRecv(ec, std::move(buffer), more);
+                });
+            }
+        }
+
+        // The client might have sent more, before we were done with the last request. That has to
+        // be used up first, because the recv might be paused until then.
+        void continueMultishot()
+        {
+            if (!pendingBuffers_.empty()) {
+                auto buffer = std::move(pendingBuffers_.front());
+                pendingBuffers_.pop_front();
+                onMultishotData(std::move(buffer));
+            } else {
+                armMultishotRecv();
+            }
+        }
+
+        void onMultishotRecv(std::error_code ec, ProvidedBuffer buffer, bool more)
+        {
+            const auto paused = recvPaused_ && !more;
+            if (!more) {
+                multishotRecv_ = false;
+                recvPaused_ = false;
+            }
+
+            if (readState_ == ReadState::None) {
+                // If the multishot recv terminated (e.g. EOF or error), it will be armed again
+                // when we read the next request and terminate again immediately with the same
+                // result.
+                if (buffer.size() > 0) {
+                    pendingBuffers_.push_back(std::move(buffer));
+                }
+                // The provided buffers are shared by all connections on this ring, so a client
+                // that just keeps sending must not be able to take them all. Pipelining is not
+                // supported anyway, so there is no reason to receive more than a few buffers ahead.
+                // The recv is armed again once these are used up.
+                if (pendingBuffers_.size() >= MaxPendingBuffers && multishotRecv_ && !recvPaused_) {
+                    recvPaused_ = true;
+                    Metrics::get().connRecvPaused.labels().inc();
+                    connection_->cancelRecv();
+                }
+                return;
+            }
+
+            if (closeIfTimedOut()) {
+                return;
+            }
+
+            if (paused && ec.value() == ECANCELED) {
+                // We paused the recv ourselves and want data again by now
+                continueMultishot();
+                return;
+            }
+
+            if (ec.value() == ENOBUFS) {
+                // The multishot recv terminated, because all provided buffers are in use.
+                // We fall back to our own buffers for this request and try again with the next.
+                const auto state = readState_;
+                readState_ = ReadState::None;
+                if (state == ReadState::Header) {
+                    readRequestOwned();
+                } else {
+                    readRequestBody(contentLength_);
+                }
+                return;
+            }
+
+            if (ec) {
+                const auto state = readState_;
+                readState_ = ReadState::None;
+                if (state == ReadState::Header) {
+                    onRecvHeaderError(ec);
+                } else {
+                    Metrics::get().recvErrors.labels(ec.message()).inc();
+                    slog::error("Error in recv (body): ", ec.message());
+                    connection_->close();
+                }
+                return;
+            }
+
+            if (buffer.size() == 0) {
+                readState_ = ReadState::None;
+                setIdle(false);
+                connection_->close();
+                return;
+            }
+
+            onMultishotData(std::move(buffer));
+        }
+
+        void onMultishotData(ProvidedBuffer buffer)
+        {
+            if (readState_ == ReadState::Header) {
+                // onRequestHeaderData might set it to Header or Body again
+                readState_ = ReadState::None;
+                if (requestHeaderBuffer_.empty()) {
+                    providedBuffer_ = std::move(buffer);
+                    onRequestHeaderData(providedBuffer_.view());
+                } else {
+                    // The start of the request arrived in an earlier buffer
+                    requestHeaderBuffer_.append(buffer.view());
+                    onRequestHeaderData(requestHeaderBuffer_);
+                }
+            } else {
+                assert(readState_ == ReadState::Body);
+                assert(requestBodyBuffer_.size() < contentLength_);
+                // Pipelining is not supported, so anything after the body is ignored
+                const auto data
+                    = buffer.view().substr(0, contentLength_ - requestBodyBuffer_.size());
+                requestBodyBuffer_.append(data);
+                if (requestBodyBuffer_.size() == contentLength_) {
+                    readState_ = ReadState::None;
+                    request_.body = std::string_view(requestBodyBuffer_);
+                    processRequest(request_);
+                } else {
+                    continueMultishot();
+                }
+            }
+        }
+
+        // Deadlines don't need an SQE of their own (like a linked timeout would). They are timers
+        // in the IoQueue's timer wheel and when one expires, the pending operations are cancelled.
+        // Expired timers of many connections are cancelled in the same loop iteration, so all
+        // of those cancellations are submitted together.
+        void setDeadline(uint32_t timeoutMs)
+        {
+            // The timer is owned by the session and cancelled when it is destroyed, so it must not
+            // keep the session alive.
+            io_.getTimers().schedule(timer_, timeoutMs, [this]() { onTimeout(); });
+        }
+
+        void clearDeadline() { io_.getTimers().cancel(timer_); }
+
+        void onTimeout()
+        {
+            Metrics::get().connTimedOut.labels().inc();
+            // The pending recv or send will usually fail with ECANCELED and its handler will take
+            // care of the connection. But if its CQE is in the same batch as the expiration, the
+            // cancel does nothing and the handler would just start the next operation (without a
+            // deadline), so the handlers check timedOut_ first.
+            timedOut_ = true;
+            connection_->cancel();
+        }
+
+        // Must be called first in every completion handler
+        bool closeIfTimedOut()
+        {
+            if (!timedOut_) {
+                return false;
+            }
+            // Only once, so we don't close again, if there is another operation in flight
+            timedOut_ = false;
+            readState_ = ReadState::None;
+            setIdle(false);
+            connection_->close();
+            return true;
+        }
+
+        // The connection does not need a buffer of its own, while it's waiting for a request.
+        // The kernel picks one from the provided buffer ring once data arrives and the request is
+        // parsed directly from that buffer, which is released once we wait for the next request.
+        void readRequestProvided()
+        {
+            connection_->recv(serverConfig_.maxRequestHeaderSize, nullptr,
+                [this, self = this->shared_from_this()](
+                    std::error_code ec, ProvidedBuffer buffer) {
+                    if (closeIfTimedOut()) {
+                        return;
+                    }
+
+                    if (ec.value() == ENOBUFS) {
+                        // All provided buffers are in use, so we fall back to our own buffer.
+                        // This only happens under very high load.
+                        readRequestOwned();
+                        return;
+                    }
+
+                    if (ec) {
+                        onRecvHeaderError(ec);
+                        return;
+                    }
+
+                    if (buffer.size() == 0) {
+                        setIdle(false);
+                        connection_->close();
+                        return;
+                    }
+
+                    providedBuffer_ = std::move(buffer);
+                    onRequestHeaderData(providedBuffer_.view());
+                });
+        }
 
-            const auto recvLen = serverConfig_.maxRequestHeaderSize;
+        // If part of the request header was received already, it is in requestHeaderBuffer_ and
+        // this receives the rest of it.
+        void readRequestOwned()
+        {
+            const auto received = requestHeaderBuffer_.size();
+            assert(received < serverConfig_.maxRequestHeaderSize);
+            const auto recvLen = serverConfig_.maxRequestHeaderSize - received;
+            // After the first request the capacity is there already, so this does not allocate
             requestHeaderBuffer_.append(recvLen, '\0');
-            connection_->recv(requestHeaderBuffer_.data(), recvLen, &recvTimeout_,
+            connection_->recv(requestHeaderBuffer_.data() + received, recvLen,
                 // `this->` before `shared_from_this` is necessary or you get an error
                 // because of a dependent type lookup.
                 [this, self = this->shared_from_this(), recvLen](
                     std::error_code ec, int readBytes) {
+                    if (closeIfTimedOut()) {
+                        return;
+                    }
+
                     if (ec) {
-                        Metrics::get().recvErrors.labels(ec.message()).inc();
-                        slog::error("Error in recv (headers): ", ec.message());
-                        // Error might be ECONNRESET, EPIPE (from send) or others, where we just
-                        // want to close. There might be errors, where shutdown is better, but
-                        // especially with SSL almost all errors here require us to NOT shutdown.
-                        // Same applies for send below.
-                        // A notable exception is ECANCELED caused by an expiration of the read
-                        // timeout.
-                        if (ec.value() == ECANCELED) {
-                            connection_->shutdown([this, self = this->shared_from_this()](
-                                                      std::error_code) { connection_->close(); });
-                        } else {
-                            connection_->close();
-                        }
+                        onRecvHeaderError(ec);
                         return;
                     }
 
                     if (readBytes == 0) {
+                        setIdle(false);
                         connection_->close();
                         return;
                     }
 
                     requestHeaderBuffer_.resize(requestHeaderBuffer_.size() - recvLen + readBytes);
-
-                    auto request = Request::parse(requestHeaderBuffer_);
-                    if (!request) {
-                        accessLog("INVALID REQUEST", StatusCode::BadRequest, 0);
-                        Metrics::get().reqErrors.labels("parse error").inc();
-                        respond("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n", false);
-                        return;
-                    }
-                    request_ = std::move(*request);
-
-                    const auto contentLength = request_.headers.get("Content-Length");
-                    if (contentLength) {
-                        const auto length = parseInt<uint64_t>(*contentLength);
-                        if (!length) {
-                            accessLog(
-                                "INVALID REQUEST (Content-Length)", StatusCode::BadRequest, 0);
-                            Metrics::get().reqErrors.labels("invalid length").inc();
-                            respond("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n", false);
-                            return;
-                        }
-
-                        if (*length > serverConfig_.maxRequestBodySize) {
-                            accessLog("INVALID REQUEST (body size)", StatusCode::BadRequest, 0);
-                            Metrics::get().reqErrors.labels("body too large").inc();
-                            respond("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n", false);
-                        } else if (request_.body.size() < *length) {
-                            requestBodyBuffer_.append(request_.body);
-                            request_.body = std::string_view();
-                            readRequestBody(*length);
-                        } else {
-                            request_.body = request_.body.substr(0, *length);
-                            processRequest(request_);
-                        }
-                    } else {
-                        processRequest(request_);
-                    }
+                    onRequestHeaderData(requestHeaderBuffer_);
                 });
         }
 
+        void onRecvHeaderError(std::error_code ec)
+        {
+            setIdle(false);
+            if (reaped_) {
+                // The recv was cancelled on purpose. Be nice and shut down. For TLS this sends a
+                // close_notify and waits for the one of the client, which might never come, so
+                // the connection is not held forever.
+                setDeadline(serverConfig_.sendTimeoutMs);
+                connection_->shutdown([this, self = this->shared_from_this()](
+                                          std::error_code) { connection_->close(); });
+                return;
+            }
+            Metrics::get().recvErrors.labels(ec.message()).inc();
+            slog::error("Error in recv (headers): ", ec.message());
+            // Error might be ECONNRESET, EPIPE (from send) or others, where we just
+            // want to close. There might be errors, where shutdown is better, but
+            // especially with SSL almost all errors here require us to NOT shutdown.
+            // Same applies for send below.
+            // A notable exception is ECANCELED caused by an expiration of the read
+            // timeout.
+            if (ec.value() == ECANCELED) {
+                connection_->shutdown([this, self = this->shared_from_this()](
+                                          std::error_code) { connection_->close(); });
+            } else {
+                connection_->close();
+            }
+        }
+
+        // `data` is everything of the request we have received so far. It's either the provided
+        // buffer of the first recv or requestHeaderBuffer_.
+        void onRequestHeaderData(std::string_view data)
+        {
+            const auto res = requestParser_.parse(data, request_);
+            if (res == RequestParser::Result::Incomplete) {
+                if (data.size() >= serverConfig_.maxRequestHeaderSize) {
+                    setIdle(false);
+                    clearDeadline();
+                    accessLog("INVALID REQUEST (header size)",
+                        StatusCode::RequestHeaderFieldsTooLarge, 0);
+                    Metrics::get().reqErrors.labels("header too large").inc();
+                    respond("HTTP/1.1 431 Request Header Fields Too Large\r\nConnection: "
+                            "close\r\n\r\n",
+                        false);
+                    return;
+                }
+                continueRequestHeader(data);
+                return;
+            }
+
+            setIdle(false);
+            clearDeadline();
+            if (res == RequestParser::Result::Error) {
+                accessLog("INVALID REQUEST", StatusCode::BadRequest, 0);
+                Metrics::get().reqErrors.labels("parse error").inc();
+                respond("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n", false);
+                return;
+            }
+            // `data` must stay alive until the request has been handled, because request_
+            // references it.
+            onRequestHeader();
+        }
+
+        // The request header arrived only partially. The parser remembers where it left off, so
+        // we just have to receive the rest after what we have.
+        void continueRequestHeader(std::string_view data)
+        {
+            if (data.data() != requestHeaderBuffer_.data()) {
+                // The next recv can't append to a provided buffer, so we move the data over.
+                // The parser only saved offsets, so it doesn't care.
+                requestHeaderBuffer_.assign(data);
+                providedBuffer_.reset();
+            }
+            if (idle_) {
+                // The request has started, so the connection is not idle anymore and the client
+                // has to send the rest within the header read timeout.
+                setIdle(false);
+                setDeadline(serverConfig_.headerReadTimeoutMs);
+            }
+            if (multishotRecv_ || !pendingBuffers_.empty()) {
+                // The rest arrives through the multishot recv (or arrived already)
+                readRequestMultishot();
+                return;
+            }
+            readRequestOwned();
+        }
+
+        void onRequestHeader()
+        {
+            requestHeaderSize_ = requestParser_.getHeaderSize();
+
+            const auto contentLength = request_.getHeader(KnownHeader::ContentLength);
+            if (contentLength) {
+                const auto length = parseInt<uint64_t>(*contentLength);
+                if (!length) {
+                    accessLog("INVALID REQUEST (Content-Length)", StatusCode::BadRequest, 0);
+                    Metrics::get().reqErrors.labels("invalid length").inc();
+                    respond("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n", false);
+                    return;
+                }
+
+                if (*length > serverConfig_.maxRequestBodySize) {
+                    accessLog("INVALID REQUEST (body size)", StatusCode::BadRequest, 0);
+                    Metrics::get().reqErrors.labels("body too large").inc();
+                    respond("HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n", false);
+                } else if (request_.body.size() < *length) {
+                    requestBodyBuffer_.append(request_.body);
+                    request_.body = std::string_view();
+                    setDeadline(serverConfig_.bodyReadTimeoutMs);
+                    readRequestBody(*length);
+                } else {
+                    request_.body = request_.body.substr(0, *length);
+                    processRequest(request_);
+                }
+            } else {
+                processRequest(request_);
+            }
+        }
+
         void readRequestBody(size_t contentLength)
         {
+            if (multishotRecv_ || !pendingBuffers_.empty()) {
+                // The rest of the body will arrive through the multishot recv (or arrived already)
+                readState_ = ReadState::Body;
+                contentLength_ = contentLength;
+                continueMultishot();
+                return;
+            }
+
             const auto sizeBeforeRead = requestBodyBuffer_.size();
             assert(sizeBeforeRead < contentLength);
             const auto recvLen = contentLength - sizeBeforeRead;
             requestBodyBuffer_.append(recvLen, '\0');
             auto buffer = requestBodyBuffer_.data() + sizeBeforeRead;
-            connection_->recv(buffer, recvLen, &recvTimeout_,
+            connection_->recv(buffer, recvLen,
                 [this, self = this->shared_from_this(), recvLen, contentLength](
                     std::error_code ec, int readBytes) {
+                    if (closeIfTimedOut()) {
+                        return;
+                    }
+
                     if (ec) {
                         Metrics::get().recvErrors.labels(ec.message()).inc();
                         slog::error("Error in recv (body): ", ec.message());
@@ -234,7 +693,7 @@ private:
 
         bool getKeepAlive(const Request& request) const
         {
-            const auto connectionHeader = request.headers.get("Connection");
+            const auto connectionHeader = request.getHeader(KnownHeader::Connection);
             if (connectionHeader) {
                 if (connectionHeader->find("close") != std::string_view::npos) {
                     return false;
@@ -251,90 +710,168 @@ private:
             return false;
         }
 
+        // Canned responses (e.g. for parse errors) are sent without processRequest, so this might
+        // be called for a request that was never completely parsed (empty path).
+        PathMetrics& getRequestMetrics()
+        {
+            if (!requestMetrics_) {
+                requestMetrics_ = &server_.getPathMetrics(request_.method, request_.url.path);
+            }
+            return *requestMetrics_;
+        }
+
         void processRequest(const Request& request)
         {
-            Metrics::get()
-                .reqHeaderSize.labels(toString(request.method), request.url.path)
-                .observe(requestHeaderBuffer_.size());
-            Metrics::get()
-                .reqBodySize.labels(toString(request.method), request.url.path)
-                .observe(requestBodyBuffer_.size());
-            handler_(request, std::make_shared<SessionResponder>(this->shared_from_this()));
+            auto& metrics = getRequestMetrics();
+            metrics.reqHeaderSize.observe(requestHeaderSize_);
+            metrics.reqBodySize.observe(requestBodyBuffer_.size());
+            handler_(request, std::shared_ptr<Responder>(this->shared_from_this(), &responder_));
         }
 
         void respond(Response&& response)
         {
             response_ = std::move(response);
-            const auto status = std::to_string(static_cast<int>(response_.status));
-            Metrics::get()
-                .reqsTotal.labels(toString(request_.method), request_.url.path, status)
-                .inc();
-            accessLog(request_.requestLine, response_.status, response_.body.size());
-            respond(response_.string(request_.version), getKeepAlive(request_));
+            getRequestMetrics().getStatusMetrics(response_.status).reqsTotal.inc();
+            accessLog(request_.requestLine, response_.status, response_.getBody().size());
+            // Only the status line and headers are serialized. The body is sent straight from
+            // response_ (see sendResponse), so it's never copied. If it is a sharedBody, response_
+            // keeps it alive until the next response, even if the owner replaced it already.
+            responseBuffer_.clear();
+            response_.serializeHeader(responseBuffer_, request_.version);
+            responseBody_ = response_.getBody();
+            zeroCopy_ = useZeroCopySend();
+            startResponse(getKeepAlive(request_));
         }
 
         void respond(std::string response, bool keepAlive)
         {
-            // We need to keep the memory that is referenced in the SQE around, because we don't
-            // know when the kernel will copy it, so we save it in this member variable, which
-            // definitely lives longer than this send takes to complete.
-            // I also prefer the member variable compared to moving it into the lambda, because
-            // it can be reused for another request in this session.
             responseBuffer_ = std::move(response);
+            responseBody_ = std::string_view();
+            zeroCopy_ = false;
+            startResponse(keepAlive);
+        }
+
+        bool useZeroCopySend() const
+        {
+            // Only a sharedBody can be kept alive until the kernel is done with it, which might be
+            // after this session is gone.
+            if constexpr (Connection::SupportsZeroCopySend) {
+                return serverConfig_.zeroCopySendThreshold > 0 && response_.sharedBody
+                    && responseBody_.size() >= serverConfig_.zeroCopySendThreshold
+                    && connection_->hasZeroCopySend();
+            }
+            return false;
+        }
+
+        void startResponse(bool keepAlive)
+        {
+            if (zeroCopy_) {
+                // The kernel might still reference the header after the last send completed and
+                // by then responseBuffer_ might contain the next response already, so it needs a
+                // buffer of its own, which lives as long as the kernel needs it.
+                zeroCopyHeader_ = std::make_shared<const std::string>(std::move(responseBuffer_));
+                responseBuffer_.clear();
+                responseHeader_ = *zeroCopyHeader_;
+            } else {
+                responseHeader_ = responseBuffer_;
+            }
             responseSendOffset_ = 0;
             keepAlive_ = keepAlive;
+            // This is a deadline for the whole response, not for every single send
+            setDeadline(serverConfig_.sendTimeoutMs);
             sendResponse();
         }
 
+        size_t getResponseSize() const
+        {
+            return responseHeader_.size() + responseBody_.size();
+        }
+
         void sendResponse()
         {
-            assert(responseSendOffset_ < responseBuffer_.size());
-            connection_->send(responseBuffer_.data() + responseSendOffset_,
-                responseBuffer_.size() - responseSendOffset_,
-                [this, self = this->shared_from_this()](std::error_code ec, int sentBytes) {
-                    if (ec) {
-                        // I think there are no errors, where we want to shutdown.
-                        // Note that ec could be an error that can not be returned by ::send,
-                        // because with SSL it might do ::recv as part of Connection::send.
-                        Metrics::get().sendErrors.labels(ec.message()).inc();
-                        slog::error("Error in send: ", ec.message());
-                        connection_->close();
-                        return;
-                    }
+            assert(responseSendOffset_ < getResponseSize());
+            // We need to keep the memory that is referenced in the SQE around, because we don't
+            // know when the kernel will copy it, so header and body are kept in member variables,
+            // which definitely live longer than this send takes to complete.
+            // Header and body are sent with a single sendmsg (see Connection::sendv), if there is
+            // a body left to send.
+            std::array<::iovec, 2> segments;
+            size_t numSegments = 0;
+            const auto headerSize = responseHeader_.size();
+            // The iovecs are not const, because they are also used for receiving
+            if (responseSendOffset_ < headerSize) {
+                segments[numSegments++]
+                    = ::iovec { const_cast<char*>(responseHeader_.data()) + responseSendOffset_,
+                          headerSize - responseSendOffset_ };
+            }
+            const auto bodyOffset
+                = responseSendOffset_ > headerSize ? responseSendOffset_ - headerSize : 0;
+            if (bodyOffset < responseBody_.size()) {
+                segments[numSegments++]
+                    = ::iovec { const_cast<char*>(responseBody_.data()) + bodyOffset,
+                          responseBody_.size() - bodyOffset };
+            }
+            auto handler = [this, self = this->shared_from_this()](
+                               std::error_code ec, int sentBytes) { onSent(ec, sentBytes); };
+            if constexpr (Connection::SupportsZeroCopySend) {
+                if (zeroCopy_) {
+                    // The release handler owns header and body, until the kernel is done with them
+                    connection_->sendvZeroCopy(segments.data(), numSegments, std::move(handler),
+                        [header = zeroCopyHeader_, body = response_.sharedBody](
+                            std::error_code /*ec*/) {});
+                    return;
+                }
+            }
+            connection_->sendv(segments.data(), numSegments, std::move(handler));
+        }
 
-                    if (sentBytes == 0) {
-                        // I don't know when this would happen for TCP.
-                        // For SSL this will happen, when the remote peer closed the
-                        // connection during a recv that's part of an SSL_write.
-                        // In that case we close (since we can't shutdown).
-                        connection_->close();
-                        return;
-                    }
+        void onSent(std::error_code ec, int sentBytes)
+        {
+            if (closeIfTimedOut()) {
+                return;
+            }
 
-                    assert(sentBytes > 0);
-                    if (responseSendOffset_ + sentBytes < responseBuffer_.size()) {
-                        responseSendOffset_ += sentBytes;
-                        sendResponse();
-                        return;
-                    }
+            if (ec) {
+                // I think there are no errors, where we want to shutdown.
+                // Note that ec could be an error that can not be returned by ::send,
+                // because with SSL it might do ::recv as part of Connection::send.
+                Metrics::get().sendErrors.labels(ec.message()).inc();
+                slog::error("Error in send: ", ec.message());
+                connection_->close();
+                return;
+            }
 
-                    // Only step these counters for successful sends
-                    const auto method = toString(request_.method);
-                    const auto status = std::to_string(static_cast<int>(response_.status));
-                    Metrics::get()
-                        .reqDuration.labels(method, request_.url.path)
-                        .observe(cpprom::now() - requestStart_);
-                    Metrics::get().respTotal.labels(method, request_.url.path, status).inc();
-                    Metrics::get()
-                        .respSize.labels(method, request_.url.path, status)
-                        .observe(responseBuffer_.size());
-
-                    if (keepAlive_) {
-                        start();
-                    } else {
-                        shutdown();
-                    }
-                });
+            if (sentBytes == 0) {
+                // I don't know when this would happen for TCP.
+                // For SSL this will happen, when the remote peer closed the
+                // connection during a recv that's part of an SSL_write.
+                // In that case we close (since we can't shutdown).
+                connection_->close();
+                return;
+            }
+
+            assert(sentBytes > 0);
+            if (responseSendOffset_ + sentBytes < getResponseSize()) {
+                responseSendOffset_ += sentBytes;
+                sendResponse();
+                return;
+            }
+            clearDeadline();
+
+            // Only step these counters for successful sends
+            auto& metrics = getRequestMetrics();
+            metrics.reqDuration.observe(cpprom::now() - requestStart_);
+            auto& statusMetrics = metrics.getStatusMetrics(response_.status);
+            statusMetrics.respTotal.inc();
+            statusMetrics.respSize.observe(getResponseSize());
+
+            if (keepAlive_) {
+                // Until the next request arrives, this connection may be reaped
+                setIdle(true);
+                start();
+            } else {
+                shutdown();
+            }
         }
 
         // If this only supported TCP, then using close everywhere would be fine.
@@ -347,24 +884,156 @@ private:
             });
         }
 
+        void setIdle(bool idle)
+        {
+            if (idle == idle_ || reaped_) {
+                return;
+            }
+            if (idle) {
+                server_.addIdle(this);
+            } else {
+                server_.removeIdle(this);
+            }
+        }
+
+        enum class ReadState {
+            None, // Not waiting for data (e.g. processing or sending a response)
+            Header,
+            Body,
+        };
+
+        // A request header always fits into one provided buffer, so this is plenty for a client
+        // that sends the next request early.
+        static constexpr size_t MaxPendingBuffers = 4;
+
+        Server& server_;
+        IoQueue& io_;
         std::unique_ptr<Connection> connection_;
         RequestHandler& handler_;
+        SessionResponder responder_;
         std::string remoteAddr_;
+        // Filled by resolveRemoteAddr
+        ::sockaddr_in peerAddr_;
         // The Request object is the result of request header parsing and consists of many
         // string_views referencing the buffer that the request was parsed from. If that buffer
         // would have to be resized (because of a large body not yet fully received), these
         // references would be invalidated. Hence the body is saved in a separate buffer.
+        // Buffers are not reserved up front, so idle connections don't hold any memory for them.
+        // If provided buffers are available, requestHeaderBuffer_ is not used at all.
+        ProvidedBuffer providedBuffer_;
+        // Data that arrived through the multishot recv while we were not reading. At most
+        // MaxPendingBuffers, after which the recv is paused (see onMultishotRecv).
+        std::deque<ProvidedBuffer> pendingBuffers_;
         std::string requestHeaderBuffer_;
         std::string requestBodyBuffer_;
+        // Only the status line and headers of a Response (or a complete canned response)
         std::string responseBuffer_;
+        // References responseBuffer_ or zeroCopyHeader_
+        std::string_view responseHeader_;
+        // References response_.body or response_.sharedBody (or nothing)
+        std::string_view responseBody_;
+        // Owned by the release handlers of the zero-copy sends as well (see startResponse)
+        std::shared_ptr<const std::string> zeroCopyHeader_;
+        // request_ and response_ (if the handler used Request::getAllocator) are allocated from
+        // this. It starts small, because it's kept while the connection is idle.
+        Arena arena_ { 1024 };
+        RequestParser requestParser_;
         Request request_;
         Response response_;
-        IoQueue::Timespec recvTimeout_;
-        cpprom::Gauge::TrackInProgressHandle trackInProgressHandle_;
+        // Belongs to request_ (see getRequestMetrics)
+        PathMetrics* requestMetrics_ = nullptr;
+        TimerWheel::Timer timer_;
         double requestStart_;
         const Config::Server& serverConfig_;
+        size_t requestHeaderSize_ = 0;
+        size_t contentLength_ = 0;
+        ReadState readState_ = ReadState::None;
+        bool multishotRecv_ = false;
+        // The multishot recv was cancelled, because pendingBuffers_ is full
+        bool recvPaused_ = false;
         size_t responseSendOffset_ = 0;
         bool keepAlive_;
+        bool zeroCopy_ = false;
+        // Intrusive list of idle sessions (see Server::addIdle)
+        Session* idlePrev_ = nullptr;
+        Session* idleNext_ = nullptr;
+        bool idle_ = false;
+        bool reaped_ = false;
+        bool timedOut_ = false;
+    };
+
+    PathMetrics& getPathMetrics(Method method, std::string_view path)
+    {
+        // std::less<> lets us find a string_view without creating a std::string
+        auto& paths = pathMetrics_[static_cast<size_t>(method)];
+        auto it = paths.find(path);
+        if (it == paths.end()) {
+            const auto m = toString(method);
+            const auto p = std::string(path);
+            it = paths
+                     .emplace(p,
+                         PathMetrics { m, p, Metrics::get().reqHeaderSize.labels(m, p),
+                             Metrics::get().reqBodySize.labels(m, p),
+                             Metrics::get().reqDuration.labels(m, p) })
+                     .first;
+        }
+        return it->second;
+    }
+
+    // Idle sessions (keep-alive connections waiting for the next request) are kept in a list, least
+    // recently active first, so we can close the oldest ones first if there are too many
+    // connections. It's intrusive, so marking a session idle or busy does not allocate.
+    void addIdle(Session* session)
+    {
+        assert(!session->idle_);
+        session->idle_ = true;
+        session->idlePrev_ = idleTail_;
+        session->idleNext_ = nullptr;
+        if (idleTail_) {
+            idleTail_->idleNext_ = session;
+        } else {
+            idleHead_ = session;
+        }
+        idleTail_ = session;
+    }
+
+    void removeIdle(Session* session)
+    {
+        assert(session->idle_);
+        session->idle_ = false;
+        if (session->idlePrev_) {
+            session->idlePrev_->idleNext_ = session->idleNext_;
+        } else {
+            idleHead_ = session->idleNext_;
+        }
+        if (session->idleNext_) {
+            session->idleNext_->idlePrev_ = session->idlePrev_;
+        } else {
+            idleTail_ = session->idlePrev_;
+        }
+        session->idlePrev_ = nullptr;
+        session->idleNext_ = nullptr;
+    }
+
+    void reapIdleSessions()
+    {
+        if (config_.idleConnectionWatermark == 0) {
+            return;
+        }
+        // Reaped sessions take a moment to close, so they don't count anymore
+        while (numSessions_ - numReaped_ > config_.idleConnectionWatermark && idleHead_) {
+            auto session = idleHead_;
+            removeIdle(session);
+            session->reap();
+        }
+    }
+
+    // How we get the address of an accepted connection (for the access log)
+    enum class AcceptAddr {
+        Filled, // by accept in acceptAddr_
+        GetPeerName, // with getpeername (regular fd)
+        Resolve, // with IoQueue::getPeerName, asynchronously (direct descriptor)
+        None, // not needed
     };
 
     void accept()
@@ -372,48 +1041,159 @@ private:
         // In the past there was a bug, where too many concurrent requests would fill up the SQR
         // with reads and writes so that it would run full and you could not add an accept SQE.
         // Essentially too high concurrency would push out the accept task and the server would stop
-        // accepting connections.
-        // For some reason I cannot reproduce it anymore. Maybe *something* has changed with a newer
-        // kernel, but I can't imagine what that would be.
-        // I will fix it anyway, because it should be dead code, if everything goes right anyways.
-        // So essentially we *force* an accept SQE into the SQR by retrying again and again.
-        // This is a busy loop, because we *really* want to get that accept into the SQR and we
-        // don't have to worry about priority inversion (I think) because it's the kernel that's
-        // consuming the currently present items.
-        bool added = false;
-        acceptAddrLen_ = sizeof(acceptAddr_);
-        while (!added) {
-            added = io_.accept(listenSocket_, &acceptAddr_, &acceptAddrLen_,
-                [this](std::error_code ec, int fd) { handleAccept(ec, fd); });
+        // accepting connections. We used to force the accept into the SQR with a busy loop, but
+        // now the IoQueue defers operations that don't fit and submits them later instead.
+        // If multishot accept is supported, this only happens again once the kernel terminates
+        // the multishot accept, which should be rare.
+
+        // Sockets accepted directly into the fixed file table (direct descriptors) save the kernel
+        // a file table lookup for every operation on them. If the table is full, we fall back to
+        // regular fds one connection at a time, until slots are free again.
+        const auto direct = io_.hasFixedFiles() && io_.getNumFreeFixedFiles() > 0;
+        // Multishot accept can't give us the address and direct descriptors are not real fds, so
+        // getpeername doesn't work on them. If the access log needs the address, we ask for it
+        // asynchronously (together with the first recv). Only on old kernels that can't do that,
+        // we need an accept SQE per connection.
+        const auto directAddr = !config_.accesLog ? AcceptAddr::None
+            : io_.hasGetPeerName()                ? AcceptAddr::Resolve
+                                                  : AcceptAddr::Filled;
+        if (direct && directAddr != AcceptAddr::Filled) {
+            multishotDirectAccept_ = io_.acceptMultishotDirect(
+                listenSocket_, [this, directAddr](std::error_code ec, int fd, bool more) {
+                    if (!more) {
+                        multishotDirectAccept_ = IoQueue::RequestHandle();
+                    }
+                    handleAccept(ec, IoQueue::Descriptor(fd, true), more, directAddr);
+                });
+        } else if (direct) {
+            acceptAddrLen_ = sizeof(acceptAddr_);
+            io_.acceptDirect(
+                listenSocket_, &acceptAddr_, &acceptAddrLen_, [this](std::error_code ec, int fd) {
+                    handleAccept(ec, IoQueue::Descriptor(fd, true), false, AcceptAddr::Filled);
+                });
+        } else if (io_.hasMultishotAccept() && !io_.hasFixedFiles()) {
+            io_.acceptMultishot(listenSocket_, [this](std::error_code ec, int fd, bool more) {
+                handleAccept(ec, fd, more, AcceptAddr::GetPeerName);
+            });
+        } else {
+            acceptRegular();
         }
     }
 
-    void handleAccept(std::error_code ec, int fd)
+    void acceptRegular()
+    {
+        acceptAddrLen_ = sizeof(acceptAddr_);
+        io_.accept(listenSocket_, &acceptAddr_, &acceptAddrLen_,
+            [this](std::error_code ec, int fd) {
+                handleAccept(ec, fd, false, AcceptAddr::Filled);
+            });
+    }
+
+    void handleAccept(std::error_code ec, IoQueue::Descriptor fd, bool more, AcceptAddr addrSource)
     {
-        if (ec) {
+        if (fd.fixed && ec.value() == ENFILE) {
+            // A multishot accept got more connections in one batch than there were free slots
+            // (see below). The kernel has dropped that connection already, but the next ones get a
+            // regular fd.
+            slog::info("Fixed file table is full. Accepting regular file descriptors.");
+            Metrics::get().acceptErrors.labels(ec.message()).inc();
+            if (!more) {
+                acceptRegular();
+            }
+            return;
+        }
+
+        if (ec && !(fd.fixed && ec.value() == ECANCELED)) {
             slog::error("Error in accept: ", ec.message());
             Metrics::get().acceptErrors.labels(ec.message()).inc();
-        } else {
+        } else if (!ec) {
             static auto& connAccepted = Metrics::get().connAccepted.labels();
             connAccepted.inc();
+            if (addrSource == AcceptAddr::GetPeerName) {
+                acceptAddrLen_ = sizeof(acceptAddr_);
+                if (::getpeername(
+                        fd.fd, reinterpret_cast<::sockaddr*>(&acceptAddr_), &acceptAddrLen_)
+                    == -1) {
+                    slog::debug("Could not get peer address: ", errnoToString(errno));
+                    acceptAddr_.sin_addr.s_addr = INADDR_ANY;
+                }
+            } else if (addrSource != AcceptAddr::Filled) {
+                // Resolved later or not needed at all
+                acceptAddr_.sin_addr.s_addr = INADDR_ANY;
+            }
             const auto addr = ::inet_ntoa(acceptAddr_.sin_addr);
             auto conn = connectionFactory_.create(io_, fd);
             if (conn) {
-                std::make_shared<Session>(std::move(conn), handler_, addr, config_)->start();
+                auto session = createSession(std::move(conn), addr);
+                if (addrSource == AcceptAddr::Resolve) {
+                    session->resolveRemoteAddr(fd);
+                }
+                session->start();
+                reapIdleSessions();
             } else {
                 slog::info("Could not create connection object (connection factory not ready)");
                 io_.close(fd, [](std::error_code) {});
             }
+
+            if (fd.fixed && more && io_.getNumFreeFixedFiles() == 0) {
+                // The multishot accept would fail with ENFILE for the next connection, which
+                // the kernel drops then. With a regular accept we can still take it. It's armed
+                // again, when the cancelled multishot accept terminates (with ECANCELED).
+                io_.cancel(multishotDirectAccept_, [](std::error_code) {});
+            }
         }
 
-        accept();
+        if (!more) {
+            accept();
+        }
+    }
+
+    // Sessions of closed connections are kept and reused, so that accepting a connection
+    // does not have to allocate the session and the buffers have their capacity already.
+    std::shared_ptr<Session> createSession(std::unique_ptr<Connection> conn, std::string_view addr)
+    {
+        std::unique_ptr<Session> session;
+        if (!freeSessions_.empty()) {
+            session = std::move(freeSessions_.back());
+            freeSessions_.pop_back();
+        } else {
+            session = std::make_unique<Session>(*this, io_, handler_, config_);
+        }
+        session->open(std::move(conn), addr);
+        // The control block is allocated with a FreeListAllocator, so it is recycled too
+        return std::shared_ptr<Session>(
+            session.release(), SessionRecycler { this }, FreeListAllocator<Session>());
     }
 
+    struct SessionRecycler {
+        Server* server;
+
+        void operator()(Session* session) const
+        {
+            session->close();
+            if (server->freeSessions_.size() < server->config_.maxFreeSessions) {
+                server->freeSessions_.emplace_back(session);
+            } else {
+                delete session;
+            }
+        }
+    };
+
     IoQueue& io_;
     Fd listenSocket_;
     RequestHandler handler_;
     ::sockaddr_in acceptAddr_;
     ::socklen_t acceptAddrLen_;
+    IoQueue::RequestHandle multishotDirectAccept_;
     ConnectionFactory connectionFactory_;
     Config::Server config_;
+    Session* idleHead_ = nullptr;
+    Session* idleTail_ = nullptr;
+    size_t numSessions_ = 0;
+    size_t numReaped_ = 0;
+    std::vector<std::unique_ptr<Session>> freeSessions_;
+    // Indexed by Method
+    std::array<std::map<std::string, PathMetrics, std::less<>>,
+        static_cast<size_t>(Method::Patch) + 1>
+        pathMetrics_;
 };
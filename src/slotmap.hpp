@@ -1,6 +1,7 @@
 #pragma once
 
-#include <queue>
+#include <algorithm>
+#include <vector>
 
 #include "vectormap.hpp"
 
@@ -59,7 +60,7 @@ public:
     {
         assert(data_.contains(index));
         data_.remove(index);
-        freeList_.push(index);
+        pushFreeIndex(index);
     }
 
     T& operator[](size_t index)
@@ -77,15 +78,34 @@ public:
 private:
     size_t getNewIndex()
     {
-        if (!freeList_.empty()) {
-            const auto idx = freeList_.front();
-            freeList_.pop();
+        if (numFree_ > 0) {
+            const auto idx = freeList_[freeHead_];
+            freeHead_ = (freeHead_ + 1) % freeList_.size();
+            numFree_--;
             return idx;
         }
         return nextIndex_++;
     }
 
+    // Indices are reused in the order they were freed, so an index that was just freed is not
+    // handed out again right away. A std::queue would do that, but its std::deque allocates and
+    // frees a block every few dozen pushes, even if its size never changes. This ring buffer only
+    // allocates if more indices are free than ever before.
+    void pushFreeIndex(size_t index)
+    {
+        if (numFree_ == freeList_.size()) {
+            // Make the ring start at 0 again, so we can simply append
+            std::rotate(freeList_.begin(), freeList_.begin() + freeHead_, freeList_.end());
+            freeHead_ = 0;
+            freeList_.resize(std::max<size_t>(freeList_.size() * 2, 16));
+        }
+        freeList_[(freeHead_ + numFree_) % freeList_.size()] = index;
+        numFree_++;
+    }
+
     VectorMap<T> data_;
     size_t nextIndex_ = 0;
-    std::queue<size_t> freeList_;
+    std::vector<size_t> freeList_;
+    size_t freeHead_ = 0;
+    size_t numFree_ = 0;
 };
@@ -1,12 +1,163 @@
 #include "ssl.hpp"
 
+#include <algorithm>
 #include <cassert>
+#include <vector>
 
 #include <openssl/bio.h>
 #include <openssl/err.h>
 
 #include "log.hpp"
 
+namespace {
+// The staging buffers and BIO pairs (which contain two 17 KiB buffers themselves) are only needed
+// while a connection is actually sending or receiving. Connections that are waiting for the
+// peer or not doing anything at all give them back to these per-thread free lists.
+// SSL objects of server connections are reused as well (after SSL_clear), because SSL_new and
+// SSL_free are expensive, if there are lots of short connections. They are kept per SslContext and
+// once the context is gone (e.g. because the certificates were reloaded and all connections that
+// use the old context are closed), its objects are freed.
+// All of them are bounded, so the memory of a burst of connections is freed again afterwards.
+class SslResources {
+public:
+    static constexpr size_t MaxFree = 64;
+
+    struct BioPair {
+        BIO* internal = nullptr;
+        BIO* external = nullptr;
+    };
+
+    static SslResources& get()
+    {
+        thread_local SslResources resources;
+        return resources;
+    }
+
+    ~SslResources()
+    {
+        for (const auto& pair : bioPairs_) {
+            BIO_free(pair.internal);
+            BIO_free(pair.external);
+        }
+        for (const auto& pool : sslPools_) {
+            for (auto ssl : pool.free) {
+                SSL_free(ssl);
+            }
+        }
+    }
+
+    // Returns nullptr if no SSL object could be created
+    SSL* acquireSsl(const std::shared_ptr<SslContext>& context)
+    {
+        auto pool = findSslPool(context);
+        if (pool && !pool->free.empty()) {
+            auto ssl = pool->free.back();
+            pool->free.pop_back();
+            return ssl;
+        }
+        return SSL_new(*context);
+    }
+
+    // The SSL object must not have a BIO
+    void releaseSsl(const std::shared_ptr<SslContext>& context, SSL* ssl)
+    {
+        // Client connections have per-connection settings (hostname validation), which SSL_clear
+        // does not reset
+        if (!SSL_is_server(ssl) || SSL_clear(ssl) != 1) {
+            SSL_free(ssl);
+            return;
+        }
+        auto pool = findSslPool(context);
+        if (!pool) {
+            pool = &sslPools_.emplace_back(SslPool { context, {} });
+        }
+        if (pool->free.size() < MaxFree) {
+            pool->free.push_back(ssl);
+        } else {
+            SSL_free(ssl);
+        }
+    }
+
+    std::unique_ptr<char[]> acquireBuffer()
+    {
+        if (buffers_.empty()) {
+            return std::unique_ptr<char[]>(new char[SslConnection::IoBufferSize]);
+        }
+        auto buffer = std::move(buffers_.back());
+        buffers_.pop_back();
+        return buffer;
+    }
+
+    void releaseBuffer(std::unique_ptr<char[]> buffer)
+    {
+        if (buffers_.size() < MaxFree) {
+            buffers_.push_back(std::move(buffer));
+        }
+    }
+
+    // Returns an empty pair if it could not be created
+    BioPair acquireBioPair()
+    {
+        if (bioPairs_.empty()) {
+            BioPair pair;
+            // The same size as the IO buffers, so a full recv always fits (see onRecv)
+            const auto size = SslConnection::IoBufferSize;
+            if (!BIO_new_bio_pair(&pair.internal, size, &pair.external, size)) {
+                return BioPair {};
+            }
+            return pair;
+        }
+        const auto pair = bioPairs_.back();
+        bioPairs_.pop_back();
+        return pair;
+    }
+
+    // The pair must be empty
+    void releaseBioPair(BioPair pair)
+    {
+        assert(BIO_ctrl_pending(pair.internal) == 0 && BIO_ctrl_pending(pair.external) == 0);
+        if (bioPairs_.size() < MaxFree) {
+            bioPairs_.push_back(pair);
+        } else {
+            BIO_free(pair.internal);
+            BIO_free(pair.external);
+        }
+    }
+
+private:
+    struct SslPool {
+        std::weak_ptr<SslContext> context;
+        std::vector<SSL*> free;
+    };
+
+    // Also frees the pools of contexts that are gone. There are only a handful of contexts.
+    SslPool* findSslPool(const std::shared_ptr<SslContext>& context)
+    {
+        for (auto it = sslPools_.begin(); it != sslPools_.end();) {
+            if (it->context.expired()) {
+                for (auto ssl : it->free) {
+                    SSL_free(ssl);
+                }
+                it = sslPools_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        for (auto& pool : sslPools_) {
+            // Compares the control blocks, which is cheaper than lock()
+            if (!pool.context.owner_before(context) && !context.owner_before(pool.context)) {
+                return &pool;
+            }
+        }
+        return nullptr;
+    }
+
+    std::vector<std::unique_ptr<char[]>> buffers_;
+    std::vector<BioPair> bioPairs_;
+    std::vector<SslPool> sslPools_;
+};
+}
+
 std::string getSslErrorString()
 {
     auto err = ERR_get_error();
@@ -182,15 +333,15 @@ void SslServerContextManager::fileWatcherCallback(std::error_code ec)
             if (ec) {
                 slog::error("Error during certificate reload: ", ec.message());
             } else if (context) {
-                currentContext_ = std::move(context);
+                currentContext_.set(std::move(context));
             }
             // If context is empty, we already logged a message
         });
 }
 
-std::shared_ptr<SslContext> SslServerContextManager::getCurrentContext() const
+std::shared_ptr<SslContext> SslServerContextManager::getCurrentContext(IoQueue& io)
 {
-    return currentContext_;
+    return currentContext_.get(io);
 }
 
 void SslServerContextManager::updateContext()
@@ -199,7 +350,7 @@ void SslServerContextManager::updateContext()
     if (!context) {
         return;
     }
-    currentContext_ = std::move(context);
+    currentContext_.set(std::move(context));
 }
 
 SslClientContextManager::SslClientContextManager()
@@ -207,7 +358,7 @@ SslClientContextManager::SslClientContextManager()
 {
 }
 
-std::shared_ptr<SslContext> SslClientContextManager::getCurrentContext() const
+std::shared_ptr<SslContext> SslClientContextManager::getCurrentContext(IoQueue&) const
 {
     return currentContext_;
 }
@@ -249,9 +400,11 @@ std::string toString(SslOperation op)
     }
 }
 
-SslConnection::SslConnection(IoQueue& io, int fd, std::shared_ptr<SslContext> context)
+SslConnection::SslConnection(
+    IoQueue& io, IoQueue::Descriptor fd, std::shared_ptr<SslContext> context)
     : TcpConnection(io, fd)
-    , ssl_(SSL_new(*context))
+    , context_(std::move(context))
+    , ssl_(SslResources::get().acquireSsl(context_))
 {
     if (!ssl_) {
         slog::error("Could not create SSL object: ", getSslErrorString());
@@ -261,13 +414,7 @@ SslConnection::SslConnection(IoQueue& io, int fd, std::shared_ptr<SslContext> co
     // I think there is no reason not to have this? It should save memory.
     SSL_set_mode(ssl_, SSL_MODE_RELEASE_BUFFERS);
 
-    BIO* internalBio = nullptr;
-    BIO_new_bio_pair(&internalBio, 0, &externalBio_, 0);
-    if (!internalBio || !externalBio_) {
-        assert(!internalBio && !externalBio_);
-        return;
-    }
-    SSL_set_bio(ssl_, internalBio, internalBio);
+    // The BIO pair is only attached while an operation is running (see attachBioPair)
 
     // https://www.openssl.org/docs/man1.1.1/man3/SSL_set_connect_state.html
     // Even though it may be clear from the method chosen, whether client or server mode was
@@ -283,12 +430,6 @@ SslConnection::SslConnection(IoQueue& io, int fd, std::shared_ptr<SslContext> co
         SSL_set_connect_state(ssl_);
     }
 
-    // https://www.openssl.org/docs/man1.1.1/man3/SSL_read.html
-    // 16K is maximum TLS record size
-    // but 17*1024 is default BIO size.
-    recvBuffer_.resize(17 * 1024, 0);
-    sendBuffer_.resize(17 * 1024, 0);
-
     /*
      * We don't have to do the handshake here manually:
      * https://www.openssl.org/docs/man1.1.1/man3/SSL_read.html
@@ -300,8 +441,17 @@ SslConnection::SslConnection(IoQueue& io, int fd, std::shared_ptr<SslContext> co
 
 SslConnection::~SslConnection()
 {
-    SSL_free(ssl_);
-    BIO_free(externalBio_);
+    releaseIoBuffer();
+    if (!ssl_) {
+        return;
+    }
+    if (externalBio_) {
+        // The BIO pair is not empty or the connection is in a weird state, so it's not reused.
+        // This frees the internal BIO.
+        SSL_set_bio(ssl_, nullptr, nullptr);
+        BIO_free(externalBio_);
+    }
+    SslResources::get().releaseSsl(context_, ssl_);
 }
 
 bool SslConnection::setHostname(const std::string& hostname)
@@ -346,8 +496,29 @@ void SslConnection::send(
         SslOperation::Write, const_cast<void*>(buffer), len, timeout, std::move(handler));
 }
 
+void SslConnection::sendv(const ::iovec* iov, size_t iovCount, IoQueue::HandlerEcRes handler)
+{
+    // SSL_write with a length of 0 is not allowed
+    while (iovCount > 0 && iov->iov_len == 0) {
+        iov++;
+        iovCount--;
+    }
+    assert(iovCount > 0);
+    assert(iovCount <= sendIov_.size());
+    // The iovecs are referenced until the operation completes, so copy them like TcpConnection
+    std::copy(iov, iov + iovCount, sendIov_.begin());
+    state_ = SslOperationState { std::move(handler), SslOperation::Write, sendIov_[0].iov_base,
+        static_cast<int>(sendIov_[0].iov_len), nullptr };
+    state_.nextSegments = sendIov_.data() + 1;
+    state_.numNextSegments = iovCount - 1;
+    startSslOperation();
+}
+
 void SslConnection::shutdown(IoQueue::HandlerEc handler)
 {
+    // Otherwise we would never send a close_notify after a cancel
+    assert(state_.currentOp == SslOperation::Invalid);
+    cancelled_ = false;
     startSslOperation(SslOperation::Shutdown, nullptr, 0, nullptr,
         [handler = std::move(handler)](std::error_code ec, int) { handler(ec); });
 }
@@ -388,16 +559,59 @@ SslConnection::SslOperationResult SslConnection::performSslOperation(
 
 void SslConnection::performSslOperation()
 {
-    const auto res = performSslOperation(state_.currentOp, ssl_, state_.buffer, state_.length);
+    if (!attachBioPair()) {
+        completeSslOperation(std::make_error_code(std::errc::not_enough_memory), -1);
+        return;
+    }
+    auto res = performSslOperation(state_.currentOp, ssl_, state_.buffer, state_.length);
+    // For sendv we continue with the next buffer right away (and only send what ended up in the
+    // BIO when it's full or after the last buffer), so the result is the sum of all of them.
+    while (res.error == SSL_ERROR_NONE && state_.currentOp == SslOperation::Write
+        && (state_.numNextSegments > 0 || state_.writtenSegmentBytes > 0)) {
+        state_.writtenSegmentBytes += res.result;
+        while (state_.numNextSegments > 0 && state_.nextSegments->iov_len == 0) {
+            state_.nextSegments++;
+            state_.numNextSegments--;
+        }
+        if (state_.numNextSegments == 0) {
+            res.result = state_.writtenSegmentBytes;
+            break;
+        }
+        const auto& segment = *state_.nextSegments;
+        state_.nextSegments++;
+        state_.numNextSegments--;
+        state_.buffer = segment.iov_base;
+        state_.length = static_cast<int>(segment.iov_len);
+        res = performSslOperation(state_.currentOp, ssl_, state_.buffer, state_.length);
+    }
     state_.lastResult = res.result;
     state_.lastError = res.error;
     processSslOperationResult(res);
 }
 
+void SslConnection::cancel()
+{
+    // An SSL operation consists of many recvs and sends. If the one that is in flight completed
+    // already (e.g. its CQE is in the same batch as an expired deadline), cancelling it does
+    // nothing and the SSL operation would just continue with the next one. So we remember it and
+    // fail the SSL operation, as soon as its recv or send completes.
+    cancelled_ = true;
+    TcpConnection::cancel();
+}
+
 void SslConnection::startSslOperation(SslOperation op, void* buffer, int length,
     IoQueue::Timespec* timeout, IoQueue::HandlerEcRes handler)
 {
     state_ = SslOperationState { std::move(handler), op, buffer, length, timeout };
+    startSslOperation();
+}
+
+void SslConnection::startSslOperation()
+{
+    if (cancelled_) {
+        completeSslOperation(std::make_error_code(std::errc::operation_canceled), -1);
+        return;
+    }
     performSslOperation();
 }
 
@@ -414,6 +628,7 @@ void SslConnection::updateSslOperation()
 
 void SslConnection::completeSslOperation(std::error_code ec, int result)
 {
+    detachBioPair();
     auto handler = std::move(state_.handler);
     // Handler needs to be released, so the Session can die, but we have to do it before we call the
     // handler, because it might start another SSL operation and we don't want to discard it
@@ -422,29 +637,170 @@ void SslConnection::completeSslOperation(std::error_code ec, int result)
     handler(ec, result);
 }
 
+bool SslConnection::attachBioPair()
+{
+    if (externalBio_) {
+        return true;
+    }
+    const auto pair = SslResources::get().acquireBioPair();
+    if (!pair.internal) {
+        slog::error("Could not create BIO pair: ", getSslErrorString());
+        return false;
+    }
+    // Takes a reference for reading and one for writing
+    SSL_set_bio(ssl_, pair.internal, pair.internal);
+    externalBio_ = pair.external;
+    return true;
+}
+
+void SslConnection::detachBioPair()
+{
+    // During the handshake a buffering BIO is pushed onto the write BIO, which we would throw
+    // away, so this only happens afterwards. Also it's only possible when nothing is buffered.
+    if (!externalBio_ || !SSL_is_init_finished(ssl_) || BIO_ctrl_pending(externalBio_) > 0) {
+        return;
+    }
+    auto internalBio = SSL_get_rbio(ssl_);
+    if (BIO_ctrl_pending(internalBio) > 0) {
+        return;
+    }
+    // SSL_set_bio drops both references, so we keep one of our own
+    BIO_up_ref(internalBio);
+    SSL_set_bio(ssl_, nullptr, nullptr);
+    SslResources::get().releaseBioPair({ internalBio, externalBio_ });
+    externalBio_ = nullptr;
+}
+
+char* SslConnection::acquireIoBuffer()
+{
+    assert(!ioBuffer_ && !fallbackBuffer_);
+    if (io_.getRegisteredBufferSize() >= IoBufferSize) {
+        ioBuffer_ = io_.acquireRegisteredBuffer();
+        if (ioBuffer_) {
+            return ioBuffer_.data();
+        }
+    }
+    fallbackBuffer_ = SslResources::get().acquireBuffer();
+    return fallbackBuffer_.get();
+}
+
+void SslConnection::releaseIoBuffer()
+{
+    ioBuffer_.reset();
+    if (fallbackBuffer_) {
+        SslResources::get().releaseBuffer(std::move(fallbackBuffer_));
+    }
+}
+
 void SslConnection::sendFromBuffer(size_t offset, size_t size)
 {
-    io_.send(fd_, sendBuffer_.data() + offset, size, state_.timeout, true,
-        [this, offset, size](std::error_code ec, int sentBytes) {
-            if (ec) {
-                slog::debug("Error in send (SSL): ", ec.message());
-                // Because a read error would result in a SSL_ERROR_SYSCALL if OpenSSL did
-                // the syscalls itself, we also should not call SSL_shutdown.
-                completeSslOperation(ec, -1);
-                return;
-            }
+    auto handler = [this, offset, size](std::error_code ec, int sentBytes) {
+        if (!ec && cancelled_) {
+            ec = std::make_error_code(std::errc::operation_canceled);
+        }
+        if (ec) {
+            slog::debug("Error in send (SSL): ", ec.message());
+            releaseIoBuffer();
+            // Because a read error would result in a SSL_ERROR_SYSCALL if OpenSSL did
+            // the syscalls itself, we also should not call SSL_shutdown.
+            completeSslOperation(ec, -1);
+            return;
+        }
 
-            if (sentBytes == 0) {
-                completeSslOperation(std::error_code {}, 0);
-                return;
-            }
+        if (sentBytes == 0) {
+            releaseIoBuffer();
+            completeSslOperation(std::error_code {}, 0);
+            return;
+        }
 
-            if (static_cast<size_t>(sentBytes) < size) {
-                sendFromBuffer(offset + sentBytes, size - sentBytes);
-            } else {
-                updateSslOperation();
-            }
-        });
+        if (static_cast<size_t>(sentBytes) < size) {
+            sendFromBuffer(offset + sentBytes, size - sentBytes);
+        } else {
+            releaseIoBuffer();
+            updateSslOperation();
+        }
+    };
+    if (ioBuffer_) {
+        sendHandle_ = io_.sendFixed(
+            fd_, ioBuffer_, offset, size, state_.timeout, true, std::move(handler));
+    } else {
+        sendHandle_ = io_.send(fd_, fallbackBuffer_.get() + offset, size, state_.timeout, true,
+            std::move(handler));
+    }
+}
+
+void SslConnection::recvIntoBuffer(bool allowProvidedBuffer)
+{
+    // If nothing is buffered, we are likely waiting for the next request of a keep-alive
+    // connection, which might take a long time. With provided buffers nothing has to be held
+    // until data arrives (not even the BIO pair), but they are small, so they are not used when
+    // the rest of a record is expected.
+    if (allowProvidedBuffer && io_.hasProvidedBuffers()
+        && BIO_ctrl_pending(SSL_get_rbio(ssl_)) == 0) {
+        detachBioPair();
+        // The BIO pair only holds IoBufferSize bytes and the provided buffers might be larger
+        const auto len = std::min(io_.getProvidedBufferSize(), IoBufferSize);
+        recvHandle_ = io_.recv(fd_, len, state_.timeout, true,
+            [this](std::error_code ec, ProvidedBuffer buffer) {
+                if (ec.value() == ENOBUFS && !cancelled_) {
+                    // All provided buffers are in use
+                    recvIntoBuffer(false);
+                    return;
+                }
+                const auto data = buffer ? buffer.view().data() : nullptr;
+                onRecv(ec, data, static_cast<int>(buffer.size()));
+            });
+        return;
+    }
+
+    auto buffer = acquireIoBuffer();
+    auto handler
+        = [this, buffer](std::error_code ec, int readBytes) { onRecv(ec, buffer, readBytes); };
+    if (ioBuffer_) {
+        recvHandle_ = io_.recvFixed(
+            fd_, ioBuffer_, 0, IoBufferSize, state_.timeout, true, std::move(handler));
+    } else {
+        recvHandle_
+            = io_.recv(fd_, buffer, IoBufferSize, state_.timeout, true, std::move(handler));
+    }
+}
+
+void SslConnection::onRecv(std::error_code ec, const char* data, int readBytes)
+{
+    if (!ec && cancelled_) {
+        ec = std::make_error_code(std::errc::operation_canceled);
+    }
+    if (ec) {
+        slog::debug("Error in recv (SSL): ", ec.message());
+        releaseIoBuffer();
+        // See sendFromBuffer
+        completeSslOperation(ec, -1);
+        return;
+    }
+
+    if (readBytes == 0) {
+        releaseIoBuffer();
+        completeSslOperation(std::error_code {}, 0);
+        return;
+    }
+
+    if (!attachBioPair()) {
+        releaseIoBuffer();
+        completeSslOperation(std::make_error_code(std::errc::not_enough_memory), -1);
+        return;
+    }
+    // We never receive more than IoBufferSize bytes (the size of the BIO) and we only receive
+    // when SSL wants to read, i.e. after it has read everything from the BIO, so this should
+    // always write everything. If it does not, the TLS stream would be corrupted.
+    const auto written = BIO_write(externalBio_, data, readBytes);
+    if (written != readBytes) {
+        slog::error("Could not write received data to BIO: ", written, "/", readBytes);
+        releaseIoBuffer();
+        completeSslOperation(std::make_error_code(std::errc::no_buffer_space), -1);
+        return;
+    }
+    releaseIoBuffer();
+    updateSslOperation();
 }
 
 void SslConnection::processSslOperationResult(const SslOperationResult& result)
@@ -467,7 +823,7 @@ void SslConnection::processSslOperationResult(const SslOperationResult& result)
         // If we can read or write (pending > 0 and SSL_ERROR_WANT_READ), we rather
         // write, because then we can proceed quicker (writing should mostly finish quicker than
         // reading).
-        const auto readFromBio = BIO_read(externalBio_, sendBuffer_.data(), sendBuffer_.size());
+        const auto readFromBio = BIO_read(externalBio_, acquireIoBuffer(), IoBufferSize);
         // Why would OpenSSL say WANT_WRITE if it has nothing to write?
         assert(readFromBio > 0);
         // This assert is preliminary
@@ -475,23 +831,7 @@ void SslConnection::processSslOperationResult(const SslOperationResult& result)
 
         sendFromBuffer(0, readFromBio);
     } else if (result.error == SSL_ERROR_WANT_READ) {
-        io_.recv(fd_, recvBuffer_.data(), recvBuffer_.size(), state_.timeout, true,
-            [this](std::error_code ec, int readBytes) {
-                if (ec) {
-                    slog::debug("Error in recv (SSL): ", ec.message());
-                    // See branch for SSL_ERROR_WANT_WRITE
-                    completeSslOperation(ec, -1);
-                    return;
-                }
-
-                if (readBytes == 0) {
-                    completeSslOperation(std::error_code {}, 0);
-                    return;
-                }
-
-                BIO_write(externalBio_, recvBuffer_.data(), readBytes);
-                updateSslOperation();
-            });
+        recvIntoBuffer(true);
     } else if (result.error == SSL_ERROR_NONE) {
         completeSslOperation(std::error_code {}, result.result);
     } else if (result.error == SSL_ERROR_ZERO_RETURN) {
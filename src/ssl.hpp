@@ -6,6 +6,7 @@
 #include <openssl/ssl.h>
 
 #include "filewatcher.hpp"
+#include "replicated.hpp"
 #include "tcp.hpp"
 
 // Must be at least 1.1.1
@@ -48,11 +49,13 @@ private:
     SSL_CTX* ctx_;
 };
 
+// The certificates are watched and reloaded on the thread of the IoQueue that is passed, but
+// getCurrentContext may be called from any IoQueue thread (with its own IoQueue).
 class SslServerContextManager {
 public:
     SslServerContextManager(IoQueue& io, std::string certChainPath, std::string keyPath);
 
-    std::shared_ptr<SslContext> getCurrentContext() const;
+    std::shared_ptr<SslContext> getCurrentContext(IoQueue& io);
 
 private:
     void updateContext();
@@ -61,7 +64,7 @@ private:
 
     std::string certChainPath_;
     std::string keyPath_;
-    std::shared_ptr<SslContext> currentContext_;
+    Replicated<std::shared_ptr<SslContext>> currentContext_;
     IoQueue& io_;
     FileWatcher fileWatcher_;
 };
@@ -70,7 +73,8 @@ class SslClientContextManager {
 public:
     SslClientContextManager();
 
-    std::shared_ptr<SslContext> getCurrentContext() const;
+    // The IoQueue is only there, so this can be used with SslConnectionFactory
+    std::shared_ptr<SslContext> getCurrentContext(IoQueue& io) const;
 
 private:
     std::shared_ptr<SslContext> currentContext_;
@@ -92,7 +96,15 @@ std::string toString(SslOperation op);
 // This whole thing is *heavily* inspired by what Boost ASIO is doing
 class SslConnection : public TcpConnection {
 public:
-    SslConnection(IoQueue& io, int fd, std::shared_ptr<SslContext> context);
+    // SSL_read needs to decrypt into a buffer of our own
+    static constexpr bool SupportsProvidedBuffers = false;
+    // The records are encrypted into a buffer of our own as well
+    static constexpr bool SupportsZeroCopySend = false;
+    // 16K is maximum TLS record size, but 17*1024 is the default BIO size.
+    // Registered buffers must have at least this size to be used (see IoQueue::registerBuffers).
+    static constexpr size_t IoBufferSize = 17 * 1024;
+
+    SslConnection(IoQueue& io, IoQueue::Descriptor fd, std::shared_ptr<SslContext> context);
     ~SslConnection();
 
     // Not movable or copyable, because pointers to it are captured in lambdas
@@ -111,7 +123,15 @@ public:
     void send(const void* buffer, size_t len, IoQueue::HandlerEcRes handler);
     void send(
         const void* buffer, size_t len, IoQueue::Timespec* timeout, IoQueue::HandlerEcRes handler);
+    // Every buffer is passed to SSL_write separately, but the records only go out once all of
+    // them are written (or the BIO is full), so e.g. header and body still share a send.
+    // Unlike send this only completes after everything is written.
+    void sendv(const ::iovec* iov, size_t iovCount, IoQueue::HandlerEcRes handler);
+    // This is how a cancelled connection is closed nicely (e.g. a reaped one), so it is not
+    // affected by cancel. It must only be called after the cancelled operation completed.
     void shutdown(IoQueue::HandlerEc handler);
+    // The current SSL operation (if any) and all later ones except shutdown fail with ECANCELED
+    void cancel();
 
 private:
     struct SslOperationResult {
@@ -128,42 +148,67 @@ private:
         IoQueue::Timespec* timeout = nullptr;
         int lastResult = 0;
         int lastError = 0;
+        // For sendv. The current buffer is in buffer and length.
+        const ::iovec* nextSegments = nullptr;
+        size_t numNextSegments = 0;
+        int writtenSegmentBytes = 0;
     };
 
     static SslOperationResult performSslOperation(
         SslOperation op, SSL* ssl, void* buffer, int length);
 
+    // Returns false if no BIO pair could be created
+    bool attachBioPair();
+    // Only if it's empty
+    void detachBioPair();
+    // Returns ioBuffer_ (if one is available) or fallbackBuffer_
+    char* acquireIoBuffer();
+    void releaseIoBuffer();
     void sendFromBuffer(size_t offset, size_t size);
+    void recvIntoBuffer(bool allowProvidedBuffer);
+    void onRecv(std::error_code ec, const char* data, int readBytes);
 
     void startSslOperation(SslOperation op, void* buffer, int length, IoQueue::Timespec* timeout,
         IoQueue::HandlerEcRes handler);
+    // Starts the operation in state_ or fails it right away, if the connection was cancelled
+    void startSslOperation();
     void performSslOperation();
     void processSslOperationResult(const SslOperationResult& result);
     void updateSslOperation();
     void completeSslOperation(std::error_code ec, int result);
 
+    // Keeps the pool of SSL objects for this context alive (see SslResources)
+    std::shared_ptr<SslContext> context_;
     SSL* ssl_;
+    // Only set while the BIO pair is attached
     BIO* externalBio_ = nullptr;
-    std::vector<char> recvBuffer_;
-    std::vector<char> sendBuffer_;
+    // The buffer for the recv or send that is in flight (there is only one SSL operation at a
+    // time and it only does one at a time). It's taken from the registered buffers and given back
+    // after every recv or send, so idle connections don't need one.
+    RegisteredBuffer ioBuffer_;
+    // Used instead, if there are no registered buffers (left). It's taken from a per-thread free
+    // list the same way.
+    std::unique_ptr<char[]> fallbackBuffer_;
     SslOperationState state_;
+    bool cancelled_ = false;
 };
 
 template <typename ContextManager>
 struct SslConnectionFactory {
     using Connection = SslConnection;
 
-    std::unique_ptr<ContextManager> contextManager;
+    // Shared, so every thread can have a copy of the factory (see Config::threads)
+    std::shared_ptr<ContextManager> contextManager;
 
     template <typename... Args>
     SslConnectionFactory(Args&&... args)
-        : contextManager(std::make_unique<ContextManager>(std::forward<Args>(args)...))
+        : contextManager(std::make_shared<ContextManager>(std::forward<Args>(args)...))
     {
     }
 
-    std::unique_ptr<Connection> create(IoQueue& io, int fd)
+    std::unique_ptr<Connection> create(IoQueue& io, IoQueue::Descriptor fd)
     {
-        auto context = contextManager->getCurrentContext();
+        auto context = contextManager->getCurrentContext(io);
         return context ? std::make_unique<Connection>(io, fd, std::move(context)) : nullptr;
     }
 };
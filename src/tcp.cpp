@@ -1,6 +1,9 @@
 #include "tcp.hpp"
 
-TcpConnection::TcpConnection(IoQueue& io, int fd)
+#include <algorithm>
+#include <cassert>
+
+TcpConnection::TcpConnection(IoQueue& io, IoQueue::Descriptor fd)
     : io_(io)
     , fd_(fd)
 {
@@ -8,24 +11,65 @@ TcpConnection::TcpConnection(IoQueue& io, int fd)
 
 void TcpConnection::recv(void* buffer, size_t len, IoQueue::HandlerEcRes handler)
 {
-    io_.recv(fd_, buffer, len, std::move(handler));
+    recvHandle_ = io_.recv(fd_, buffer, len, std::move(handler));
 }
 
 void TcpConnection::recv(
     void* buffer, size_t len, IoQueue::Timespec* timeout, IoQueue::HandlerEcRes handler)
 {
-    io_.recv(fd_, buffer, len, timeout, true, std::move(handler));
+    recvHandle_ = io_.recv(fd_, buffer, len, timeout, true, std::move(handler));
+}
+
+void TcpConnection::recv(size_t len, IoQueue::Timespec* timeout, IoQueue::HandlerEcBuffer handler)
+{
+    recvHandle_ = io_.recv(fd_, len, timeout, true, std::move(handler));
+}
+
+void TcpConnection::recvMultishot(IoQueue::HandlerEcBufferMore handler)
+{
+    multishotRecv_ = true;
+    recvHandle_ = io_.recvMultishot(fd_, std::move(handler));
 }
 
 void TcpConnection::send(const void* buffer, size_t len, IoQueue::HandlerEcRes handler)
 {
-    io_.send(fd_, buffer, len, std::move(handler));
+    sendHandle_ = io_.send(fd_, buffer, len, std::move(handler));
 }
 
 void TcpConnection::send(
     const void* buffer, size_t len, IoQueue::Timespec* timeout, IoQueue::HandlerEcRes handler)
 {
-    io_.send(fd_, buffer, len, timeout, true, std::move(handler));
+    sendHandle_ = io_.send(fd_, buffer, len, timeout, true, std::move(handler));
+}
+
+void TcpConnection::sendv(const ::iovec* iov, size_t iovCount, IoQueue::HandlerEcRes handler)
+{
+    assert(iovCount > 0 && iovCount <= sendIov_.size());
+    if (iovCount == 1) {
+        send(iov[0].iov_base, iov[0].iov_len, std::move(handler));
+        return;
+    }
+    std::copy(iov, iov + iovCount, sendIov_.begin());
+    sendMsg_ = ::msghdr {};
+    sendMsg_.msg_iov = sendIov_.data();
+    sendMsg_.msg_iovlen = iovCount;
+    sendHandle_ = io_.sendmsg(fd_, &sendMsg_, 0, std::move(handler));
+}
+
+void TcpConnection::sendvZeroCopy(const ::iovec* iov, size_t iovCount,
+    IoQueue::HandlerEcRes handler, IoQueue::HandlerEc released)
+{
+    assert(iovCount > 0 && iovCount <= sendIov_.size());
+    if (iovCount == 1) {
+        sendHandle_ = io_.sendZc(
+            fd_, iov[0].iov_base, iov[0].iov_len, std::move(handler), std::move(released));
+        return;
+    }
+    std::copy(iov, iov + iovCount, sendIov_.begin());
+    sendMsg_ = ::msghdr {};
+    sendMsg_.msg_iov = sendIov_.data();
+    sendMsg_.msg_iovlen = iovCount;
+    sendHandle_ = io_.sendmsgZc(fd_, &sendMsg_, 0, std::move(handler), std::move(released));
 }
 
 void TcpConnection::shutdown(IoQueue::HandlerEc handler)
@@ -35,5 +79,46 @@ void TcpConnection::shutdown(IoQueue::HandlerEc handler)
 
 void TcpConnection::close()
 {
+    if (multishotRecv_) {
+        // Closing the fd does not terminate a multishot recv that might still be pending (and
+        // its handler would never be released), but shutting the socket down does.
+        // The connection object might be gone, when the shutdown completes.
+        io_.shutdown(fd_, SHUT_RDWR, [&io = io_, fd = fd_](std::error_code /*ec*/) {
+            io.close(fd, [](std::error_code /*ec*/) {});
+        });
+        return;
+    }
     io_.close(fd_, [](std::error_code /*ec*/) {});
 }
+
+void TcpConnection::cancel()
+{
+    // If an operation already completed, cancelling it does nothing
+    io_.cancel(recvHandle_, [](std::error_code /*ec*/) {});
+    io_.cancel(sendHandle_, [](std::error_code /*ec*/) {});
+}
+
+void TcpConnection::cancelRecv()
+{
+    io_.cancel(recvHandle_, [](std::error_code /*ec*/) {});
+}
+
+bool TcpConnection::hasProvidedBuffers() const
+{
+    return io_.hasProvidedBuffers();
+}
+
+size_t TcpConnection::getProvidedBufferSize() const
+{
+    return io_.getProvidedBufferSize();
+}
+
+bool TcpConnection::hasMultishotRecv() const
+{
+    return io_.hasMultishotRecv();
+}
+
+bool TcpConnection::hasZeroCopySend() const
+{
+    return io_.hasZeroCopySend();
+}
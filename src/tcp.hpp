@@ -1,30 +1,66 @@
 #pragma once
 
+#include <array>
 #include <memory>
 
+#include <sys/uio.h>
+
 #include <ioqueue.hpp>
 
 class TcpConnection {
 public:
-    TcpConnection(IoQueue& io, int fd);
+    // Whether this connection type can receive into provided buffers at all (see
+    // IoQueue::registerProvidedBuffers). Whether it actually can depends on the IoQueue as well.
+    static constexpr bool SupportsProvidedBuffers = true;
+    // Same for zero-copy sends (see IoQueue::sendmsgZc)
+    static constexpr bool SupportsZeroCopySend = true;
+
+    TcpConnection(IoQueue& io, IoQueue::Descriptor fd);
 
     void recv(void* buffer, size_t len, IoQueue::HandlerEcRes handler);
     void recv(void* buffer, size_t len, IoQueue::Timespec* timeout, IoQueue::HandlerEcRes handler);
+    // Only call this if hasProvidedBuffers returns true
+    void recv(size_t len, IoQueue::Timespec* timeout, IoQueue::HandlerEcBuffer handler);
+    // Only call this if hasMultishotRecv returns true. See IoQueue::recvMultishot.
+    void recvMultishot(IoQueue::HandlerEcBufferMore handler);
     void send(const void* buffer, size_t len, IoQueue::HandlerEcRes handler);
     void send(
         const void* buffer, size_t len, IoQueue::Timespec* timeout, IoQueue::HandlerEcRes handler);
+    // Sends multiple buffers at once (IORING_OP_SENDMSG), without concatenating them first.
+    // Like send this may send only part of the data. The iovecs must stay valid until the handler
+    // is called, but the array itself is copied.
+    void sendv(const ::iovec* iov, size_t iovCount, IoQueue::HandlerEcRes handler);
+    // Only call this if hasZeroCopySend returns true. Like sendv, but the buffers must stay valid
+    // until `released` is called (see IoQueue::sendmsgZc).
+    void sendvZeroCopy(const ::iovec* iov, size_t iovCount, IoQueue::HandlerEcRes handler,
+        IoQueue::HandlerEc released);
     void shutdown(IoQueue::HandlerEc handler);
     void close();
+    // The pending recv and send (if any) will complete with ECANCELED
+    void cancel();
+    // Only the pending recv will complete with ECANCELED
+    void cancelRecv();
+
+    bool hasProvidedBuffers() const;
+    size_t getProvidedBufferSize() const;
+    bool hasMultishotRecv() const;
+    bool hasZeroCopySend() const;
 
 protected:
     IoQueue& io_;
-    int fd_;
+    IoQueue::Descriptor fd_;
+    IoQueue::RequestHandle recvHandle_;
+    IoQueue::RequestHandle sendHandle_;
+    // sendmsg needs these to stay alive until it completes
+    ::msghdr sendMsg_ {};
+    std::array<::iovec, 4> sendIov_ {};
+    bool multishotRecv_ = false;
 };
 
 struct TcpConnectionFactory {
     using Connection = TcpConnection;
 
-    std::unique_ptr<Connection> create(IoQueue& io, int fd)
+    std::unique_ptr<Connection> create(IoQueue& io, IoQueue::Descriptor fd)
     {
         return std::make_unique<Connection>(io, fd);
     }
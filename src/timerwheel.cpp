@@ -0,0 +1,227 @@
+#include "timerwheel.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include "ioqueue.hpp"
+
+TimerWheel::Timer::~Timer()
+{
+    if (wheel_) {
+        wheel_->cancel(*this);
+    }
+}
+
+bool TimerWheel::Timer::isScheduled() const
+{
+    return wheel_ != nullptr;
+}
+
+TimerWheel::TimerWheel(IoQueue& io, uint32_t tickMs)
+    : io_(io)
+    , tickMs_(tickMs)
+{
+    assert(tickMs_ > 0);
+}
+
+TimerWheel::~TimerWheel()
+{
+    // Timers might outlive the wheel
+    for (auto& level : slots_) {
+        for (auto& slot : level) {
+            while (slot) {
+                unlink(*slot);
+            }
+        }
+    }
+}
+
+void TimerWheel::schedule(Timer& timer, uint64_t timeoutMs, Function<void()> callback)
+{
+    if (timer.wheel_) {
+        unlink(timer);
+    }
+    if (numTimers_ == 0) {
+        // Nothing is scheduled, so we can skip all the ticks that passed in the meantime
+        currentTick_ = getNowTick();
+    }
+    // Round up, so timers never fire early
+    const auto expiryTick = (io_.getNow() + timeoutMs + tickMs_ - 1) / tickMs_;
+    // A timer that expires in the current tick would never fire, because that tick has already
+    // been processed. Also the distance to the current tick must not exceed MaxTicks, or
+    // cascading breaks.
+    timer.expiryTick_
+        = std::min(std::max(expiryTick, currentTick_ + 1), currentTick_ + MaxTicks);
+    timer.callback_ = std::move(callback);
+    insert(timer);
+    // advance arms the timeout itself, when it's done
+    if (!advancing_) {
+        arm();
+    }
+}
+
+void TimerWheel::cancel(Timer& timer)
+{
+    if (timer.wheel_) {
+        unlink(timer);
+        timer.callback_ = nullptr;
+    }
+}
+
+size_t TimerWheel::size() const
+{
+    return numTimers_;
+}
+
+void TimerWheel::insert(Timer& timer)
+{
+    // A timer that expires in the current tick is only inserted during a cascade, right before
+    // the current slot of level 0 expires.
+    assert(timer.expiryTick_ >= currentTick_);
+    const auto delta = timer.expiryTick_ - currentTick_;
+    // Find the lowest level, that can hold the timer. Level 0 has one slot per tick, level 1 one
+    // slot per NumSlots ticks, etc.
+    size_t level = 0;
+    while (level < NumLevels - 1 && delta >= (1ull << (SlotBits * (level + 1)))) {
+        level++;
+    }
+    const auto index = (timer.expiryTick_ >> (SlotBits * level)) & (NumSlots - 1);
+    auto& slot = slots_[level][index];
+
+    timer.wheel_ = this;
+    timer.slot_ = &slot;
+    timer.prev_ = nullptr;
+    timer.next_ = slot;
+    if (slot) {
+        slot->prev_ = &timer;
+    }
+    slot = &timer;
+    numTimers_++;
+}
+
+void TimerWheel::unlink(Timer& timer)
+{
+    assert(timer.wheel_ == this);
+    if (timer.prev_) {
+        timer.prev_->next_ = timer.next_;
+    } else {
+        *timer.slot_ = timer.next_;
+    }
+    if (timer.next_) {
+        timer.next_->prev_ = timer.prev_;
+    }
+    timer.wheel_ = nullptr;
+    timer.slot_ = nullptr;
+    timer.prev_ = nullptr;
+    timer.next_ = nullptr;
+    numTimers_--;
+}
+
+void TimerWheel::arm()
+{
+    if (numTimers_ == 0) {
+        return;
+    }
+    const auto tick = getNextTick();
+    if (armed_) {
+        if (tick >= armedTick_) {
+            return;
+        }
+        // A timer was scheduled before the timeout we are waiting for. Its handler will see that
+        // it is stale and do nothing.
+        io_.cancel(IoQueue::RequestHandle(armedTimeout_), [](std::error_code) {});
+    }
+    // getNow is the CLOCK_MONOTONIC time in milliseconds, which is also the clock of absolute
+    // io_uring timeouts.
+    const auto expiryMs = tick * tickMs_;
+    timeout_.tv_sec = expiryMs / 1000;
+    timeout_.tv_nsec = (expiryMs % 1000) * 1000 * 1000;
+    const auto generation = ++armGeneration_;
+    const auto handle = io_.timeout(&timeout_, true, [this, generation](std::error_code ec) {
+        if (generation != armGeneration_) {
+            return;
+        }
+        armed_ = false;
+        // ETIME is a regular expiration
+        if (ec && ec.value() != ETIME) {
+            slog::error("Error in timer wheel timeout: ", ec.message());
+        }
+        advance(getNowTick());
+        arm();
+    });
+    armed_ = static_cast<bool>(handle);
+    armedTick_ = tick;
+    armedTimeout_ = handle.getUserData();
+}
+
+void TimerWheel::advance(uint64_t nowTick)
+{
+    advancing_ = true;
+    while (currentTick_ < nowTick && numTimers_ > 0) {
+        // Nothing happens in the ticks in between, so we skip them
+        currentTick_ = std::min(getNextTick(), nowTick);
+        // If the index of a level wraps around, the next slot of the level above is due and its
+        // timers are distributed to the levels below.
+        for (size_t level = 1; level < NumLevels; ++level) {
+            if ((currentTick_ & ((1ull << (SlotBits * level)) - 1)) != 0) {
+                break;
+            }
+            cascade(level);
+        }
+        expire(&slots_[0][currentTick_ & (NumSlots - 1)]);
+    }
+    if (numTimers_ == 0) {
+        currentTick_ = nowTick;
+    }
+    advancing_ = false;
+}
+
+// Level 0 has a slot for every one of the next NumSlots ticks and is done at the first non-empty
+// one. The slots of the levels above are due, when they are cascaded. A level never holds timers
+// more than NumSlots of its slots ahead (see insert), so every slot is only due once in the range.
+uint64_t TimerWheel::getNextTick() const
+{
+    assert(numTimers_ > 0);
+    auto next = std::numeric_limits<uint64_t>::max();
+    for (size_t level = 0; level < NumLevels; ++level) {
+        const auto shift = SlotBits * level;
+        const auto current = currentTick_ >> shift;
+        for (uint64_t i = 1; i <= NumSlots; ++i) {
+            if (slots_[level][(current + i) & (NumSlots - 1)]) {
+                next = std::min(next, (current + i) << shift);
+                break;
+            }
+        }
+    }
+    assert(next > currentTick_);
+    return next;
+}
+
+void TimerWheel::cascade(size_t level)
+{
+    auto& slot = slots_[level][(currentTick_ >> (SlotBits * level)) & (NumSlots - 1)];
+    while (slot) {
+        auto& timer = *slot;
+        unlink(timer);
+        insert(timer);
+    }
+}
+
+void TimerWheel::expire(Timer** slot)
+{
+    // Callbacks may cancel or schedule other timers (or this one), so we always take the head
+    while (*slot) {
+        auto& timer = **slot;
+        assert(timer.expiryTick_ == currentTick_);
+        unlink(timer);
+        auto callback = std::move(timer.callback_);
+        timer.callback_ = nullptr;
+        callback();
+    }
+}
+
+uint64_t TimerWheel::getNowTick() const
+{
+    return io_.getNow() / tickMs_;
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+#include "function.hpp"
+#include "iouring.hpp"
+
+class IoQueue;
+
+// A hierarchical timer wheel (Varghese & Lauck), so that thousands of connection deadlines don't
+// need a kernel timer (and an SQE) each. All timers share a single io_uring timeout that expires
+// in the next tick in which a timer fires or a slot of a higher level is cascaded, so an idle
+// server with many keep-alive connections does not wake up every tick.
+// Deadlines are rounded up to the next tick and all timers that expire in the same tick fire
+// together, so the operations they cancel are submitted in a single batch.
+class TimerWheel {
+public:
+    // Timers are intrusive, so scheduling them does not allocate. A timer is cancelled when it is
+    // destroyed, so it's safe to capture the owner of a timer in its callback.
+    class Timer {
+    public:
+        Timer() = default;
+        ~Timer();
+
+        // Not movable or copyable, because the wheel has pointers to it
+        Timer(const Timer&) = delete;
+        Timer(Timer&&) = delete;
+        Timer& operator=(const Timer&) = delete;
+        Timer& operator=(Timer&&) = delete;
+
+        bool isScheduled() const;
+
+    private:
+        friend class TimerWheel;
+
+        TimerWheel* wheel_ = nullptr;
+        Timer** slot_ = nullptr;
+        Timer* prev_ = nullptr;
+        Timer* next_ = nullptr;
+        uint64_t expiryTick_ = 0;
+        Function<void()> callback_;
+    };
+
+    TimerWheel(IoQueue& io, uint32_t tickMs = 10);
+    ~TimerWheel();
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    // If the timer is already scheduled, it is rescheduled.
+    void schedule(Timer& timer, uint64_t timeoutMs, Function<void()> callback);
+    void cancel(Timer& timer);
+
+    size_t size() const;
+
+private:
+    static constexpr size_t SlotBits = 6;
+    static constexpr size_t NumSlots = 1 << SlotBits;
+    static constexpr size_t NumLevels = 4;
+    // With 10ms ticks this is about 46 hours. Later deadlines are clamped.
+    static constexpr uint64_t MaxTicks = (1ull << (SlotBits * NumLevels)) - 1;
+
+    void insert(Timer& timer);
+    void unlink(Timer& timer);
+    void arm();
+    void advance(uint64_t nowTick);
+    uint64_t getNextTick() const;
+    void cascade(size_t level);
+    void expire(Timer** slot);
+    uint64_t getNowTick() const;
+
+    IoQueue& io_;
+    uint32_t tickMs_;
+    uint64_t currentTick_ = 0;
+    std::array<std::array<Timer*, NumSlots>, NumLevels> slots_ {};
+    size_t numTimers_ = 0;
+    bool armed_ = false;
+    bool advancing_ = false;
+    uint64_t armedTick_ = 0;
+    // The user data of the armed timeout (see IoQueue::RequestHandle), so it can be cancelled
+    uint64_t armedTimeout_ = 0;
+    // Every timeout gets a new one, so the handler of a cancelled timeout can tell it's stale
+    uint64_t armGeneration_ = 0;
+    IoURing::Timespec timeout_;
+};
@@ -0,0 +1,116 @@
+#include "workerpool.hpp"
+
+#include <cassert>
+
+#include "log.hpp"
+#include "metrics.hpp"
+
+WorkerPool::WorkerPool(IoQueue& io, size_t numThreads)
+    : numThreads_(numThreads)
+    , eventFd_(io)
+{
+    assert(numThreads_ > 0);
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    jobAvailable_.notify_all();
+    // Jobs that are running right now are finished first
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+    // The nodes of the queue are not freed otherwise
+    while (completions_.consume()) { }
+}
+
+void WorkerPool::setNumThreads(size_t numThreads)
+{
+    assert(numThreads > 0);
+    numThreads_ = numThreads;
+}
+
+void WorkerPool::submit(std::unique_ptr<Job> job)
+{
+    if (threads_.empty()) {
+        start();
+    }
+    job->queued_ = cpprom::now();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(std::move(job));
+    }
+    Metrics::get().asyncQueueDepth.labels().inc();
+    jobAvailable_.notify_one();
+    numInFlight_++;
+    if (!reading_) {
+        readCompletions();
+    }
+}
+
+void WorkerPool::start()
+{
+    threads_.reserve(numThreads_);
+    for (size_t i = 0; i < numThreads_; ++i) {
+        threads_.emplace_back([this]() { work(); });
+    }
+    // There is a pool per IoQueue (i.e. per thread), so these gauges are the sum of all of them
+    Metrics::get().asyncThreads.labels().inc(numThreads_);
+}
+
+void WorkerPool::work()
+{
+    static auto& queueDepth = Metrics::get().asyncQueueDepth.labels();
+    static auto& threadsBusy = Metrics::get().asyncThreadsBusy.labels();
+    while (true) {
+        std::unique_ptr<Job> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            jobAvailable_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+            if (stop_) {
+                return;
+            }
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        queueDepth.dec();
+        threadsBusy.inc();
+        job->started_ = cpprom::now();
+        job->run();
+        job->finished_ = cpprom::now();
+        threadsBusy.dec();
+        completions_.produce(std::move(job));
+        eventFd_.write(1);
+    }
+}
+
+void WorkerPool::readCompletions()
+{
+    // The read is only queued while jobs are in flight, otherwise IoQueue::run would never return
+    reading_ = true;
+    eventFd_.read([this](std::error_code ec, uint64_t) {
+        reading_ = false;
+        if (ec) {
+            slog::error("Error reading eventfd: ", ec.message());
+        }
+        static auto& tasks = Metrics::get().asyncTasks.labels();
+        static auto& waitDuration = Metrics::get().asyncTaskWaitDuration.labels();
+        static auto& runDuration = Metrics::get().asyncTaskDuration.labels();
+        // consume might return nothing, even though a job is about to be produced, but then the
+        // eventfd will be written again afterwards.
+        while (auto job = completions_.consume()) {
+            assert(numInFlight_ > 0);
+            numInFlight_--;
+            tasks.inc();
+            waitDuration.observe((*job)->started_ - (*job)->queued_);
+            runDuration.observe((*job)->finished_ - (*job)->started_);
+            (*job)->complete();
+        }
+        if (numInFlight_ > 0 && !reading_) {
+            readCompletions();
+        }
+    });
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "events.hpp"
+#include "mpscqueue.hpp"
+
+class IoQueue;
+
+// A fixed number of threads that do blocking work (like getaddrinfo or loading certificates) for
+// the IoQueue thread. Finished jobs are handed back through a single eventfd, which is only read
+// while jobs are in flight and drained in batches, so many jobs finishing at the same time only
+// need a single completion.
+// Threads are started with the first job, so an IoQueue that never uses them has none.
+class WorkerPool {
+public:
+    class Job {
+    public:
+        virtual ~Job() = default;
+
+        // Called on a worker thread
+        virtual void run() = 0;
+
+        // Called on the IoQueue thread after run
+        virtual void complete() = 0;
+
+    private:
+        friend class WorkerPool;
+
+        // cpprom::now(), for the metrics
+        double queued_ = 0.0;
+        double started_ = 0.0;
+        double finished_ = 0.0;
+    };
+
+    WorkerPool(IoQueue& io, size_t numThreads = 4);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    // Has no effect after the first job was submitted
+    void setNumThreads(size_t numThreads);
+
+    // Must be called from the IoQueue thread
+    void submit(std::unique_ptr<Job> job);
+
+private:
+    void start();
+    void work();
+    void readCompletions();
+
+    size_t numThreads_;
+    std::vector<std::thread> threads_;
+
+    // Guards jobs_ and stop_
+    std::mutex mutex_;
+    std::condition_variable jobAvailable_;
+    std::deque<std::unique_ptr<Job>> jobs_;
+    bool stop_ = false;
+
+    MpscQueue<std::unique_ptr<Job>> completions_;
+    EventFd eventFd_;
+    // Submitted, but not completed on the IoQueue thread yet
+    size_t numInFlight_ = 0;
+    bool reading_ = false;
+};
@@ -0,0 +1,84 @@
+#include "test.hpp"
+
+#include <cstdint>
+#include <string>
+
+#include "arena.hpp"
+
+TEST_CASE("Arena::allocate")
+{
+    Arena arena(64);
+    const auto a = static_cast<char*>(arena.allocate(10, 1));
+    const auto b = static_cast<char*>(arena.allocate(10, 1));
+    TEST_CHECK(b == a + 10);
+    const auto c = arena.allocate(8, 8);
+    TEST_CHECK(reinterpret_cast<uintptr_t>(c) % 8 == 0);
+    TEST_CHECK(arena.getCapacity() == 64);
+
+    // Doesn't fit anymore, so a new chunk is added
+    const auto d = arena.allocate(60, 1);
+    TEST_CHECK(d != nullptr);
+    TEST_CHECK(arena.getCapacity() == 64 + 128);
+
+    // Larger alignment than the chunk has
+    const auto e = arena.allocate(1, 256);
+    TEST_CHECK(reinterpret_cast<uintptr_t>(e) % 256 == 0);
+
+    // Larger than any chunk so far
+    const auto f = static_cast<char*>(arena.allocate(10000, 1));
+    f[0] = 'a';
+    f[9999] = 'b';
+    TEST_CHECK(arena.getCapacity() >= 64 + 128 + 10000);
+}
+
+TEST_CASE("Arena::reset")
+{
+    Arena arena(64);
+    for (size_t i = 0; i < 100; ++i) {
+        arena.allocate(50, 1);
+    }
+    const auto capacity = arena.getCapacity();
+    TEST_CHECK(capacity >= 5000);
+
+    // Now everything fits into a single chunk
+    arena.reset();
+    TEST_CHECK(arena.getCapacity() >= capacity);
+    const auto resetCapacity = arena.getCapacity();
+    const auto first = static_cast<char*>(arena.allocate(50, 1));
+    for (size_t i = 1; i < 100; ++i) {
+        TEST_CHECK(static_cast<char*>(arena.allocate(50, 1)) == first + i * 50);
+    }
+    TEST_CHECK(arena.getCapacity() == resetCapacity);
+
+    // And it stays that way
+    arena.reset();
+    TEST_CHECK(arena.getCapacity() == resetCapacity);
+    TEST_CHECK(arena.allocate(50, 1) == first);
+}
+
+TEST_CASE("ArenaAllocator")
+{
+    Arena arena(4096);
+    using String = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+    String str { ArenaAllocator<char>(&arena) };
+    str.assign(100, 'x');
+    TEST_CHECK(str.get_allocator().getArena() == &arena);
+    const auto capacity = arena.getCapacity();
+    TEST_CHECK(arena.allocate(1, 1) > static_cast<void*>(str.data()));
+    TEST_CHECK(arena.getCapacity() == capacity);
+
+    // Copies don't use the arena, so they survive a reset
+    const String copy(str);
+    TEST_CHECK(copy.get_allocator().getArena() == nullptr);
+    TEST_CHECK(copy == str);
+
+    // Moves do
+    String moved(std::move(str));
+    TEST_CHECK(moved.get_allocator().getArena() == &arena);
+
+    // Without an arena it behaves like std::allocator
+    String plain;
+    plain.assign(1000, 'y');
+    TEST_CHECK(plain.get_allocator().getArena() == nullptr);
+    TEST_CHECK(plain.size() == 1000);
+}
@@ -0,0 +1,290 @@
+#include "test.hpp"
+
+#include "http.hpp"
+#include "httptokenizer.hpp"
+
+namespace {
+const std::vector<std::string> validRequests = {
+    "GET / HTTP/1.1\r\n\r\n",
+    "GET /index.html HTTP/1.1\r\nHost: example.com\r\n\r\n",
+    "GET /a/../b/./c?x=1&y=2#frag HTTP/1.0\r\nhost:example.com\r\nCONNECTION: close\r\n\r\n",
+    "POST /upload HTTP/1.1\r\nHost: localhost:6969\r\nContent-Length: 11\r\n"
+    "Content-Type: text/plain\r\n\r\nhello world",
+    "HEAD / HTTP/1.1\r\nX-Empty:\r\nX-Spaces: \t  \r\nX-Inner: a \t b\r\n"
+    "X-Weird: !\"{}\x80\xff\r\n\r\n",
+    "GET / HTTP/1.1\r\nAccept-Encoding: gzip\r\naccept-encoding: br\r\nRange: bytes=0-1\r\n"
+    "If-None-Match: \"abc\"\r\nIf-Modified-Since: Wed, 21 Oct 2015 07:28:00 GMT\r\n\r\n",
+    // Headers that cross the 64 byte blocks of the tokenizer
+    "GET /" + std::string(100, 'p') + " HTTP/1.1\r\nUser-Agent: " + std::string(150, 'u')
+        + "\r\n" + std::string(70, 'n') + ": v\r\n!#$%&'*+-.^_`|~09azAZ: " + std::string(63, 'v')
+        + "\r\n\r\n",
+    "DELETE /x HTTP/1.1\r\nHost: a\r\n\r\nGET /pipelined HTTP/1.1\r\n\r\n",
+};
+
+const std::vector<std::string> invalidRequests = {
+    "GET / HTTP/1.1\nHost: a\r\n\r\n", // bare LF after the request line
+    "GET / HTTP/1.1\r\nHost: a\n\r\n", // bare LF after a header line
+    "GET / HTTP/1.1\r\nHost: a\r\n\n", // bare LF at the end
+    "GET / HTTP/1.1\r\nHost: a\r\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost : a\r\n\r\n", // whitespace before the colon
+    "GET / HTTP/1.1\r\n Host: a\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost: a\r\n folded\r\n\r\n", // obsolete line folding
+    "GET / HTTP/1.1\r\n: a\r\n\r\n", // empty name
+    "GET / HTTP/1.1\r\nHost\r\n\r\n", // no colon
+    "GET / HTTP/1.1\r\nHo\"st: a\r\n\r\n",
+    std::string("GET / HTTP/1.1\r\nHost: a\0b\r\n\r\n", 29),
+    "GET / HTTP/1.1\r\nHost: a\x01\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost: a\x7f\r\n\r\n",
+    "GET / HTTP/1.1\x01\r\n\r\n",
+    "FOO / HTTP/1.1\r\n\r\n",
+    "GET / HTTP/2.0\r\n\r\n",
+    "GET  / HTTP/1.1\r\n\r\n",
+    "GET /\r\n\r\n",
+    "\r\n\r\n",
+};
+
+std::vector<TokenizerImpl> getSupportedImpls()
+{
+    const auto prev = getTokenizerImpl();
+    std::vector<TokenizerImpl> impls;
+    for (const auto impl : { TokenizerImpl::Scalar, TokenizerImpl::Ssse3, TokenizerImpl::Avx2 }) {
+        if (setTokenizerImpl(impl)) {
+            impls.push_back(impl);
+        }
+    }
+    setTokenizerImpl(prev);
+    return impls;
+}
+
+// Everything a handler might look at, so two requests can be compared easily
+std::string describe(const Request& req, size_t headerSize)
+{
+    std::string s;
+    s.append(toString(req.method) + "\n");
+    s.append(std::string(req.requestLine) + "\n");
+    s.append(std::string(req.url.path) + "?" + std::string(req.url.query) + "\n");
+    s.append(std::string(req.version) + "\n");
+    for (const auto& [name, value] : req.headers.getEntries()) {
+        s.append("'" + std::string(name) + "' = '" + std::string(value) + "'\n");
+    }
+    for (const auto& value : req.knownHeaders) {
+        s.append(value ? "'" + std::string(*value) + "'\n" : "-\n");
+    }
+    s.append(std::string(req.body) + "\n");
+    s.append(std::to_string(headerSize));
+    return s;
+}
+
+std::optional<std::string> parseOneShot(std::string_view data, size_t* headerSize = nullptr)
+{
+    RequestParser parser;
+    parser.reset();
+    Request req;
+    if (parser.parse(data, req) != RequestParser::Result::Complete) {
+        return std::nullopt;
+    }
+    if (headerSize) {
+        *headerSize = parser.getHeaderSize();
+    }
+    return describe(req, parser.getHeaderSize());
+}
+
+// Passes the first `split` bytes in a different buffer (like the first recv into a provided
+// buffer) and then everything.
+RequestParser::Result parseSplit(std::string_view data, size_t split, Request& req,
+    RequestParser& parser)
+{
+    parser.reset();
+    const std::string first(data.substr(0, split));
+    const auto res = parser.parse(first, req);
+    if (res != RequestParser::Result::Incomplete) {
+        return res;
+    }
+    return parser.parse(data, req);
+}
+}
+
+TEST_CASE("RequestParser parses valid requests")
+{
+    for (const auto& data : validRequests) {
+        setTokenizerImpl(TokenizerImpl::Scalar);
+        const auto expected = parseOneShot(data);
+        TEST_CHECK(expected.has_value());
+        for (const auto impl : getSupportedImpls()) {
+            setTokenizerImpl(impl);
+            TEST_CHECK(parseOneShot(data) == expected);
+        }
+    }
+
+    RequestParser parser;
+    parser.reset();
+    Request req;
+    const std::string_view data = validRequests[3];
+    TEST_CHECK(parser.parse(data, req) == RequestParser::Result::Complete);
+    TEST_CHECK(req.method == Method::Post);
+    TEST_CHECK(req.url.path == "/upload");
+    TEST_CHECK(req.version == "HTTP/1.1");
+    TEST_CHECK(req.headers.getEntries().size() == 3);
+    TEST_CHECK(req.headers.get("content-type") == "text/plain");
+    TEST_CHECK(req.getHeader(KnownHeader::Host) == "localhost:6969");
+    TEST_CHECK(req.getHeader(KnownHeader::ContentLength) == "11");
+    TEST_CHECK(!req.getHeader(KnownHeader::Range));
+    TEST_CHECK(req.body == "hello world");
+    TEST_CHECK(parser.getHeaderSize() == data.size() - 11);
+}
+
+TEST_CASE("RequestParser trims header values")
+{
+    RequestParser parser;
+    parser.reset();
+    Request req;
+    TEST_CHECK(parser.parse(validRequests[4], req) == RequestParser::Result::Complete);
+    TEST_CHECK(req.headers.get("X-Empty") == "");
+    TEST_CHECK(req.headers.get("X-Spaces") == "");
+    TEST_CHECK(req.headers.get("X-Inner") == "a \t b");
+    TEST_CHECK(req.headers.get("X-Weird") == "!\"{}\x80\xff");
+}
+
+TEST_CASE("RequestParser gives the same result for every split")
+{
+    for (const auto impl : getSupportedImpls()) {
+        setTokenizerImpl(impl);
+        for (const auto& data : validRequests) {
+            size_t headerSize = 0;
+            const auto expected = parseOneShot(data, &headerSize);
+            TEST_CHECK(expected.has_value());
+            if (!expected) {
+                continue;
+            }
+            // If the first part contains the whole header, the request would reference it
+            for (size_t split = 0; split < headerSize; ++split) {
+                RequestParser parser;
+                Request req;
+                const auto res = parseSplit(data, split, req, parser);
+                TEST_CHECK(res == RequestParser::Result::Complete);
+                if (res == RequestParser::Result::Complete) {
+                    TEST_CHECK(describe(req, parser.getHeaderSize()) == *expected);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("RequestParser gives the same result byte by byte")
+{
+    for (const auto impl : getSupportedImpls()) {
+        setTokenizerImpl(impl);
+        for (const auto& data : validRequests) {
+            const auto expected = parseOneShot(data);
+            RequestParser parser;
+            parser.reset();
+            Request req;
+            auto res = RequestParser::Result::Incomplete;
+            size_t size = 0;
+            while (res == RequestParser::Result::Incomplete && size < data.size()) {
+                res = parser.parse(std::string_view(data).substr(0, ++size), req);
+            }
+            TEST_CHECK(res == RequestParser::Result::Complete);
+            TEST_CHECK(size == parser.getHeaderSize());
+            if (expected && res == RequestParser::Result::Complete) {
+                // The body is everything after the header in the data passed last, which is
+                // nothing here.
+                TEST_CHECK(req.body.empty());
+                req.body = std::string_view(data).substr(size);
+                TEST_CHECK(describe(req, parser.getHeaderSize()) == *expected);
+            }
+        }
+    }
+}
+
+TEST_CASE("RequestParser rejects invalid requests")
+{
+    for (const auto impl : getSupportedImpls()) {
+        setTokenizerImpl(impl);
+        for (const auto& data : invalidRequests) {
+            TEST_CHECK(!parseOneShot(data));
+            for (size_t split = 0; split <= data.size(); ++split) {
+                RequestParser parser;
+                Request req;
+                TEST_CHECK(parseSplit(data, split, req, parser) == RequestParser::Result::Error);
+            }
+        }
+    }
+}
+
+TEST_CASE("RequestParser handles large headers")
+{
+    // The parser does not limit the size itself. The Session responds with 431 if the header is
+    // still incomplete after maxRequestHeaderSize, so it must stay Incomplete until then.
+    const auto value = std::string(256 * 1024, 'v');
+    const auto data = "GET / HTTP/1.1\r\nX-Large: " + value + "\r\nHost: a\r\n\r\n";
+    for (const auto impl : getSupportedImpls()) {
+        setTokenizerImpl(impl);
+        RequestParser parser;
+        parser.reset();
+        Request req;
+        auto res = RequestParser::Result::Incomplete;
+        size_t size = 0;
+        while (res == RequestParser::Result::Incomplete && size < data.size()) {
+            size = std::min(size + 1000, data.size());
+            res = parser.parse(std::string_view(data).substr(0, size), req);
+            TEST_CHECK(res != RequestParser::Result::Error);
+        }
+        TEST_CHECK(res == RequestParser::Result::Complete);
+        TEST_CHECK(req.headers.get("X-Large") == value);
+        TEST_CHECK(req.getHeader(KnownHeader::Host) == "a");
+        TEST_CHECK(parser.getHeaderSize() == data.size());
+
+        // An invalid character at the very end is still found
+        auto broken = data;
+        broken[broken.size() - 12] = '\x01';
+        TEST_CHECK(!parseOneShot(broken));
+    }
+}
+
+TEST_CASE("Request::getHeader")
+{
+    // Built by hand, so knownHeaders is empty and getHeader has to search headers
+    Request req;
+    req.headers.add("host", "a");
+    req.headers.add("Range", "bytes=0-1");
+    req.headers.add("HOST", "b");
+    TEST_CHECK(!req.knownHeadersResolved);
+    TEST_CHECK(req.getHeader(KnownHeader::Host) == "a");
+    TEST_CHECK(req.getHeader(KnownHeader::Range) == "bytes=0-1");
+    TEST_CHECK(!req.getHeader(KnownHeader::Connection));
+
+    req.resolveKnownHeaders();
+    TEST_CHECK(req.knownHeadersResolved);
+    TEST_CHECK(req.getHeader(KnownHeader::Host) == "a");
+    TEST_CHECK(req.getHeader(KnownHeader::Range) == "bytes=0-1");
+    TEST_CHECK(!req.getHeader(KnownHeader::Connection));
+
+    req.headers.add("Connection", "close");
+    req.resolveKnownHeaders();
+    TEST_CHECK(req.getHeader(KnownHeader::Connection) == "close");
+
+    // Every known header, parsed both ways
+    std::string data = "GET / HTTP/1.1\r\n";
+    for (size_t i = 0; i < static_cast<size_t>(KnownHeader::Count); ++i) {
+        data.append(std::string(toString(static_cast<KnownHeader>(i))) + ": " + std::to_string(i)
+            + "\r\n");
+    }
+    data.append("\r\n");
+    const auto parsed = Request::parse(data);
+    TEST_CHECK(parsed.has_value());
+    RequestParser parser;
+    parser.reset();
+    Request incremental;
+    TEST_CHECK(parser.parse(data, incremental) == RequestParser::Result::Complete);
+    for (size_t i = 0; i < static_cast<size_t>(KnownHeader::Count); ++i) {
+        const auto header = static_cast<KnownHeader>(i);
+        TEST_CHECK(getKnownHeader(toString(header)) == header);
+        if (parsed) {
+            TEST_CHECK(parsed->knownHeadersResolved);
+            TEST_CHECK(parsed->getHeader(header) == std::to_string(i));
+        }
+        TEST_CHECK(incremental.knownHeadersResolved);
+        TEST_CHECK(incremental.getHeader(header) == std::to_string(i));
+    }
+}
@@ -0,0 +1,66 @@
+#include "test.hpp"
+
+#include <string>
+#include <vector>
+
+#include "slotmap.hpp"
+
+TEST_CASE("SlotMap reuses indices in the order they were freed")
+{
+    SlotMap<std::string> map(4);
+    std::vector<size_t> indices;
+    for (size_t i = 0; i < 4; ++i) {
+        indices.push_back(map.insert(std::to_string(i)));
+    }
+    TEST_CHECK((indices == std::vector<size_t> { 0, 1, 2, 3 }));
+    TEST_CHECK(map.size() == 4);
+
+    map.remove(2);
+    map.remove(0);
+    TEST_CHECK(map.size() == 2);
+    TEST_CHECK(!map.contains(2));
+    TEST_CHECK(map.insert("a") == 2);
+    TEST_CHECK(map.insert("b") == 0);
+    TEST_CHECK(map.insert("c") == 4);
+    TEST_CHECK(map[1] == "1");
+    TEST_CHECK(map[2] == "a");
+    TEST_CHECK(map[0] == "b");
+    TEST_CHECK(map[4] == "c");
+}
+
+TEST_CASE("SlotMap free list wraps around and grows")
+{
+    SlotMap<size_t> map(64);
+    for (size_t i = 0; i < 40; ++i) {
+        map.insert(i);
+    }
+    // Go around the ring a few times with a few free indices
+    size_t next = 0;
+    for (size_t i = 0; i < 100; ++i) {
+        map.remove(next);
+        next = map.insert(i);
+        TEST_CHECK(map[next] == i);
+    }
+    TEST_CHECK(map.size() == 40);
+
+    // More free indices than the ring has room for, while it's wrapped
+    map.remove(next);
+    for (size_t i = 0; i < 40; ++i) {
+        if (i != next) {
+            map.remove(i);
+        }
+    }
+    TEST_CHECK(map.size() == 0);
+    std::vector<size_t> reused;
+    for (size_t i = 0; i < 40; ++i) {
+        reused.push_back(map.insert(i));
+    }
+    std::vector<size_t> expected { next };
+    for (size_t i = 0; i < 40; ++i) {
+        if (i != next) {
+            expected.push_back(i);
+        }
+    }
+    TEST_CHECK(reused == expected);
+    TEST_CHECK(map.insert(40) == 40);
+}
@@ -0,0 +1,121 @@
+#include "test.hpp"
+
+#include "ioqueue.hpp"
+#include "timerwheel.hpp"
+
+TEST_CASE("TimerWheel fires timers in order")
+{
+    IoQueue io(64);
+    TimerWheel wheel(io, 5);
+    const auto start = io.getNow();
+    std::vector<std::pair<int, uint64_t>> fired;
+    TimerWheel::Timer a, b, c;
+    wheel.schedule(a, 30, [&] { fired.emplace_back(1, io.getNow()); });
+    wheel.schedule(b, 10, [&] { fired.emplace_back(2, io.getNow()); });
+    wheel.schedule(c, 20, [&] { fired.emplace_back(3, io.getNow()); });
+    TEST_CHECK(wheel.size() == 3);
+    TEST_CHECK(a.isScheduled());
+    io.run();
+    TEST_CHECK(wheel.size() == 0);
+    TEST_CHECK(!a.isScheduled());
+    TEST_CHECK(fired.size() == 3);
+    if (fired.size() == 3) {
+        TEST_CHECK(fired[0].first == 2 && fired[0].second >= start + 10);
+        TEST_CHECK(fired[1].first == 3 && fired[1].second >= start + 20);
+        TEST_CHECK(fired[2].first == 1 && fired[2].second >= start + 30);
+    }
+}
+
+TEST_CASE("TimerWheel cancel and reschedule")
+{
+    IoQueue io(64);
+    TimerWheel wheel(io, 5);
+    std::vector<int> fired;
+    TimerWheel::Timer a, b;
+    wheel.schedule(a, 10, [&] { fired.push_back(1); });
+    wheel.schedule(b, 10, [&] { fired.push_back(2); });
+    wheel.cancel(a);
+    TEST_CHECK(!a.isScheduled());
+    TEST_CHECK(wheel.size() == 1);
+    // Rescheduling replaces the callback
+    wheel.schedule(b, 20, [&] { fired.push_back(3); });
+    TEST_CHECK(wheel.size() == 1);
+    {
+        TimerWheel::Timer destroyed;
+        wheel.schedule(destroyed, 5, [&] { fired.push_back(4); });
+    }
+    TEST_CHECK(wheel.size() == 1);
+    io.run();
+    TEST_CHECK(fired == std::vector<int> { 3 });
+}
+
+TEST_CASE("TimerWheel callbacks can schedule timers")
+{
+    IoQueue io(64);
+    TimerWheel wheel(io, 1);
+    TimerWheel::Timer a;
+    int count = 0;
+    Function<void()> again = [&] {
+        count++;
+        if (count < 5) {
+            wheel.schedule(a, 2, [&] { again(); });
+        }
+    };
+    wheel.schedule(a, 2, [&] { again(); });
+    io.run();
+    TEST_CHECK(count == 5);
+
+    // The timers of a slot fire latest first, so b cancels a, which is due in the same tick
+    TimerWheel::Timer b;
+    bool aFired = false;
+    wheel.schedule(a, 5, [&] { aFired = true; });
+    wheel.schedule(b, 5, [&] { wheel.cancel(a); });
+    io.run();
+    TEST_CHECK(!aFired);
+}
+
+TEST_CASE("TimerWheel cascades timers from higher levels")
+{
+    IoQueue io(64);
+    // 64 ticks per level, so these go into level 1 and have to cascade down before they fire
+    TimerWheel wheel(io, 1);
+    const auto start = io.getNow();
+    std::vector<std::pair<int, uint64_t>> fired;
+    TimerWheel::Timer a, b, c;
+    wheel.schedule(a, 150, [&] { fired.emplace_back(1, io.getNow()); });
+    wheel.schedule(b, 70, [&] { fired.emplace_back(2, io.getNow()); });
+    wheel.schedule(c, 3, [&] { fired.emplace_back(3, io.getNow()); });
+    io.run();
+    TEST_CHECK(fired.size() == 3);
+    if (fired.size() == 3) {
+        TEST_CHECK(fired[0].first == 3 && fired[0].second >= start + 3);
+        TEST_CHECK(fired[1].first == 2 && fired[1].second >= start + 70);
+        TEST_CHECK(fired[2].first == 1 && fired[2].second >= start + 150);
+        // Not much later either
+        TEST_CHECK(fired[2].second < start + 150 + 50);
+    }
+}
+
+TEST_CASE("TimerWheel fires timers before the one it is waiting for")
+{
+    IoQueue io(64);
+    TimerWheel wheel(io, 1);
+    const auto start = io.getNow();
+    std::vector<std::pair<int, uint64_t>> fired;
+    TimerWheel::Timer a, b;
+    // The wheel only wakes up for a, so it has to re-arm for b
+    wheel.schedule(a, 300, [&] { fired.emplace_back(1, io.getNow()); });
+    IoQueue::Timespec ts;
+    IoQueue::setRelativeTimeout(&ts, 10);
+    io.timeout(&ts, false, [&](std::error_code) {
+        wheel.schedule(b, 20, [&] { fired.emplace_back(2, io.getNow()); });
+    });
+    io.run();
+    TEST_CHECK(fired.size() == 2);
+    if (fired.size() == 2) {
+        TEST_CHECK(fired[0].first == 2 && fired[0].second >= start + 30);
+        TEST_CHECK(fired[0].second < start + 30 + 50);
+        TEST_CHECK(fired[1].first == 1 && fired[1].second >= start + 300);
+        TEST_CHECK(fired[1].second < start + 300 + 50);
+    }
+}